@@ -68,7 +68,7 @@ for cf in `ls -1 /etc/vchanger/*.conf` ; do
           fi
           mount $mdir
           [ $? -eq 0 ] || exit 0
-          /usr/bin/vchanger $cf refresh
+          /usr/bin/vchanger --all-configs /etc/vchanger refresh $uuid
           exit 0
         fi
         # Mount under configured MOUNT_DIR
@@ -82,7 +82,7 @@ for cf in `ls -1 /etc/vchanger/*.conf` ; do
         mount $MOUNT_OPTIONS /dev/disk/by-uuid/$uuid $MOUNT_DIR/$uuid &>/dev/null
         if [ $? -eq 0 ] ; then
 		  # On successful mount, cause update slots to be issued in bconsole
-          /usr/bin/vchanger $cf refresh
+          /usr/bin/vchanger --all-configs /etc/vchanger refresh $uuid
 		fi
         exit 0
       fi
@@ -61,13 +61,13 @@ for cf in `ls -1 /etc/vchanger/*.conf` ; do
           # filesystem has UUID entry in fstab, so umount it
           [ -d $mdir ] || exit 0  # mountpoint not found
           umount $mdir &>/dev/null
-          /usr/bin/vchanger $cf refresh
+          /usr/bin/vchanger --all-configs /etc/vchanger refresh $uuid
           exit 0
         fi
         # Unmount from configured MOUNT_DIR
         [ -d $MOUNT_DIR/$uuid ] || exit 0  # mountpoint not found
         umount $MOUNT_DIR/$uuid &>/dev/null
-        /usr/bin/vchanger $cf refresh
+        /usr/bin/vchanger --all-configs /etc/vchanger refresh $uuid
         exit 0
       fi
     fi
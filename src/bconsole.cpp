@@ -46,169 +46,850 @@
 #ifdef HAVE_CTYPE_H
 #include <ctype.h>
 #endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#include <set>
+#include <vector>
 
 #include "compat_defs.h"
 #include "util.h"
 #include "loghandler.h"
 #include "mymutex.h"
 #include "mypopen.h"
+#include "dirclient.h"
+#include "changerstate.h"
 #include "vconf.h"
 #include "bconsole.h"
 
 #ifndef HAVE_WINDOWS_H
 
+/* Seconds allowed for a bconsole session before it is terminated */
+#define BCONSOLE_TIMEOUT 600
+
+/* Prefix of the marker lines echoed by bconsole ahead of each command */
+#define BCONSOLE_MARKER "@@vchanger-cmd-"
+
+/*
+ *  Command issued in a bconsole session, along with its captured output
+ */
+typedef struct _bconsole_cmd_s
+{
+   tString name;      /* short name used in log messages */
+   tString cmd;       /* command text, including any confirmation lines */
+   tString output;    /* output captured for this command */
+   bool done;         /* true if bconsole went on past this command */
+   tString pool;      /* pool of a label command */
+   tString slots;     /* slots of a label command, empty if all slots */
+   int changer;       /* index of the changer the command was issued for */
+} BconsoleCmd;
+
+
 /*
- *  Function to issue command in Bacula console.
- *  Returns zero on success, or errno if there was an error running the command
- *  or a timeout occurred.
+ *  Function to split the output of a bconsole session at the marker lines
+ *  echoed ahead of each command, storing each command's output separately.
+ *  A command is considered done when the marker following it is seen.
  */
-static int issue_bconsole_command(const char *bcmd)
+static void split_bconsole_output(const tString &out, std::vector<BconsoleCmd> &cmds)
 {
-   int pid, rc, n, len, fno_in = -1, fno_out = -1;
-   struct timeval tv;
-   fd_set rfd;
-   tString cmd, tmp;
-   char buf[4096];
+   int cur = -1, n, mlen = strlen(BCONSOLE_MARKER);
+   size_t pos = 0, eol;
+   tString line;
+
+   while (pos < out.size()) {
+      eol = out.find('\n', pos);
+      if (eol == tString::npos) eol = out.size();
+      line = out.substr(pos, eol - pos);
+      pos = eol + 1;
+      if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+      if (line.compare(0, mlen, BCONSOLE_MARKER) == 0) {
+         if (cur >= 0) cmds[cur].done = true;
+         if (line.compare(mlen, tString::npos, "end") == 0) {
+            cur = -1;
+            continue;
+         }
+         n = (int)strtol(line.c_str() + mlen, NULL, 10);
+         if (n >= 0 && n < (int)cmds.size()) cur = n;
+         continue;
+      }
+      if (cur < 0) continue;
+      cmds[cur].output += line;
+      cmds[cur].output += "\n";
+   }
+}
+
+
+/*
+ *  Function to issue a list of commands in a single Bacula console session,
+ *  using the bconsole settings of the changer configuration 'cf'.
+ *  An "@echo" marker line is sent ahead of each command, so that the output
+ *  of each command can be captured separately in cmds[n].output.
+ *  Returns zero if bconsole ran and exited normally, or errno if there was
+ *  an error running bconsole or a timeout occurred. Commands that bconsole
+ *  did not complete have cmds[n].done set false.
+ */
+static int issue_bconsole_commands(const VchangerConfig &cf, std::vector<BconsoleCmd> &cmds)
+{
+   int rc;
+   size_t n;
+   tString cmd, script, tmp;
+   MYPOPEN_RESULT res;
 
    /* Build command line */
-   cmd = conf.bconsole;
-   if (cmd.empty()) return 0;
-   if (!conf.bconsole_config.empty()) {
-      cmd += " -c ";
-      cmd += conf.bconsole_config;
+   cmd = cf.bconsole;
+   if (cmd.empty() || cmds.empty()) return 0;
+   if (!cf.bconsole_config.empty()) {
+      cmd += " -c \"";
+      cmd += cf.bconsole_config;
+      cmd += "\"";
    }
    cmd += " -n -u 30";
-   /* Start bconsole process */
+   /* Build session input */
+   for (n = 0; n < cmds.size(); n++) {
+      cmds[n].output.clear();
+      cmds[n].done = false;
+      tFormat(tmp, "@echo %s%d\n", BCONSOLE_MARKER, (int)n);
+      script += tmp;
+      script += cmds[n].cmd;
+      if (script[script.size() - 1] != '\n') script += "\n";
+      vlog.Debug("sending bconsole command '%s'", cmds[n].cmd.c_str());
+   }
+   tFormat(tmp, "@echo %send\n", BCONSOLE_MARKER);
+   script += tmp;
+
+   /* Run bconsole, sending the commands to its stdin while capturing its output */
    vlog.Debug("running '%s'", cmd.c_str());
-   pid = mypopen_raw(cmd.c_str(), &fno_in, &fno_out, NULL);
-   if (pid < 0) {
-      rc = errno;
+   rc = mypopen_run(cmd, script, BCONSOLE_TIMEOUT, res);
+   if (rc) {
       vlog.Error("bconsole run failed errno=%d", rc);
       errno = rc;
       return rc;
    }
-   /* Wait for bconsole to accept input */
-   tv.tv_sec = 30;
-   tv.tv_usec = 0;
-   FD_ZERO(&rfd);
-   FD_SET(fno_in, &rfd);
-   rc = select(fno_in + 1, NULL, &rfd, NULL, &tv);
-   if (rc == 0) {
-      vlog.Error("timeout waiting to send command to bconsole");
-      close(fno_in);
-      close(fno_out);
-      errno = ETIMEDOUT;
+   split_bconsole_output(res.out, cmds);
+   if (!res.err.empty()) vlog.Debug("bconsole stderr:\n%s", res.err.c_str());
+   if (res.timed_out) {
+      vlog.Error("bconsole: timeout after %ld ms", res.elapsed_ms);
       return ETIMEDOUT;
    }
-   if (rc < 0) {
-      rc = errno;
-      vlog.Error("errno=%d waiting to send command to bconsole", rc);
-      close(fno_in);
-      close(fno_out);
-      errno = rc;
-      return rc;
+   if (res.term_signal) {
+      vlog.Error("abnormal exit of bconsole process (signal %d)", res.term_signal);
+      return EPIPE;
    }
-   /* Send command to bconsole's stdin */
-   vlog.Debug("sending bconsole command '%s'", bcmd);
-   len = strlen(bcmd);
-   n = 0;
-   while (n < len) {
-      rc = write(fno_in, bcmd + n, len - n);
-      if (rc < 0) {
-         rc = errno;
-         vlog.Error("send to bconsole's stdin failed errno=%d", rc);
-         close(fno_in);
-         close(fno_out);
-         errno = rc;
-         return rc;
+   if (res.exit_code) {
+      vlog.Error("bconsole: exited with rc=%d", res.exit_code);
+      return res.exit_code;
+   }
+   vlog.Debug("bconsole: bconsole terminated normally in %ld ms", res.elapsed_ms);
+   return 0;
+}
+
+
+/*
+ *  Function to issue a list of commands over a single connection to the
+ *  Director using the native console client, without running bconsole.
+ *  The Director is found in the bconsole config file of changer 'cf'.
+ *  The first line of each command is the command itself and any further
+ *  lines are the answers to send when the Director prompts for input.
+ *  Returns zero if the commands were issued, with cmds[n].done set for each
+ *  command that succeeded. Returns -1 if the Director could not be reached,
+ *  in which case no command was issued.
+ */
+static int issue_director_commands(const VchangerConfig &cf, std::vector<BconsoleCmd> &cmds)
+{
+   size_t n, p, eol;
+   tString line;
+   tStringList answers;
+   DirectorClient dir;
+
+   for (n = 0; n < cmds.size(); n++) {
+      cmds[n].output.clear();
+      cmds[n].done = false;
+   }
+   if (dir.ReadConfig(cf.bconsole_config.c_str()) || dir.Connect(30)) {
+      vlog.Error("native console: %s", dir.GetErrorMsg());
+      return -1;
+   }
+   for (n = 0; n < cmds.size(); n++) {
+      /* Split command from its answers */
+      answers.clear();
+      line.clear();
+      for (p = 0; p < cmds[n].cmd.size(); p = eol + 1) {
+         eol = cmds[n].cmd.find('\n', p);
+         if (eol == tString::npos) eol = cmds[n].cmd.size();
+         if (p == 0) line = cmds[n].cmd.substr(0, eol);
+         else if (eol > p) answers.push_back(cmds[n].cmd.substr(p, eol - p));
       }
-      n += rc;
+      vlog.Debug("sending director command '%s'", line.c_str());
+      cmds[n].done = (dir.Command(line.c_str(), answers, cmds[n].output) == 0);
+      if (!cmds[n].done) vlog.Error("native console: %s", dir.GetErrorMsg());
+      if (!dir.IsConnected()) break;
    }
-   if (write(fno_in, "\n", 1) != 1) {
-      rc = errno;
-      vlog.Error("send to bconsole's stdin failed errno=%d", rc);
-      close(fno_in);
-      close(fno_out);
-      errno = rc;
-      return rc;
+   dir.Close();
+   return 0;
+}
+
+
+/*
+ *  Function to parse the output of a label barcodes command, appending a
+ *  line to 'vols' for each volume Bacula reported as labeled, as already
+ *  in the catalog, or as failed. The number of volumes of each kind is
+ *  returned in 'labeled', 'exists', and 'failed'.
+ */
+static void parse_label_output(const BconsoleCmd &bc, tString &vols, int &labeled,
+      int &exists, int &failed)
+{
+   int slot;
+   size_t pos = 0, eol;
+   char vol[256];
+   const char *status;
+   tString line, tmp;
+
+   labeled = exists = failed = 0;
+   while (pos < bc.output.size()) {
+      eol = bc.output.find('\n', pos);
+      if (eol == tString::npos) eol = bc.output.size();
+      line = bc.output.substr(pos, eol - pos);
+      pos = eol + 1;
+      slot = 0;
+      if (sscanf(line.c_str(), "Catalog record for Volume \"%255[^\"]\", Slot %d", vol, &slot) == 2) {
+         status = "labeled";
+         ++labeled;
+      } else if (sscanf(line.c_str(), "Media record for Slot %d Volume \"%255[^\"]\"", &slot, vol) == 2) {
+         status = "exists";
+         ++exists;
+      } else if (sscanf(line.c_str(), "Label command failed for Volume %255s", vol) == 1) {
+         if (vol[0] && vol[strlen(vol) - 1] == '.') vol[strlen(vol) - 1] = 0;
+         status = "failed";
+         ++failed;
+      } else continue;
+      tFormat(tmp, "volume label=\"%s\" slot=%d pool=\"%s\" status=%s\n", vol, slot,
+            bc.pool.c_str(), status);
+      vols += tmp;
    }
+}
 
-   /* Wait for bconsole process to finish */
-   close(fno_in);
-   pid = waitpid(pid, &rc, 0);
-   if (!WIFEXITED(rc)) {
-      vlog.Error("abnormal exit of bconsole process");
-      close(fno_out);
-      return EPIPE;
+
+/*
+ *  Function to write a machine-readable summary of the label barcodes
+ *  commands issued for changer number 'ndx', whose configuration is 'cf',
+ *  to the file LABEL_SUMMARY_FILE in the changer's work directory.
+ *  The summary has one "label" line per command giving its pool, slots,
+ *  status (ok, partial, or failed), and volume counts, followed by one
+ *  "volume" line per volume reported by Bacula. The file is replaced
+ *  atomically, so readers never see a partial summary.
+ */
+static void write_label_summary(const VchangerConfig &cf, int ndx, const std::vector<BconsoleCmd> &cmds)
+{
+   size_t n;
+   int labeled, exists, failed;
+   FILE *fs;
+   const char *status;
+   tString path(cf.work_dir), tmp_path, vols, text, tmp;
+
+   for (n = 0; n < cmds.size(); n++) {
+      if (cmds[n].changer != ndx || cmds[n].pool.empty()) continue;
+      parse_label_output(cmds[n], vols, labeled, exists, failed);
+      if (!cmds[n].done) status = "failed";
+      else if (failed) status = "partial";
+      else status = "ok";
+      tFormat(tmp, "label pool=\"%s\" slots=%s status=%s labeled=%d exists=%d failed=%d\n",
+            cmds[n].pool.c_str(), cmds[n].slots.empty() ? "all" : cmds[n].slots.c_str(),
+            status, labeled, exists, failed);
+      text += tmp;
+      vlog.Info("label barcodes pool '%s' slots %s: %s, %d labeled, %d existing, %d failed",
+            cmds[n].pool.c_str(), cmds[n].slots.empty() ? "all" : cmds[n].slots.c_str(),
+            status, labeled, exists, failed);
+   }
+   if (text.empty()) return;
+   tFormat(tmp, "storage=\"%s\" time=%ld\n", cf.storage_name.c_str(), (long)time(NULL));
+   text = tmp + text + vols;
+
+   if (!path.empty() && path[path.size() - 1] != DIR_DELIM_C) path += DIR_DELIM;
+   path += LABEL_SUMMARY_FILE;
+   tmp_path = path + ".tmp";
+   fs = fopen(tmp_path.c_str(), "w");
+   if (!fs) {
+      vlog.Error("errno=%d creating %s", errno, tmp_path.c_str());
+      return;
    }
-   if (WEXITSTATUS(rc)) {
-      vlog.Error("bconsole: exited with rc=%d", WEXITSTATUS(rc));
-      close(fno_out);
-      return WEXITSTATUS(rc);
+   if (fwrite(text.c_str(), 1, text.size(), fs) != text.size() || fclose(fs)) {
+      vlog.Error("errno=%d writing %s", errno, tmp_path.c_str());
+      unlink(tmp_path.c_str());
+      return;
    }
+   if (rename(tmp_path.c_str(), path.c_str())) {
+      vlog.Error("errno=%d renaming %s", errno, tmp_path.c_str());
+      unlink(tmp_path.c_str());
+   }
+}
+
 
-   /* Read stdout from bconsole */
-   vlog.Debug("bconsole: bconsole terminated normally");
-   memset(buf, 0, sizeof(buf));
-   tmp.clear();
-   rc = read(fno_out, buf, 4095);
-   while (rc > 0) {
-      buf[rc] = 0;
-      tmp += buf;
-      rc = read(fno_out, buf, 4095);
+/*
+ *  Function to append to 'cmds' the commands needed to perform update slots
+ *  and/or label new volumes using barcodes into each of the pools given for
+ *  changer number 'ndx', whose configuration is 'cf'. If 'slot_list' is not
+ *  empty, then only the slots it lists, of the form "1-5,9", are updated.
+ *  Likewise, each pool's label command is limited to the slots listed for
+ *  that pool. Update slots precedes labeling so that Bacula knows the new
+ *  volumes.
+ */
+static void add_changer_commands(const VchangerConfig &cf, int ndx, bool update_slots,
+      const tString &slot_list, const LabelPoolMap &label_pools, std::vector<BconsoleCmd> &cmds)
+{
+   BconsoleCmd bc;
+   LabelPoolMap::const_iterator p;
+
+   bc.changer = ndx;
+   if (update_slots) {
+      bc.name = "update slots";
+      if (slot_list.empty()) {
+         tFormat(bc.cmd, "update slots storage=\"%s\" drive=\"0\"", cf.storage_name.c_str());
+      } else {
+         tFormat(bc.cmd, "update slots=%s storage=\"%s\" drive=\"0\"", slot_list.c_str(),
+               cf.storage_name.c_str());
+      }
+      cmds.push_back(bc);
    }
-   if (rc < 0) {
-      rc = errno;
-      vlog.Error("errno=%d reading bconsole stdout", rc);
-      close(fno_out);
-      errno = rc;
-      return rc;
+   for (p = label_pools.begin(); p != label_pools.end(); p++) {
+      bc.name = "label barcodes";
+      bc.pool = p->first;
+      bc.slots = p->second;
+      if (bc.slots.empty()) {
+         tFormat(bc.cmd, "label storage=\"%s\" pool=\"%s\" barcodes\nyes\nyes\n",
+               cf.storage_name.c_str(), bc.pool.c_str());
+      } else {
+         tFormat(bc.cmd, "label storage=\"%s\" pool=\"%s\" slots=%s barcodes\nyes\nyes\n",
+               cf.storage_name.c_str(), bc.pool.c_str(), bc.slots.c_str());
+      }
+      cmds.push_back(bc);
    }
-   close(fno_out);
-   vlog.Debug("bconsole output:\n%s", tmp.c_str());
+}
 
-   return 0;
+
+/*
+ *  Function to issue the commands of one or more changers in a single
+ *  Bacula console session. All of the changers must share the same console
+ *  settings. The results of the label commands are written to the label
+ *  summary file of each changer.
+ */
+static void issue_changer_commands(const std::vector<VchangerConfig> &changers,
+      std::vector<BconsoleCmd> &cmds)
+{
+   size_t n;
+   const VchangerConfig *cf;
+
+   if (cmds.empty()) return; /* Nothing to do */
+   cf = &changers[cmds[0].changer];
+   if (!cf->native_console || issue_director_commands(*cf, cmds) < 0) issue_bconsole_commands(*cf, cmds);
+   for (n = 0; n < cmds.size(); n++) {
+      cf = &changers[cmds[n].changer];
+      vlog.Debug("bconsole %s output:\n%s", cmds[n].name.c_str(), cmds[n].output.c_str());
+      if (cmds[n].done) {
+         vlog.Info("bconsole %s command success for %s", cmds[n].name.c_str(), cf->storage_name.c_str());
+      } else {
+         vlog.Error("WARNING! '%s' needed in bconsole for %s", cmds[n].name.c_str(),
+               cf->storage_name.c_str());
+      }
+   }
+   for (n = 0; n < changers.size(); n++) write_label_summary(changers[n], (int)n, cmds);
 }
 
 
 /*
- *  Function to fork a new process and issue commands in Bacula console to
- *  perform update slots and/or label new volumes using barcodes.
+ *  Function to issue commands in Bacula console to perform update slots
+ *  and/or label new volumes using barcodes into each of the pools given.
+ *  If 'slot_list' is not empty, then only the slots it lists, of the form
+ *  "1-5,9", are updated. Likewise, each pool's label command is limited to
+ *  the slots listed for that pool. All commands are sent in a single
+ *  bconsole session, and the results of the label commands are written to
+ *  the label summary file.
  */
-void IssueBconsoleCommands(bool update_slots, bool label_barcodes)
+void IssueBconsoleCommands(bool update_slots, const tString &slot_list, const LabelPoolMap &label_pools)
 {
-   tString cmd;
+   std::vector<VchangerConfig> changers(1, conf);
+   std::vector<BconsoleCmd> cmds;
 
-   /* Check if update needed */
-   if (!update_slots && !label_barcodes) return; /* Nothing to do */
+   add_changer_commands(conf, 0, update_slots, slot_list, label_pools, cmds);
+   issue_changer_commands(changers, cmds);
+}
 
-   /* Perform update slots command in bconsole */
-   if (update_slots) {
-      tFormat(cmd, "update slots storage=\"%s\" drive=\"0\"", conf.storage_name.c_str());
-      if(issue_bconsole_command(cmd.c_str())) {
-         vlog.Error("WARNING! 'update slots' needed in bconsole");
+
+/*
+ *  Function to build the path of the bconsole request queue file of the
+ *  changer whose configuration is 'cf'.
+ */
+static tString bconsole_queue_path(const VchangerConfig &cf)
+{
+   tString path(cf.work_dir);
+   if (!path.empty() && path[path.size() - 1] != DIR_DELIM_C) path += DIR_DELIM;
+   path += BCONSOLE_QUEUE_FILE;
+   return path;
+}
+
+
+/*
+ *  Function to wait until no request has been added to the queue for
+ *  'delay' seconds, so that requests made by several vchanger invocations
+ *  in quick succession are issued together. To avoid starving the queue
+ *  when requests keep arriving, waits no longer than 'max_wait' seconds.
+ */
+static void wait_queue_quiet(const char *qpath, time_t delay, time_t max_wait)
+{
+   struct stat st;
+   time_t start = time(NULL), now, age;
+
+   for (;;) {
+      if (stat(qpath, &st) || st.st_size == 0) return;
+      now = time(NULL);
+      age = now - st.st_mtime;
+      if (age >= delay || now - start >= max_wait) return;
+      sleep(delay - age);
+   }
+}
+
+
+/*
+ *  Function to add to 'slots' the slots of a queued slot list of the form
+ *  "1-5,9/60", where the number following the slash is the number of slots
+ *  the changer had when the request was queued. The number is stored in
+ *  'num_slots', or zero if the list omits it.
+ *  Returns true on success, or false if the list is invalid.
+ */
+static bool parse_queued_slots(const char *list, SlotRangeSet &slots, int &num_slots)
+{
+   tString s(list);
+   size_t n = s.find('/');
+
+   num_slots = 0;
+   if (n != tString::npos) {
+      num_slots = atoi(s.c_str() + n + 1);
+      s.erase(n);
+   }
+   return slots.Parse(s.c_str());
+}
+
+
+/*
+ *  Function to determine if the merged slot list 'slots' should be given
+ *  to bconsole, or if all slots should be updated or labeled instead,
+ *  because the list is scattered over too many ranges or covers more than
+ *  half of the changer's 'num_slots' slots. This matches the fallback of
+ *  DiskChanger::UpdateSlotList().
+ */
+static bool use_slot_list(const SlotRangeSet &slots, int num_slots)
+{
+   if (slots.NumRanges() > MAX_UPDATE_RANGES) return false;
+   return num_slots < 1 || slots.NumSlots() * 2 <= num_slots;
+}
+
+
+/*
+ *  Function to read and empty the request queue. Each line of the queue
+ *  is either "update", "update <slot list>", "label <pool>", or
+ *  "label slots=<slot list> <pool>", where a slot list is of the form
+ *  "1-5,9/60" as described for parse_queued_slots(). Requests are merged
+ *  so that update slots is issued at most once and label barcodes at most
+ *  once per pool. The slot lists of update requests are merged into
+ *  'slot_list', which is left empty if all slots must be updated. The slot
+ *  lists of each pool's label requests are merged in the same way into
+ *  'label_pools'. The changer's number of slots is taken from the latest
+ *  request giving it.
+ *  Returns the number of requests read, or -1 if the queue could not be
+ *  emptied.
+ */
+static int take_queued_requests(const char *qpath, bool &update_slots, tString &slot_list,
+      LabelPoolMap &label_pools)
+{
+   int count = 0, num_slots = 0, n;
+   FILE *fs;
+   char line[4096], *pool;
+   size_t len;
+   bool update_all = false;
+   SlotRangeSet slots;
+   std::map<tString, SlotRangeSet> label_slots;
+   std::map<tString, SlotRangeSet>::iterator ls;
+   std::set<tString> label_all;
+   std::set<tString>::iterator la;
+
+   update_slots = false;
+   slot_list.clear();
+   label_pools.clear();
+   fs = fopen(qpath, "r+");
+   if (!fs) return 0;
+   while (fgets(line, sizeof(line), fs)) {
+      len = strlen(line);
+      while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = 0;
+      if (!len) continue;
+      ++count;
+      if (strcmp(line, "update") == 0) {
+         update_slots = true;
+         update_all = true;
+      } else if (strncmp(line, "update ", 7) == 0) {
+         update_slots = true;
+         if (!parse_queued_slots(line + 7, slots, n)) update_all = true;
+         if (n > 0) num_slots = n;
+      } else if (strncmp(line, "label slots=", 12) == 0 && (pool = strchr(line + 12, ' ')) && pool[1]) {
+         *pool++ = 0;
+         if (!parse_queued_slots(line + 12, label_slots[tString(pool)], n)) label_all.insert(tString(pool));
+         if (n > 0) num_slots = n;
+      } else if (strncmp(line, "label ", 6) == 0 && line[6]) {
+         label_all.insert(tString(line + 6));
       } else {
-          vlog.Info("bconsole update slots command success");
+         vlog.Error("ignoring invalid bconsole queue entry '%s'", line);
+      }
+   }
+   if (update_slots && !update_all && use_slot_list(slots, num_slots)) {
+      slot_list = slots.Format();
+   }
+   for (ls = label_slots.begin(); ls != label_slots.end(); ls++) {
+      if (label_all.count(ls->first) || !use_slot_list(ls->second, num_slots)) {
+         label_pools[ls->first] = tString();
+      } else {
+         label_pools[ls->first] = ls->second.Format();
+      }
+   }
+   for (la = label_all.begin(); la != label_all.end(); la++) {
+      label_pools[*la] = tString();
+   }
+   if (ftruncate(fileno(fs), 0)) {
+      vlog.Error("errno=%d truncating %s", errno, qpath);
+      count = -1;
+   }
+   fclose(fs);
+   return count;
+}
+
+
+/*
+ *  Function to put merged requests taken by take_queued_requests() back
+ *  into the request queue, so that they are not lost when bconsole cannot
+ *  be run. The merged slot lists have already been checked by
+ *  use_slot_list(), so they are queued without the number of slots.
+ *  If the requests cannot be queued, warns that the bconsole commands are
+ *  needed.
+ */
+static void requeue_requests(const char *qpath, void *queue_mux, bool update_slots,
+      const tString &slot_list, const LabelPoolMap &label_pools)
+{
+   int fd, rc = 0;
+   tString req, line;
+   LabelPoolMap::const_iterator lp;
+
+   if (update_slots) {
+      req = "update";
+      if (!slot_list.empty()) {
+         req += " ";
+         req += slot_list;
+      }
+      req += "\n";
+   }
+   for (lp = label_pools.begin(); lp != label_pools.end(); lp++) {
+      if (lp->second.empty()) tFormat(line, "label %s\n", lp->first.c_str());
+      else tFormat(line, "label slots=%s %s\n", lp->second.c_str(), lp->first.c_str());
+      req += line;
+   }
+   if (req.empty()) return;
+   if (mymutex_lock(queue_mux, 300)) {
+      vlog.Error("ERROR! timeout waiting for bconsole queue lock");
+      rc = ETIMEDOUT;
+   } else {
+      fd = open(qpath, O_WRONLY | O_APPEND | O_CREAT, 0660);
+      if (fd < 0 || write(fd, req.c_str(), req.size()) != (ssize_t)req.size()) {
+         rc = errno;
+         vlog.Error("errno=%d writing bconsole queue %s", rc, qpath);
+      }
+      if (fd >= 0) close(fd);
+      mymutex_unlock(queue_mux);
+   }
+   if (rc) {
+      if (update_slots) vlog.Error("WARNING! 'update slots' needed in bconsole");
+      if (!label_pools.empty()) vlog.Error("WARNING! 'label barcodes' needed in bconsole");
+   }
+}
+
+
+/*
+ *  Changer served by a bconsole worker, along with its named mutexes
+ */
+typedef struct _worker_changer_s
+{
+   tString qpath;       /* path of the changer's request queue */
+   void *worker_mux;    /* held while this worker serves the changer */
+   void *queue_mux;     /* guards the request queue */
+   void *bconsole_mux;  /* held while bconsole runs commands for the changer */
+   bool active;         /* true while this worker serves the changer */
+} WorkerChanger;
+
+
+/*
+ *  Function to stop serving a changer, releasing its named mutexes.
+ */
+static void release_worker_changer(WorkerChanger &wc)
+{
+   if (wc.active) mymutex_unlock(wc.worker_mux);
+   wc.active = false;
+   if (wc.bconsole_mux) mymutex_destroy(wc.bconsole_mux);
+   if (wc.queue_mux) mymutex_destroy(wc.queue_mux);
+   if (wc.worker_mux) mymutex_destroy(wc.worker_mux);
+   wc.bconsole_mux = wc.queue_mux = wc.worker_mux = NULL;
+}
+
+
+/*
+ *  Function run by the background worker process. Issues the queued bconsole
+ *  requests of each of the changers given, merging all requests pending at
+ *  that time, until their queues are empty. The requests of all changers
+ *  are issued in a single bconsole session, so the changers must share the
+ *  same console settings. Only one worker per changer runs at a time, so
+ *  changers already served by another worker are skipped.
+ */
+static void run_bconsole_worker(const std::vector<VchangerConfig> &changers)
+{
+   int count, active = 0;
+   size_t n;
+   bool update_slots;
+   tString slot_list;
+   LabelPoolMap label_pools;
+   time_t max_wait;
+   std::vector<WorkerChanger> wc(changers.size());
+   std::vector<bool> locked(changers.size());
+   std::vector<BconsoleCmd> cmds;
+   VchangerConfig saved_conf(conf);
+
+   for (n = 0; n < changers.size(); n++) {
+      /* Named mutexes are created in the work directory of the global conf */
+      conf = changers[n];
+      wc[n].qpath = bconsole_queue_path(changers[n]);
+      wc[n].queue_mux = wc[n].bconsole_mux = NULL;
+      wc[n].active = false;
+      wc[n].worker_mux = mymutex_create(changers[n].storage_name.c_str(), "bconsole-worker");
+      if (!wc[n].worker_mux) continue;
+      if (mymutex_lock(wc[n].worker_mux, 0)) {
+         /* Another worker is running and will see the new requests */
+         release_worker_changer(wc[n]);
+         continue;
+      }
+      wc[n].active = true;
+      wc[n].queue_mux = mymutex_create(changers[n].storage_name.c_str(), "bconsole-queue");
+      wc[n].bconsole_mux = mymutex_create(changers[n].storage_name.c_str(), "bconsole");
+      if (!wc[n].queue_mux || !wc[n].bconsole_mux) {
+         vlog.Error("ERROR! failed to create named mutex errno=%d", errno);
+         release_worker_changer(wc[n]);
+         continue;
       }
+      ++active;
    }
+   conf = saved_conf;
+   if (!active) return;
+   vlog.Debug("bconsole worker started pid=%d", getpid());
 
-   /* Perform label barcodes command in bconsole */
+   while (active) {
+      cmds.clear();
+      for (n = 0; n < changers.size(); n++) {
+         locked[n] = false;
+         if (!wc[n].active) continue;
+         max_wait = changers[n].bconsole_delay * 5;
+         if (max_wait < 30) max_wait = 30;
+         wait_queue_quiet(wc[n].qpath.c_str(), changers[n].bconsole_delay, max_wait);
+         if (mymutex_lock(wc[n].queue_mux, 300)) {
+            vlog.Error("ERROR! timeout waiting for bconsole queue lock");
+            release_worker_changer(wc[n]);
+            --active;
+            continue;
+         }
+         count = take_queued_requests(wc[n].qpath.c_str(), update_slots, slot_list, label_pools);
+         if (count <= 0) {
+            /* Give up the worker role while still holding the queue lock, so
+             * that a request queued after this point starts a new worker. If
+             * the queue could not be emptied, its requests are left for a
+             * later worker rather than issued again on every pass. */
+            mymutex_unlock(wc[n].worker_mux);
+            wc[n].active = false;
+            mymutex_unlock(wc[n].queue_mux);
+            release_worker_changer(wc[n]);
+            --active;
+            continue;
+         }
+         mymutex_unlock(wc[n].queue_mux);
+         vlog.Info("bconsole worker merged %d queued requests for %s", count,
+               changers[n].storage_name.c_str());
+         /* Hold the bconsole mutex while bconsole runs, so that vchanger
+          * instances invoked by bconsole do not queue further requests */
+         if (mymutex_lock(wc[n].bconsole_mux, 300)) {
+            vlog.Error("ERROR! timeout waiting for bconsole mutex");
+            requeue_requests(wc[n].qpath.c_str(), wc[n].queue_mux, update_slots, slot_list,
+                  label_pools);
+            continue;
+         }
+         locked[n] = true;
+         add_changer_commands(changers[n], (int)n, update_slots, slot_list, label_pools, cmds);
+      }
+      issue_changer_commands(changers, cmds);
+      for (n = 0; n < changers.size(); n++) {
+         if (locked[n]) mymutex_unlock(wc[n].bconsole_mux);
+      }
+   }
+   vlog.Debug("bconsole worker finished pid=%d", getpid());
+}
+
+
+/*
+ *  Function to start the background worker for the changers given as a
+ *  daemonized grandchild process, so that the caller does not wait for
+ *  bconsole and the worker is not left as a zombie. The worker keeps only
+ *  the log file open, so that it does not hold locks or sockets belonging
+ *  to the caller. If started by root, the worker runs as the user and group
+ *  of the first changer. If the worker process cannot be created, the
+ *  queues are processed by the caller.
+ */
+static void start_bconsole_worker(const std::vector<VchangerConfig> &changers)
+{
+   pid_t pid;
+   int fd, rc, status, log_fd;
+   long max_fd;
+
+   fflush(NULL);
+   pid = fork();
+   if (pid < 0) {
+      vlog.Error("errno=%d starting bconsole worker - issuing commands now", errno);
+      run_bconsole_worker(changers);
+      return;
+   }
+   if (pid > 0) {
+      while (waitpid(pid, &status, 0) < 0 && errno == EINTR) ;
+      return;
+   }
+   /* First child */
+   setsid();
+   pid = fork();
+   if (pid != 0) _exit(pid < 0 ? 1 : 0);
+   /* Worker process */
+   log_fd = vlog.LogFileno();
+   max_fd = sysconf(_SC_OPEN_MAX);
+   if (max_fd < 0 || max_fd > 65536) max_fd = 65536;
+   for (fd = 3; fd < max_fd; fd++) {
+      if (fd != log_fd) close(fd);
+   }
+   fd = open("/dev/null", O_RDWR);
+   if (fd >= 0) {
+      dup2(fd, STDIN_FILENO);
+      if (log_fd != STDOUT_FILENO) dup2(fd, STDOUT_FILENO);
+      if (log_fd != STDERR_FILENO) dup2(fd, STDERR_FILENO);
+      if (fd > STDERR_FILENO) close(fd);
+   }
+   rc = drop_privs(changers[0].user.c_str(), changers[0].group.c_str());
+   if (rc) {
+      vlog.Error("Error %d attempting to run bconsole worker as user '%s'", rc, changers[0].user.c_str());
+      _exit(1);
+   }
+   run_bconsole_worker(changers);
+   fflush(NULL);
+   _exit(0);
+}
+
+
+/*
+ *  Function to start a single background worker that issues the queued
+ *  requests of all of the changers given in one bconsole session. The
+ *  changers must share the same console settings and user.
+ */
+void StartBconsoleWorker(const std::vector<VchangerConfig> &changers)
+{
+   if (!changers.empty()) start_bconsole_worker(changers);
+}
+
+
+/*
+ *  Function to queue requests to update slots and/or label new volumes
+ *  into the default pool, and to start a background worker to issue them.
+ *  If 'slot_list' is not empty, then it lists the only slots, in the form
+ *  "1-5,9", that need to be updated. Likewise, if 'label_list' is not empty,
+ *  then it lists the only slots that need to be labeled. The changer's
+ *  number of slots, 'num_slots', is queued with the slot lists so that the
+ *  worker can decide whether merged lists are worth using. If
+ *  'start_worker' is false, the requests are left for a later call to
+ *  StartBconsoleWorker().
+ *  Returns immediately without waiting for bconsole.
+ *  On success returns zero, else returns errno.
+ */
+int QueueBconsoleCommands(bool update_slots, const tString &slot_list, bool label_barcodes,
+      const tString &label_list, int num_slots, bool start_worker)
+{
+   int fd, rc = 0;
+   void *queue_mux;
+   tString req, list, qpath(bconsole_queue_path(conf));
+
+   if (!update_slots && !label_barcodes) return 0; /* Nothing to do */
+   if (update_slots) {
+      req = "update";
+      if (!slot_list.empty()) {
+         tFormat(list, " %s/%d", slot_list.c_str(), num_slots);
+         req += list;
+      }
+      req += "\n";
+   }
    if (label_barcodes) {
-      tFormat(cmd, "label storage=\"%s\" pool=\"%s\" barcodes\nyes\nyes\n", conf.storage_name.c_str(),
-            conf.def_pool.c_str());
-      if (issue_bconsole_command(cmd.c_str())) {
-         vlog.Error("WARNING! 'label barcodes' needed in bconsole");
-      } else {
-          vlog.Info("bconsole label barcodes command success");
+      req += "label ";
+      if (!label_list.empty()) {
+         tFormat(list, "slots=%s/%d ", label_list.c_str(), num_slots);
+         req += list;
       }
+      req += conf.def_pool;
+      req += "\n";
+   }
+
+   queue_mux = mymutex_create(conf.storage_name.c_str(), "bconsole-queue");
+   if (!queue_mux) {
+      rc = errno;
+      vlog.Error("ERROR! failed to create named mutex errno=%d", rc);
+      return rc;
+   }
+   if (mymutex_lock(queue_mux, 300)) {
+      vlog.Error("ERROR! timeout waiting for bconsole queue lock");
+      mymutex_destroy(queue_mux);
+      return ETIMEDOUT;
+   }
+   fd = open(qpath.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0660);
+   if (fd < 0 || write(fd, req.c_str(), req.size()) != (ssize_t)req.size()) {
+      rc = errno;
+      vlog.Error("errno=%d writing bconsole queue %s", rc, qpath.c_str());
+   }
+   if (fd >= 0) close(fd);
+   mymutex_unlock(queue_mux);
+   mymutex_destroy(queue_mux);
+   if (rc) {
+      if (update_slots) vlog.Error("WARNING! 'update slots' needed in bconsole");
+      if (label_barcodes) vlog.Error("WARNING! 'label barcodes' needed in bconsole");
+      return rc;
+   }
+   vlog.Debug("queued bconsole request: %s%s%s", update_slots ? "update " : "",
+         update_slots && !slot_list.empty() ? slot_list.c_str() : "", label_barcodes ? " label" : "");
+   if (start_worker) {
+      std::vector<VchangerConfig> changers(1, conf);
+      start_bconsole_worker(changers);
    }
+   return 0;
 }
 
 #else
 /*
  *  Bconsole interaction is not currently supported on Windows
  */
-void IssueBconsoleCommands(bool update_slots, bool label_barcodes)
+void IssueBconsoleCommands(bool update_slots, const tString &slot_list, const LabelPoolMap &label_pools)
+{
+   return;
+}
+
+int QueueBconsoleCommands(bool update_slots, const tString &slot_list, bool label_barcodes,
+      const tString &label_list, int num_slots, bool start_worker)
+{
+   return 0;
+}
+
+void StartBconsoleWorker(const std::vector<VchangerConfig> &changers)
 {
    return;
 }
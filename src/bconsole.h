@@ -24,6 +24,21 @@
 #ifndef BCONSOLE_H_
 #define BCONSOLE_H_
 
-void IssueBconsoleCommands(bool update_slots, bool label_barcodes);
+#include <map>
+#include <vector>
+#include "tstring.h"
+#include "vconf.h"
+
+#define BCONSOLE_QUEUE_FILE "bconsole.queue"
+#define LABEL_SUMMARY_FILE "label.summary"
+
+/* Pools to label volumes into, each mapped to the list of slots, of the
+ * form "1-5,9", to label. An empty slot list means all slots. */
+typedef std::map<tString, tString> LabelPoolMap;
+
+void IssueBconsoleCommands(bool update_slots, const tString &slot_list, const LabelPoolMap &label_pools);
+int QueueBconsoleCommands(bool update_slots, const tString &slot_list, bool label_barcodes,
+      const tString &label_list, int num_slots, bool start_worker = true);
+void StartBconsoleWorker(const std::vector<VchangerConfig> &changers);
 
 #endif /* BCONSOLE_H_ */
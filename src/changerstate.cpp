@@ -50,6 +50,18 @@
 #ifdef HAVE_DIRENT_H
 #include <dirent.h>
 #endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #ifdef HAVE_CTYPE_H
 #include <ctype.h>
 #endif
@@ -126,9 +138,12 @@ MagazineState::MagazineState(const MagazineState &b)
    start_slot = b.start_slot;
    prev_num_slots = b.prev_num_slots;
    prev_start_slot = b.prev_start_slot;
+   index_used = b.index_used;
    mag_dev = b.mag_dev;
    mountpoint = b.mountpoint;
+   known_mountpoint = b.known_mountpoint;
    mslot = b.mslot;
+   label_slot = b.label_slot;
    verr = b.verr;
 }
 
@@ -140,9 +155,12 @@ MagazineState& MagazineState::operator=(const MagazineState &b)
       start_slot = b.start_slot;
       prev_num_slots = b.prev_num_slots;
       prev_start_slot = b.prev_start_slot;
+      index_used = b.index_used;
       mag_dev = b.mag_dev;
       mountpoint = b.mountpoint;
+      known_mountpoint = b.known_mountpoint;
       mslot = b.mslot;
+      label_slot = b.label_slot;
       verr = b.verr;
    }
    return *this;
@@ -153,80 +171,54 @@ void MagazineState::clear()
    /* Notice that device and bay number are not cleared */
    num_slots = 0;
    start_slot = 0;
+   index_used = false;
    mountpoint.clear();
    mslot.clear();
+   label_slot.clear();
    verr.clear();
 }
 
 /*-------------------------------------------------
- *  Method to save current state of magazine bay to a file in
- *  the work directory named "bay" + bay_number.
+ *  Method to save current state of magazine bay in the changer state
+ *  'sf'. The state of a bay without a mounted magazine is removed. The
+ *  state is only changed if the magazine device, number of volumes, or
+ *  start slot differ from the saved state, so that the caller's commit of
+ *  the changer state to the work directory writes nothing otherwise.
  *  On success returns zero, otherwise sets lasterr and
  *  returns errno.
  *-------------------------------------------------*/
-int MagazineState::save()
+int MagazineState::save(ChangerStateFile &sf)
 {
-   mode_t old_mask;
-   int rc;
-   FILE *FS;
-   char sname[4096];
+   ChangerStateFile::BayRecord rec;
 
    if (mag_bay < 0) {
       verr.SetErrorWithErrno(EINVAL, "cannot save state of invalid magazine %d", mag_bay);
       vlog.Error("ERROR! %s", verr.GetErrorMsg());
       return EINVAL;
    }
-   /* Build path to state file */
-   snprintf(sname, sizeof(sname), "%s%sbay_state-%d", conf.work_dir.c_str(), DIR_DELIM, mag_bay);
-   /* Remove magazine state files for unmounted magazines */
+   /* Remove state of unmounted magazines */
    if (mountpoint.empty() || mslot.empty()) {
-      unlink(sname);
+      if (sf.RemoveBay(mag_bay)) vlog.Notice("removed state of magazine %d", mag_bay);
       return 0;
    }
-   /* Write state file for mounted magazine */
-   old_mask = umask(027);
-   FS = fopen(sname, "w");
-   if (!FS) {
-      /* Unable to open state file for writing */
-      rc = errno;
-      umask(old_mask);
-      verr.SetErrorWithErrno(rc, "cannot open magazine %d state file for writing", mag_bay);
-      vlog.Error("ERROR! %s", verr.GetErrorMsg());
-      return rc;
-   }
    /* Save magazine device (directory or UUID), number of volumes, and start of
-    * virtual slot range it is assigned */
-   if (fprintf(FS, "%s,%d,%d\n", mag_dev.c_str(), num_slots, start_slot) < 0) {
-      /* I/O error writing state file */
-      rc = errno;
-      fclose(FS);
-      unlink(sname);
-      umask(old_mask);
-      verr.SetErrorWithErrno(rc, "cannot write to magazine %d state file", mag_bay);
-      vlog.Error("ERROR! %s", verr.GetErrorMsg());
-      return rc;
-   }
-   fclose(FS);
-   umask(old_mask);
-   vlog.Notice("saved state of magazine %d", mag_bay);
+    * virtual slot range it is assigned, if any of them changed */
+   rec.dev = mag_dev;
+   rec.num_slots = num_slots;
+   rec.start_slot = start_slot;
+   if (sf.SetBay(mag_bay, rec)) vlog.Notice("saved state of magazine %d", mag_bay);
    return 0;
 }
 
 
 /*-------------------------------------------------
- *  Method to restore state of magazine from a file in the work
- *  directory named "bay_state-N", where N is the bay number.
+ *  Method to restore state of magazine from the changer state 'sf'.
  *  On success returns zero, otherwise sets lasterr and
  *  returns errno.
  *-------------------------------------------------*/
-int MagazineState::restore()
+int MagazineState::restore(const ChangerStateFile &sf)
 {
-   int rc;
-   tString line, word;
-   struct stat st;
-   FILE *FS;
-   size_t p;
-   char sname[4096];
+   const ChangerStateFile::BayRecord *rec;
 
    if (mag_bay < 0) {
       verr.SetErrorWithErrno(EINVAL, "cannot restore state of invalid magazine %d", mag_bay);
@@ -236,106 +228,17 @@ int MagazineState::restore()
    clear();
    prev_num_slots = 0;
    prev_start_slot = 0;
-   snprintf(sname, sizeof(sname), "%s%sbay_state-%d", conf.work_dir.c_str(), DIR_DELIM, mag_bay);
-
-   /* Check for existing state file */
-   if (stat(sname, &st)) {
-      /* magazine bay state file not found, so bay did not previously
-       * contain a magazine */
-      return 0;
-   }
-   /* Read bay state file */
-   FS = fopen(sname, "r");
-   if (!FS) {
-      /* No read permission? */
-      rc = errno;
-      verr.SetErrorWithErrno(rc, "cannot open magazine %d state file for reading", mag_bay);
-      vlog.Error("ERROR! %s", verr.GetErrorMsg());
-      return rc;
-   }
-   if (tGetLine(line, FS) == NULL) {
-      rc = errno;
-      if (!feof(FS)) {
-         /* error reading bay state file */
-         fclose(FS);
-         verr.SetErrorWithErrno(rc, "error reading magazine %d state file", mag_bay);
-         vlog.Error("ERROR! %s", verr.GetErrorMsg());
-         return rc;
-      }
-   }
-   fclose(FS);
-
-   /* Get magazine device (UUID or path specified in config) */
-   tStrip(tRemoveEOL(line));
-   p = 0;
-   if (tParseCSV(word, line, p) <= 0) {
-      /* bay state file should not be empty, assume it didn't exist */
-      vlog.Warning("WARNING! magazine %d state file was empty, deleting it", mag_bay);
-      unlink(sname);
+   rec = sf.GetBay(mag_bay);
+   if (!rec) {
+      /* bay did not previously contain a magazine */
       return 0;
    }
-   if (mag_dev != word) {
+   if (mag_dev != rec->dev) {
       /* Order of mag bays has changed in config file so ignore old state */
-      unlink(sname);
-      return 0;
-   }
-
-   /* Get number of slots */
-   if (tParseCSV(word, line, p) <= 0) {
-      /* Bay state file is corrupt.
-       * Treat as if it was not mounted at last invocation */
-      clear();
-      vlog.Warning("WARNING! magazine %d state file corrupt, deleting it", mag_bay);
-      unlink(sname);
-      return 0;
-   }
-   if (!isdigit(word[0])) {
-      /* Corrupt bay state file, assume it doesn't exist */
-      clear();
-      unlink(sname);
-      vlog.Warning("WARNING! magazine %d state file has invalid number of slots field, deleting it", mag_bay);
-      return 0;
-   }
-   prev_num_slots = (int)strtol(word.c_str(), NULL, 10);
-   if (prev_num_slots < 0) {
-      /* Corrupt bay state file, assume it doesn't exist */
-      clear();
-      prev_num_slots = 0;
-      unlink(sname);
-      vlog.Warning("WARNING! magazine %d state file has invalid number of slots field, deleting it", mag_bay);
-      return 0;
-   }
-
-   /* Get virtual slot number offset */
-   if (tParseCSV(word, line, p) <= 0) {
-      /* Bay state file is corrupt.
-       * Treat as if it was not mounted at last invocation */
-      clear();
-      prev_num_slots = 0;
-      vlog.Warning("WARNING! magazine %d state file corrupt, deleting it", mag_bay);
-      unlink(sname);
-      return 0;
-   }
-   if (!isdigit(word[0])) {
-      /* Corrupt bay state file, assume it doesn't exist */
-      clear();
-      prev_num_slots = 0;
-      unlink(sname);
-      vlog.Warning("WARNING! magazine %d state file has invalid virtual slot assignment field, deleting it",
-            mag_bay);
-      return 0;
-   }
-   prev_start_slot = (int)strtol(word.c_str(), NULL, 10);
-   if (prev_start_slot <= 0) {
-      /* Corrupt bay state file, assume it doesn't exist */
-      clear();
-      prev_num_slots = 0;
-      prev_start_slot = 0;
-      unlink(sname);
-      vlog.Warning("WARNING! magazine %d state file has invalid virtual slot assignment field, deleting it",
-            mag_bay);
       return 0;
    }
+   prev_num_slots = rec->num_slots;
+   prev_start_slot = rec->start_slot;
    vlog.Notice("restored state of magazine %d", mag_bay);
    return 0;
 }
@@ -450,6 +353,273 @@ int MagazineState::UpdateMagazineFormat()
 }
 
 
+/*-------------------------------------------------
+ *  Method to build a list of the volume files on the magazine. Writable
+ *  regular files in the magazine's mountpoint directory are considered
+ *  volume files. Where the platform supports it, the entry type returned
+ *  by readdir() is used to skip non-regular files without a stat() call,
+ *  and the remaining checks are made relative to the open directory so
+ *  that a full path need not be built and resolved for each entry. A stat()
+ *  is only needed when the file system does not report the entry type, or
+ *  for symlinks, which must be followed.
+ *  Return values are:
+ *       0    Success
+ *      -1    system error
+ *      -3    mountpoint not found
+ *      -5    permission denied
+ *-------------------------------------------------*/
+int MagazineState::ScanVolumeFiles(std::list<tString> &vname)
+{
+   int rc;
+   DIR *dir;
+   struct dirent *de;
+   struct stat st;
+#if defined(DT_UNKNOWN) && defined(AT_FDCWD)
+   int dfd, entries = 0, stats = 0;
+#else
+   tString path;
+#endif
+
+   dir = opendir(mountpoint.c_str());
+   if (!dir) {
+      /* could not open mountpoint dir */
+      rc = errno;
+      verr.SetErrorWithErrno(rc, "cannot open directory '%s'", mountpoint.c_str());
+      vlog.Error("ERROR! %s", verr.GetErrorMsg());
+      if (rc == ENOTDIR || rc == ENOENT) return -3;
+      if (rc == EACCES) return -5;
+      return -1;
+   }
+#if defined(DT_UNKNOWN) && defined(AT_FDCWD)
+   dfd = dirfd(dir);
+   de = readdir(dir);
+   while (de) {
+      ++entries;
+      /* Skip if not regular file, using the entry type when it is known */
+      if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK) {
+         ++stats;
+         if (fstatat(dfd, de->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+            de = readdir(dir);
+            continue;
+         }
+      } else if (de->d_type != DT_REG) {
+         de = readdir(dir);
+         continue;
+      }
+      /* Writable regular files on magazine are considered volume files */
+      if (faccessat(dfd, de->d_name, W_OK, 0) == 0) {
+         vname.push_back(de->d_name);
+      }
+      de = readdir(dir);
+   }
+   closedir(dir);
+   vlog.Debug("magazine %d scan: %d entries, %d volumes, %d stat calls avoided",
+         mag_bay, entries, (int)vname.size(), entries - stats);
+#else
+   de = readdir(dir);
+   while (de) {
+      /* Skip if not regular file */
+      tFormat(path, "%s%s%s", mountpoint.c_str(), DIR_DELIM, de->d_name);
+      if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+         de = readdir(dir);
+         continue;
+      }
+      /* Writable regular files on magazine are considered volume files */
+      if (access(path.c_str(), W_OK) == 0) {
+         vname.push_back(de->d_name);
+      }
+      de = readdir(dir);
+   }
+   closedir(dir);
+#endif
+   return 0;
+}
+
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_STDINT_H) && !defined(HAVE_WINDOWS_H)
+#define HAVE_VOLUME_INDEX 1
+
+/* Header of a magazine volume index file. The index is only ever read on
+ * the host that wrote it, so fields are in native byte order. The header
+ * is followed by 'data_len' bytes containing 'count' NUL terminated volume
+ * labels in ascending order. */
+#define VOLUME_INDEX_MAGIC "VCIDX01"
+struct VolumeIndexHeader
+{
+   char magic[8];
+   uint64_t dev;
+   uint64_t ino;
+   int64_t mtime_sec;
+   int64_t mtime_nsec;
+   int64_t ctime_sec;
+   int64_t ctime_nsec;
+   uint32_t count;
+   uint32_t data_len;
+};
+
+/*
+ *  Function to fill in the key fields of an index header from the
+ *  magazine directory's stat info.
+ */
+static void set_index_key(VolumeIndexHeader &hdr, const struct stat &st)
+{
+   memset(&hdr, 0, sizeof(hdr));
+   strncpy(hdr.magic, VOLUME_INDEX_MAGIC, sizeof(hdr.magic));
+   hdr.dev = (uint64_t)st.st_dev;
+   hdr.ino = (uint64_t)st.st_ino;
+   hdr.mtime_sec = (int64_t)st.st_mtime;
+   hdr.ctime_sec = (int64_t)st.st_ctime;
+#if defined(__APPLE__)
+   hdr.mtime_nsec = (int64_t)st.st_mtimespec.tv_nsec;
+   hdr.ctime_nsec = (int64_t)st.st_ctimespec.tv_nsec;
+#elif defined(__linux__) || defined(_STATBUF_ST_NSEC)
+   hdr.mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+   hdr.ctime_nsec = (int64_t)st.st_ctim.tv_nsec;
+#endif
+}
+#endif
+
+
+/*-------------------------------------------------
+ *  Method to read the list of volume files on the magazine from the
+ *  magazine's volume index file in the work directory named
+ *  "bay_index-N", where N is the bay number. The index is only used if
+ *  the device, inode, modification time, and change time of the magazine
+ *  directory, given by 'dir_st', match those recorded in the index. If
+ *  'vname' is NULL, then only the number of volumes is read.
+ *  Return values are:
+ *      >= 0  Success, number of volumes in the index
+ *      -1    index not found, invalid, or stale
+ *-------------------------------------------------*/
+int MagazineState::ReadVolumeIndex(const struct stat &dir_st, std::list<tString> *vname)
+{
+#ifdef HAVE_VOLUME_INDEX
+   int fd;
+   struct stat st;
+   VolumeIndexHeader key;
+   const VolumeIndexHeader *hdr;
+   const char *map, *p, *end;
+   uint32_t n;
+   char iname[4096];
+
+   snprintf(iname, sizeof(iname), "%s%sbay_index-%d", conf.work_dir.c_str(), DIR_DELIM, mag_bay);
+   fd = open(iname, O_RDONLY);
+   if (fd < 0) return -1;
+   if (fstat(fd, &st) || st.st_size < (off_t)sizeof(VolumeIndexHeader)) {
+      close(fd);
+      return -1;
+   }
+   map = (const char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) return -1;
+   hdr = (const VolumeIndexHeader*)map;
+   set_index_key(key, dir_st);
+   if (memcmp(hdr->magic, key.magic, sizeof(key.magic)) || hdr->dev != key.dev || hdr->ino != key.ino
+         || hdr->mtime_sec != key.mtime_sec || hdr->mtime_nsec != key.mtime_nsec
+         || hdr->ctime_sec != key.ctime_sec || hdr->ctime_nsec != key.ctime_nsec
+         || (off_t)(sizeof(VolumeIndexHeader) + hdr->data_len) != st.st_size
+         || (hdr->data_len && map[st.st_size - 1] != 0)) {
+      munmap((void*)map, st.st_size);
+      return -1;
+   }
+   if (!vname) {
+      n = hdr->count;
+      munmap((void*)map, st.st_size);
+      return (int)n;
+   }
+   p = map + sizeof(VolumeIndexHeader);
+   end = map + st.st_size;
+   for (n = 0; n < hdr->count && p < end; n++) {
+      vname->push_back(p);
+      p += strlen(p) + 1;
+   }
+   if (n != hdr->count || p != end) {
+      vname->clear();
+      munmap((void*)map, st.st_size);
+      return -1;
+   }
+   munmap((void*)map, st.st_size);
+   return (int)n;
+#else
+   return -1;
+#endif
+}
+
+
+/*-------------------------------------------------
+ *  Method to save the sorted list of volume files on the magazine to the
+ *  magazine's volume index file in the work directory, keyed by the
+ *  magazine directory's stat info, given by 'dir_st', as it was before
+ *  the directory was read. If the directory was modified so recently that
+ *  a further change might not alter its timestamps, then the index is
+ *  removed instead, forcing the directory to be read next time.
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int MagazineState::SaveVolumeIndex(const struct stat &dir_st, const std::list<tString> &vname)
+{
+#ifdef HAVE_VOLUME_INDEX
+   int fd, rc = 0;
+   VolumeIndexHeader hdr;
+   std::list<tString>::const_iterator p;
+   tString data, tname;
+   char iname[4096];
+
+   snprintf(iname, sizeof(iname), "%s%sbay_index-%d", conf.work_dir.c_str(), DIR_DELIM, mag_bay);
+   if (time(NULL) - dir_st.st_mtime < 2) {
+      vlog.Debug("magazine %d directory recently modified, not indexed", mag_bay);
+      unlink(iname);
+      return 0;
+   }
+   set_index_key(hdr, dir_st);
+   for (p = vname.begin(); p != vname.end(); p++) {
+      data += *p;
+      data.push_back(0);
+   }
+   hdr.count = (uint32_t)vname.size();
+   hdr.data_len = (uint32_t)data.size();
+
+   /* Write to temporary file, then rename over the old index */
+   tFormat(tname, "%s.%d", iname, (int)getpid());
+   fd = open(tname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0640);
+   if (fd < 0) {
+      rc = errno;
+      vlog.Error("ERROR! errno=%d creating magazine %d index file", rc, mag_bay);
+      return rc;
+   }
+   if (write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)
+         || write(fd, data.data(), data.size()) != (ssize_t)data.size()) {
+      rc = errno ? errno : EIO;
+   }
+   if (close(fd) && !rc) rc = errno;
+   if (!rc && rename(tname.c_str(), iname)) rc = errno;
+   if (rc) {
+      unlink(tname.c_str());
+      vlog.Error("ERROR! errno=%d writing magazine %d index file", rc, mag_bay);
+      return rc;
+   }
+   return 0;
+#else
+   return 0;
+#endif
+}
+
+
+/*-------------------------------------------------
+ *  Method to remove the magazine's volume index, so that the magazine
+ *  directory is read the next time the magazine is mounted. The index
+ *  is keyed by the directory's timestamps, which do not change when the
+ *  permissions of a volume file are changed, so it is removed when a
+ *  volume file it lists is found not to be writable.
+ *-------------------------------------------------*/
+void MagazineState::RemoveVolumeIndex()
+{
+   char iname[4096];
+
+   snprintf(iname, sizeof(iname), "%s%sbay_index-%d", conf.work_dir.c_str(), DIR_DELIM, mag_bay);
+   if (unlink(iname) == 0) vlog.Notice("removed volume index of magazine %d", mag_bay);
+}
+
+
 /*-------------------------------------------------
  *  Method to determine mountpoint of magazine and assign its volume files
  *  to magazine slots. Regular files on the magazine are assigned slots in
@@ -459,7 +629,9 @@ int MagazineState::UpdateMagazineFormat()
  *  as the virtual magazine. Otherwise, it specifies a directory to be used as
  *  the virtual magazine. If a UUID is given, then the system is queried to
  *  determine the mountpoint of the filesystem with the given UUID. The magazine
- *  device must already be mounted or configured to be auto-mounted.
+ *  device must already be mounted or configured to be auto-mounted. Unless
+ *  'rescan' is true, the volume index saved by a previous call is used in
+ *  place of reading the magazine directory when the directory is unchanged.
  *  Return values are:
  *       0    Magazine assigned successfully
  *      -1    system error
@@ -467,13 +639,11 @@ int MagazineState::UpdateMagazineFormat()
  *      -3    magname not found or not mounted
  *      -5    permission denied
  *-------------------------------------------------*/
-int MagazineState::Mount()
+int MagazineState::Mount(bool rescan)
 {
    int rc, s;
-   DIR *dir;
-   struct dirent *de;
    struct stat st;
-   tString fname, line, path;
+   tString fname;
    MagazineSlot v;
    std::list<tString> vname;
    std::list<tString>::iterator p;
@@ -483,6 +653,10 @@ int MagazineState::Mount()
    if (tCaseFind(mag_dev, "uuid:") != 0) {
       /* magazine specified as filesystem path */
       mountpoint = mag_dev;
+   } else if (!known_mountpoint.empty()) {
+      /* magazine specified as UUID whose mountpoint was found in the cache */
+      mountpoint = known_mountpoint;
+      vlog.Debug("magazine %d mountpoint %s found in cache", mag_bay, mountpoint.c_str());
    } else {
       /* magazine specified as UUID, so query OS for mountpoint */
       rc = GetMountpointFromUUID(buf, sizeof(buf), mag_dev.substr(5).c_str());
@@ -523,34 +697,25 @@ int MagazineState::Mount()
       UpdateMagazineFormat();
    }
 
-   /* Build list of this magazine's volume files */
-   dir = opendir(mountpoint.c_str());
-   if (!dir) {
-      /* could not open mountpoint dir */
-      rc = errno;
-      verr.SetErrorWithErrno(rc, "cannot open directory '%s'", mountpoint.c_str());
-      vlog.Error("ERROR! %s", verr.GetErrorMsg());
+   /* Build list of this magazine's volume files, reading the magazine
+    * directory only if it has changed since the volume index was saved */
+   if (stat(mountpoint.c_str(), &st) != 0) {
       mountpoint.clear();
-      if (rc == ENOTDIR || rc == ENOENT) return -3;
-      if (rc == EACCES) return -5;
-      return -1;
+      return -3;
    }
-   de = readdir(dir);
-   while (de) {
-      /* Skip if not regular file */
-      tFormat(path, "%s%s%s", mountpoint.c_str(), DIR_DELIM, de->d_name);
-      stat(path.c_str(), &st);
-      if (!S_ISREG(st.st_mode)) {
-         de = readdir(dir);
-         continue;
-      }
-      /* Writable regular files on magazine are considered volume files */
-      if (access(path.c_str(), W_OK) == 0) {
-         vname.push_back(de->d_name);
+   if (!rescan && ReadVolumeIndex(st, &vname) >= 0) {
+      index_used = true;
+      vlog.Debug("magazine %d volume index hit", mag_bay);
+   } else {
+      rc = ScanVolumeFiles(vname);
+      if (rc) {
+         mountpoint.clear();
+         return rc;
       }
-      de = readdir(dir);
+      vname.sort();
+      vlog.Debug("magazine %d volume index %s", mag_bay, rescan ? "bypassed" : "miss");
+      SaveVolumeIndex(st, vname);
    }
-   closedir(dir);
    if (vname.empty()) {
       /* Magazine is ready for use but has no volumes */
       start_slot = 0;
@@ -558,19 +723,72 @@ int MagazineState::Mount()
       return 0;
    }
    /* Assign volume files to slots in alphanumeric order */
-   vname.sort();
    s = 0;
    for (p = vname.begin(); p != vname.end(); p++) {
       v.mag_bay = mag_bay;
       v.label = *p;
       v.mag_slot = s++;
       mslot.push_back(v);
+      label_slot[v.label] = v.mag_slot;
    }
    num_slots = (int)mslot.size();
    return 0;
 }
 
 
+/*-------------------------------------------------
+ *  Method to determine whether the magazine is mounted and how many
+ *  volumes it holds, using only the magazine's volume index and, for a
+ *  magazine specified by UUID, the mountpoint cache 'mcache'. The
+ *  magazine directory is not read and nothing is written. If
+ *  'read_labels' is true, the magazine is also assigned its mountpoint
+ *  and the volume labels listed in the index, as Mount() would.
+ *  Return values are:
+ *      >= 0  number of volumes on the mounted magazine
+ *      -1    unknown, because the volume index is stale or missing, or
+ *            the mountpoint cache is not current
+ *      -3    magazine not mounted
+ *-------------------------------------------------*/
+int MagazineState::Probe(const MountpointCache &mcache, bool read_labels)
+{
+   int n;
+   struct stat st;
+   tString mp, fname;
+   MagazineSlot v;
+   std::list<tString> vname;
+   std::list<tString>::iterator p;
+
+   clear();
+   known_mountpoint.clear();
+   if (tCaseFind(mag_dev, "uuid:") != 0) {
+      mp = mag_dev;
+   } else if (!mcache.Lookup(mag_dev.substr(5), mp)) {
+      /* A UUID missing from a current cache was not mounted when the
+       * cache was saved, and the mount table has not changed since */
+      if (mcache.Current() && !mcache.Known(mag_dev.substr(5))) return -3;
+      return -1;
+   }
+   if (stat(mp.c_str(), &st) != 0) return -3;
+   if (access(mp.c_str(), W_OK) != 0) return -1;
+   /* Magazines of old versions are converted by Mount() */
+   tFormat(fname, "%s%sindex", mp.c_str(), DIR_DELIM);
+   if (access(fname.c_str(), F_OK) == 0) return -1;
+   if (tCaseFind(mag_dev, "uuid:") == 0) known_mountpoint = mp;
+   n = ReadVolumeIndex(st, read_labels ? &vname : NULL);
+   if (n < 0 || !read_labels) return n;
+   mountpoint = mp;
+   for (p = vname.begin(); p != vname.end(); p++) {
+      v.mag_bay = mag_bay;
+      v.label = *p;
+      v.mag_slot = (int)mslot.size();
+      mslot.push_back(v);
+      label_slot[v.label] = v.mag_slot;
+   }
+   num_slots = n;
+   return n;
+}
+
+
 /*-------------------------------------------------
  *  Method to get path to volume file in a magazine slot
  *  On success returns path, else returns empty string
@@ -610,16 +828,15 @@ const char* MagazineState::GetVolumePath(tString &path, int ms)
 
 
 /*-------------------------------------------------
- *  Method to get magazine slot containing a label.
+ *  Method to get magazine slot containing a label using the label
+ *  index built by Mount() and updated by CreateVolume().
  *  On success returns magazine slot number, else negative.
  *-------------------------------------------------*/
 int MagazineState::GetVolumeSlot(const char *label)
 {
-   int n;
-   for (n = 0; n < num_slots; n++) {
-      if (mslot[n].label == label) return n;
-   }
-   return -1;
+   std::map<tString, int>::const_iterator p = label_slot.find(label);
+   if (p == label_slot.end()) return -1;
+   return p->second;
 }
 
 
@@ -675,6 +892,7 @@ int MagazineState::CreateVolume(const char *vol_label_in)
    new_mslot.mag_slot = mslot.size();
    new_mslot.label = label;
    mslot.push_back(new_mslot);
+   label_slot[label] = new_mslot.mag_slot;
    ++num_slots;
    vlog.Notice("created volume '%s' on magazine %d (%s)", label.c_str(), mag_bay, mag_dev.c_str());
    return 0;
@@ -730,122 +948,1346 @@ void VirtualSlot::clear()
 
 
 ///////////////////////////////////////////////////
-//  Class DriveState
+//  Class SlotRangeSet
 ///////////////////////////////////////////////////
 
-DriveState::DriveState(const DriveState &b)
+/*-------------------------------------------------
+ *  Method to add slots 'first' through 'last' to the set, merging with
+ *  any ranges they overlap or adjoin.
+ *-------------------------------------------------*/
+void SlotRangeSet::Add(int first, int last)
 {
-   drv = b.drv;
-   vs = b.vs;
+   std::map<int, int>::iterator p;
+
+   if (first < 1 || last < first) return;
+   /* Merge with preceding range that overlaps or adjoins */
+   p = ranges.upper_bound(first);
+   if (p != ranges.begin()) {
+      --p;
+      if (p->second + 1 >= first) {
+         first = p->first;
+         if (p->second > last) last = p->second;
+         ranges.erase(p);
+      }
+   }
+   /* Merge with following ranges that overlap or adjoin */
+   p = ranges.lower_bound(first);
+   while (p != ranges.end() && p->first <= last + 1) {
+      if (p->second > last) last = p->second;
+      ranges.erase(p++);
+   }
+   ranges[first] = last;
 }
 
-DriveState& DriveState::operator=(const DriveState &b)
+
+/*-------------------------------------------------
+ *  Method to add all ranges in 'b' to the set
+ *-------------------------------------------------*/
+void SlotRangeSet::Add(const SlotRangeSet &b)
 {
-   if (&b != this) {
-      drv = b.drv;
-      vs = b.vs;
-   }
-   return *this;
+   std::map<int, int>::const_iterator p;
+   for (p = b.ranges.begin(); p != b.ranges.end(); p++) Add(p->first, p->second);
 }
 
-/*
- *  Method to clear a drive's values
- */
-void DriveState::clear()
+
+/*-------------------------------------------------
+ *  Method to add the ranges in a slot list of the form "1-5,9,12-20"
+ *  Returns true on success, or false if the list is invalid.
+ *-------------------------------------------------*/
+bool SlotRangeSet::Parse(const char *list)
 {
-   /* do not clear drive number */
-   vs = -1;
+   long first, last;
+   char *p;
+
+   while (*list) {
+      first = strtol(list, &p, 10);
+      if (p == list || first < 1) return false;
+      last = first;
+      if (*p == '-') {
+         list = p + 1;
+         last = strtol(list, &p, 10);
+         if (p == list || last < first) return false;
+      }
+      Add((int)first, (int)last);
+      if (*p == ',') ++p;
+      else if (*p) return false;
+      list = p;
+   }
+   return true;
+}
+
+
+/*-------------------------------------------------
+ *  Method to return the set as a slot list of the form "1-5,9,12-20"
+ *-------------------------------------------------*/
+tString SlotRangeSet::Format() const
+{
+   tString list, tmp;
+   std::map<int, int>::const_iterator p;
+
+   for (p = ranges.begin(); p != ranges.end(); p++) {
+      if (p->first == p->second) tFormat(tmp, "%d", p->first);
+      else tFormat(tmp, "%d-%d", p->first, p->second);
+      if (!list.empty()) list += ",";
+      list += tmp;
+   }
+   return list;
+}
+
+
+/*-------------------------------------------------
+ *  Method to return the number of slots in the set
+ *-------------------------------------------------*/
+int SlotRangeSet::NumSlots() const
+{
+   int n = 0;
+   std::map<int, int>::const_iterator p;
+   for (p = ranges.begin(); p != ranges.end(); p++) n += p->second - p->first + 1;
+   return n;
 }
 
 
 
 ///////////////////////////////////////////////////
-//  Class DynamicConfig
+//  Class FreeSlotRanges
 ///////////////////////////////////////////////////
 
 /*-------------------------------------------------
- *  Method to save dynamic configuration info to a file in
- *  the work directory named dynamic.conf.
+ *  Method to clear all free ranges. Slot zero is never allocated, so
+ *  an empty changer ends at slot 1.
  *-------------------------------------------------*/
-void DynamicConfig::save()
+void FreeSlotRanges::clear()
 {
-   mode_t old_mask;
-   int rc;
+   end_slot = 1;
+   by_start.clear();
+   by_size.clear();
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to add the free range of 'len' slots beginning at
+ *  slot 'start' to both the by-start and by-size indexes.
+ *-------------------------------------------------*/
+void FreeSlotRanges::AddRange(int start, int len)
+{
+   if (len < 1) return;
+   by_start[start] = len;
+   by_size.insert(std::make_pair(len, start));
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to remove the free range at 'p' from both indexes
+ *-------------------------------------------------*/
+void FreeSlotRanges::RemoveRange(std::map<int, int>::iterator p)
+{
+   by_size.erase(std::make_pair(p->second, p->first));
+   by_start.erase(p);
+}
+
+
+/*-------------------------------------------------
+ *  Method to build the free ranges from the empty slots in 'vslot'
+ *-------------------------------------------------*/
+void FreeSlotRanges::Build(const VirtualSlotArray &vslot)
+{
+   int n, start = -1;
+
+   clear();
+   end_slot = vslot.size() > 1 ? (int)vslot.size() : 1;
+   for (n = 1; n < (int)vslot.size(); n++) {
+      if (vslot[n].empty()) {
+         if (start < 0) start = n;
+      } else if (start > 0) {
+         AddRange(start, n - start);
+         start = -1;
+      }
+   }
+   if (start > 0) AddRange(start, end_slot - start);
+}
+
+
+/*-------------------------------------------------
+ *  Method to allocate a range of 'count' consecutive slots. The smallest
+ *  free range that will hold 'count' slots is used, choosing the lowest
+ *  numbered one if several are the same size. If no free range is large
+ *  enough, then slots are added to the end, beginning with the free range
+ *  at the end, if any.
+ *  Returns the starting slot number of the range allocated.
+ *-------------------------------------------------*/
+int FreeSlotRanges::Allocate(int count)
+{
+   int start, len;
+   std::set<std::pair<int, int> >::iterator p;
+   std::map<int, int>::iterator t;
+
+   if (count < 1) return end_slot;
+   p = by_size.lower_bound(std::make_pair(count, 0));
+   if (p != by_size.end()) {
+      start = p->second;
+      len = p->first;
+      RemoveRange(by_start.find(start));
+      AddRange(start + count, len - count);
+      return start;
+   }
+   /* Extend the free range at the end, or add a new range */
+   start = end_slot;
+   if (!by_start.empty()) {
+      t = by_start.end();
+      --t;
+      if (t->first + t->second == end_slot) {
+         start = t->first;
+         RemoveRange(t);
+      }
+   }
+   end_slot = start + count;
+   return start;
+}
+
+
+/*-------------------------------------------------
+ *  Method to allocate the specific range of 'count' slots beginning at
+ *  slot 'start', adding slots to the end if needed.
+ *  Returns true if the range was free and is now allocated, else false.
+ *-------------------------------------------------*/
+bool FreeSlotRanges::Reserve(int start, int count)
+{
+   int fstart, flen;
+   std::map<int, int>::iterator p;
+
+   if (start < 1 || count < 1) return false;
+   if (start == end_slot) {
+      end_slot += count;
+      return true;
+   }
+   p = by_start.upper_bound(start);
+   if (p == by_start.begin()) return false;
+   --p;
+   fstart = p->first;
+   flen = p->second;
+   if (start >= fstart + flen) return false;
+   if (start + count > fstart + flen) {
+      /* Range only fits if the free range extends to the end */
+      if (fstart + flen != end_slot) return false;
+      end_slot = start + count;
+      flen = end_slot - fstart;
+   }
+   RemoveRange(p);
+   AddRange(fstart, start - fstart);
+   AddRange(start + count, fstart + flen - start - count);
+   return true;
+}
+
+
+/*-------------------------------------------------
+ *  Method to return the range of 'count' slots beginning at slot 'start'
+ *  to the free ranges, merging it with adjacent free ranges.
+ *-------------------------------------------------*/
+void FreeSlotRanges::Release(int start, int count)
+{
+   std::map<int, int>::iterator p;
+
+   if (start < 1 || count < 1) return;
+   /* Merge with following free range */
+   p = by_start.find(start + count);
+   if (p != by_start.end()) {
+      count += p->second;
+      RemoveRange(p);
+   }
+   /* Merge with preceding free range */
+   p = by_start.lower_bound(start);
+   if (p != by_start.begin()) {
+      --p;
+      if (p->first + p->second == start) {
+         start = p->first;
+         count += p->second;
+         RemoveRange(p);
+      }
+   }
+   AddRange(start, count);
+}
+
+
+
+///////////////////////////////////////////////////
+//  Class DriveState
+///////////////////////////////////////////////////
+
+DriveState::DriveState(const DriveState &b)
+{
+   drv = b.drv;
+   vs = b.vs;
+   link_known = b.link_known;
+   link = b.link;
+}
+
+DriveState& DriveState::operator=(const DriveState &b)
+{
+   if (&b != this) {
+      drv = b.drv;
+      vs = b.vs;
+      link_known = b.link_known;
+      link = b.link;
+   }
+   return *this;
+}
+
+/*
+ *  Method to clear a drive's values
+ */
+void DriveState::clear()
+{
+   /* do not clear drive number or what is known of its symlink */
+   vs = -1;
+}
+
+
+
+///////////////////////////////////////////////////
+//  Class ChangerStateFile
+///////////////////////////////////////////////////
+
+/* Header of the changer state file. The file is only ever read on the host
+ * that wrote it, so fields are in native byte order. The header is followed
+ * by 'data_len' bytes of records, each a record type followed by its fields,
+ * all as NUL terminated strings:
+ *    "bay" bay_number num_slots start_slot device
+ *    "drive" drive_number device label
+ * State files of any other version are not read. */
+#define CHANGER_STATE_MAGIC "VCSTATE"
+#define CHANGER_STATE_VERSION 2
+struct ChangerStateHeader
+{
+   char magic[8];
+   uint32_t version;
+   uint32_t crc;        /* CRC-32 of the records */
+   uint32_t data_len;
+   int32_t max_slot;
+   uint64_t seq;        /* sequence number of the last journal record included */
+};
+
+/* Header of each record of the changer journal, followed by 'data_len' bytes
+ * of NUL terminated fields:
+ *    seq "drive" drive_number device label
+ *    seq "unload" drive_number */
+struct ChangerJournalHeader
+{
+   uint32_t data_len;
+   uint32_t crc;        /* CRC-32 of the fields */
+};
+
+/*
+ *  Function to compute the CRC-32 (IEEE 802.3) of 'len' bytes at 'buf'.
+ */
+static uint32_t state_crc32(const char *buf, size_t len)
+{
+   uint32_t crc = 0xffffffff;
+   size_t n;
+   int b;
+
+   for (n = 0; n < len; n++) {
+      crc ^= (unsigned char)buf[n];
+      for (b = 0; b < 8; b++) crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+   }
+   return ~crc;
+}
+
+/*
+ *  Functions to append a field to the records of a changer state file.
+ */
+static void add_state_field(tString &data, const char *str)
+{
+   data += str;
+   data.push_back(0);
+}
+
+static void add_state_field(tString &data, int val)
+{
+   char num[32];
+   snprintf(num, sizeof(num), "%d", val);
+   add_state_field(data, num);
+}
+
+static void add_state_field(tString &data, unsigned long val)
+{
+   char num[32];
+   snprintf(num, sizeof(num), "%lu", val);
+   add_state_field(data, num);
+}
+
+/*
+ *  Function to get the next field of a record from the records at 'p',
+ *  which end at 'end' with a NUL. Returns NULL if no fields remain.
+ */
+static const char* next_state_field(const char *&p, const char *end)
+{
+   const char *f = p;
+   if (p >= end) return NULL;
+   p += strlen(p) + 1;
+   return f;
+}
+
+/*
+ *  Function to convert a field to a number. Returns false if the
+ *  field is not a decimal number.
+ */
+static bool state_field_int(const char *f, int &val)
+{
+   char *e;
+   if (!f || !isdigit(f[0])) return false;
+   val = (int)strtol(f, &e, 10);
+   return *e == 0;
+}
+
+static bool state_field_ulong(const char *f, unsigned long &val)
+{
+   char *e;
+   if (!f || !isdigit(f[0])) return false;
+   val = strtoul(f, &e, 10);
+   return *e == 0;
+}
+
+/*
+ *  Function to write all 'len' bytes at 'buf' to file descriptor 'fd'.
+ *  On success returns zero, else returns errno.
+ */
+static int write_state_data(int fd, const char *buf, size_t len)
+{
+   ssize_t n;
+   size_t done = 0;
+
+   while (done < len) {
+      n = write(fd, buf + done, len - done);
+      if (n <= 0) return errno ? errno : EIO;
+      done += n;
+   }
+   return 0;
+}
+
+/*
+ *  Function to flush the entries of the work directory to disk, making
+ *  files created, renamed, or removed there durable.
+ */
+static void sync_work_dir()
+{
+#ifndef HAVE_WINDOWS_H
+   int fd = open(conf.work_dir.c_str(), O_RDONLY);
+   if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+   }
+#endif
+}
+
+
+/*-------------------------------------------------
+ *  Method to clear the changer state
+ *-------------------------------------------------*/
+void ChangerStateFile::clear()
+{
+   CloseJournal();
+   seq = 0;
+   journal_len = 0;
+   journal_records = 0;
+   max_slot = 0;
+   bay.clear();
+   drive.clear();
+   generation = saved_generation = 0;
+   migrated = false;
+   legacy.clear();
+   SetFileId(state_id, NULL);
+   SetFileId(journal_id, NULL);
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to set 'id' to identify the file whose status is 'st',
+ *  or a file that does not exist if 'st' is NULL.
+ *-------------------------------------------------*/
+void ChangerStateFile::SetFileId(FileId &id, const struct stat *st)
+{
+   id.exists = (st != NULL);
+   id.dev = st ? (unsigned long long)st->st_dev : 0;
+   id.ino = st ? (unsigned long long)st->st_ino : 0;
+   id.size = st ? (long long)st->st_size : 0;
+   id.mtime = st ? (long)st->st_mtime : 0;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to determine if file 'fname' is still the file
+ *  identified by 'id', unchanged since 'id' was set.
+ *-------------------------------------------------*/
+bool ChangerStateFile::SameFile(const FileId &id, const tString &fname)
+{
+   struct stat st;
+
+   if (stat(fname.c_str(), &st)) return !id.exists && errno == ENOENT;
+   return id.exists && id.dev == (unsigned long long)st.st_dev
+         && id.ino == (unsigned long long)st.st_ino && id.size == (long long)st.st_size
+         && id.mtime == (long)st.st_mtime;
+}
+
+
+/*-------------------------------------------------
+ *  Method to determine if the state file and journal in the work directory
+ *  are still those this object last read or wrote. They are not when
+ *  another process has since committed the state or appended to the
+ *  journal, and then the state must be loaded again before it is changed.
+ *-------------------------------------------------*/
+bool ChangerStateFile::Current() const
+{
+   struct stat st;
+   tString fname;
+
+   /* An open journal removed by another process's checkpoint */
+   if (journal_fd >= 0 && (fstat(journal_fd, &st) || st.st_nlink == 0)) return false;
+   tFormat(fname, "%s%s%s", conf.work_dir.c_str(), DIR_DELIM, CHANGER_STATE_FILE);
+   if (!SameFile(state_id, fname)) return false;
+   tFormat(fname, "%s%s%s", conf.work_dir.c_str(), DIR_DELIM, CHANGER_JOURNAL_FILE);
+   return SameFile(journal_id, fname);
+}
+
+
+/*-------------------------------------------------
+ *  Method to get the saved state of magazine bay 'n'.
+ *  Returns NULL if the bay has no saved state.
+ *-------------------------------------------------*/
+const ChangerStateFile::BayRecord* ChangerStateFile::GetBay(int n) const
+{
+   std::map<int, BayRecord>::const_iterator p = bay.find(n);
+   return p == bay.end() ? NULL : &p->second;
+}
+
+
+/*-------------------------------------------------
+ *  Method to set the state of magazine bay 'n'.
+ *  Returns true if the state changed.
+ *-------------------------------------------------*/
+bool ChangerStateFile::SetBay(int n, const BayRecord &rec)
+{
+   std::map<int, BayRecord>::iterator p = bay.find(n);
+   if (p != bay.end() && p->second.dev == rec.dev && p->second.num_slots == rec.num_slots
+         && p->second.start_slot == rec.start_slot) {
+      return false;
+   }
+   bay[n] = rec;
+   ++generation;
+   return true;
+}
+
+
+/*-------------------------------------------------
+ *  Method to remove the state of magazine bay 'n'.
+ *  Returns true if the bay had a saved state.
+ *-------------------------------------------------*/
+bool ChangerStateFile::RemoveBay(int n)
+{
+   if (!bay.erase(n)) return false;
+   ++generation;
+   return true;
+}
+
+
+/*-------------------------------------------------
+ *  Method to get the saved state of drive 'n'.
+ *  Returns NULL if the drive has no saved state.
+ *-------------------------------------------------*/
+const ChangerStateFile::DriveRecord* ChangerStateFile::GetDrive(int n) const
+{
+   std::map<int, DriveRecord>::const_iterator p = drive.find(n);
+   return p == drive.end() ? NULL : &p->second;
+}
+
+
+/*-------------------------------------------------
+ *  Method to set the state of drive 'n'.
+ *  Returns true if the state changed.
+ *-------------------------------------------------*/
+bool ChangerStateFile::SetDrive(int n, const DriveRecord &rec)
+{
+   std::map<int, DriveRecord>::iterator p = drive.find(n);
+   if (p != drive.end() && p->second.dev == rec.dev && p->second.label == rec.label) return false;
+   drive[n] = rec;
+   ++generation;
+   return true;
+}
+
+
+/*-------------------------------------------------
+ *  Method to remove the state of drive 'n'.
+ *  Returns true if the drive had a saved state.
+ *-------------------------------------------------*/
+bool ChangerStateFile::RemoveDrive(int n)
+{
+   if (!drive.erase(n)) return false;
+   ++generation;
+   return true;
+}
+
+
+/*-------------------------------------------------
+ *  Method to get the highest numbered drive having a saved state.
+ *  Returns -1 if no drive has a saved state.
+ *-------------------------------------------------*/
+int ChangerStateFile::MaxDrive() const
+{
+   return drive.empty() ? -1 : drive.rbegin()->first;
+}
+
+
+/*-------------------------------------------------
+ *  Method to set the highest virtual slot number ever used.
+ *  Returns true if the value changed.
+ *-------------------------------------------------*/
+bool ChangerStateFile::SetMaxSlot(int n)
+{
+   if (n == max_slot) return false;
+   max_slot = n;
+   ++generation;
+   return true;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to build the contents of the changer state file.
+ *-------------------------------------------------*/
+tString ChangerStateFile::Serialize() const
+{
+   ChangerStateHeader hdr;
+   tString data;
+   std::map<int, BayRecord>::const_iterator b;
+   std::map<int, DriveRecord>::const_iterator d;
+
+   for (b = bay.begin(); b != bay.end(); b++) {
+      add_state_field(data, "bay");
+      add_state_field(data, b->first);
+      add_state_field(data, b->second.num_slots);
+      add_state_field(data, b->second.start_slot);
+      add_state_field(data, b->second.dev.c_str());
+   }
+   for (d = drive.begin(); d != drive.end(); d++) {
+      add_state_field(data, "drive");
+      add_state_field(data, d->first);
+      add_state_field(data, d->second.dev.c_str());
+      add_state_field(data, d->second.label.c_str());
+   }
+   memset(&hdr, 0, sizeof(hdr));
+   strncpy(hdr.magic, CHANGER_STATE_MAGIC, sizeof(hdr.magic));
+   hdr.version = CHANGER_STATE_VERSION;
+   hdr.crc = state_crc32(data.data(), data.size());
+   hdr.data_len = (uint32_t)data.size();
+   hdr.max_slot = (int32_t)max_slot;
+   hdr.seq = (uint64_t)seq;
+   return tString((const char*)&hdr, sizeof(hdr)) + data;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to set the changer state from the 'len' bytes of
+ *  changer state file contents at 'buf'. Records with invalid values are
+ *  skipped. Returns false if the contents are not a valid state file.
+ *-------------------------------------------------*/
+bool ChangerStateFile::Parse(const char *buf, size_t len)
+{
+   ChangerStateHeader hdr;
+   const char *p, *end, *type, *f1, *f2, *f3, *f4;
+   int n, num, start;
+   size_t hlen = sizeof(hdr);
+   BayRecord br;
+   DriveRecord dr;
+
+   if (len < hlen) return false;
+   memcpy(&hdr, buf, hlen);
+   if (memcmp(hdr.magic, CHANGER_STATE_MAGIC, sizeof(hdr.magic))
+         || hdr.version != CHANGER_STATE_VERSION) {
+      return false;
+   }
+   if (hlen + hdr.data_len != len || (hdr.data_len && buf[len - 1] != 0)
+         || state_crc32(buf + hlen, hdr.data_len) != hdr.crc) {
+      return false;
+   }
+   max_slot = hdr.max_slot;
+   seq = (unsigned long)hdr.seq;
+   p = buf + hlen;
+   end = buf + len;
+   while ((type = next_state_field(p, end)) != NULL) {
+      if (strcmp(type, "bay") == 0) {
+         f1 = next_state_field(p, end);
+         f2 = next_state_field(p, end);
+         f3 = next_state_field(p, end);
+         f4 = next_state_field(p, end);
+         if (!f4) return false;
+         if (!state_field_int(f1, n) || !state_field_int(f2, num) || !state_field_int(f3, start)
+               || start <= 0 || !f4[0]) {
+            vlog.Warning("WARNING! ignoring invalid magazine state in changer state file");
+            continue;
+         }
+         br.dev = f4;
+         br.num_slots = num;
+         br.start_slot = start;
+         bay[n] = br;
+      } else if (strcmp(type, "drive") == 0) {
+         f1 = next_state_field(p, end);
+         f2 = next_state_field(p, end);
+         f3 = next_state_field(p, end);
+         if (!f3) return false;
+         if (!state_field_int(f1, n) || !f2[0] || !f3[0]) {
+            vlog.Warning("WARNING! ignoring invalid drive state in changer state file");
+            continue;
+         }
+         dr.dev = f2;
+         dr.label = f3;
+         drive[n] = dr;
+      } else {
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/*-------------------------------------------------
+ *  Method to read the changer state from the file changer.state in the
+ *  work directory. If the file does not exist, then the state files of
+ *  older versions are read instead. A corrupt state file is discarded, as
+ *  if the changer had no previous state. The drive transitions recorded in
+ *  the journal since the state file was written are then replayed.
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int ChangerStateFile::Load()
+{
+   int fd, rc;
+   bool ok;
+   struct stat st;
+   tString sname;
+#if defined(HAVE_SYS_MMAN_H) && !defined(HAVE_WINDOWS_H)
+   const char *map;
+#else
+   tString data;
+   ssize_t len;
+   size_t got = 0;
+#endif
+
+   clear();
+   tFormat(sname, "%s%s%s", conf.work_dir.c_str(), DIR_DELIM, CHANGER_STATE_FILE);
+   fd = open(sname.c_str(), O_RDONLY);
+   if (fd < 0) {
+      rc = errno;
+      if (rc != ENOENT) {
+         vlog.Error("ERROR! errno=%d opening changer state file", rc);
+         return rc;
+      }
+      rc = LoadLegacy();
+      return rc ? rc : ReplayJournal();
+   }
+   if (fstat(fd, &st)) {
+      rc = errno;
+      close(fd);
+      vlog.Error("ERROR! errno=%d reading changer state file", rc);
+      return rc;
+   }
+   SetFileId(state_id, &st);
+   if (st.st_size < (off_t)sizeof(ChangerStateHeader)) {
+      ok = false;
+      close(fd);
+   } else {
+#if defined(HAVE_SYS_MMAN_H) && !defined(HAVE_WINDOWS_H)
+      map = (const char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (map == MAP_FAILED) {
+         rc = errno;
+         vlog.Error("ERROR! errno=%d reading changer state file", rc);
+         return rc;
+      }
+      ok = Parse(map, st.st_size);
+      munmap((void*)map, st.st_size);
+#else
+      data.resize(st.st_size);
+      while (got < data.size()) {
+         len = read(fd, &data[got], data.size() - got);
+         if (len <= 0) break;
+         got += len;
+      }
+      close(fd);
+      ok = (got == data.size()) && Parse(data.data(), data.size());
+#endif
+   }
+   if (!ok) {
+      vlog.Warning("WARNING! changer state file is corrupt, discarding it");
+      clear();
+   }
+   return ReplayJournal();
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to read the state files written by older versions,
+ *  dynamic.conf, bay_state-N, and drive_state-N, where N is the bay or
+ *  drive number. These files are removed once their contents have been
+ *  committed to the changer state file.
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int ChangerStateFile::LoadLegacy()
+{
+   int rc, n, kind, num, start;
+   DIR *d;
+   struct dirent *de;
    FILE *FS;
-   char sname[4096];
+   size_t p;
+   tString name, path, line, dev, w1, w2;
+   BayRecord br;
+   DriveRecord dr;
 
-   if (max_slot < 10) max_slot = 10;
-   /* Build path to dynamic.conf file */
-   snprintf(sname, sizeof(sname), "%s%sdynamic.conf", conf.work_dir.c_str(), DIR_DELIM);
-   /* Write dynamic config info */
+   d = opendir(conf.work_dir.c_str());
+   if (!d) {
+      rc = errno;
+      vlog.Error("ERROR! error %d accessing work directory", rc);
+      return rc;
+   }
+   while ((de = readdir(d)) != NULL) {
+      name = de->d_name;
+      n = 0;
+      if (name == "dynamic.conf") {
+         kind = 0;
+      } else if (name.find("bay_state-") == 0 && state_field_int(name.c_str() + 10, n)) {
+         kind = 1;
+      } else if (name.find("drive_state-") == 0 && state_field_int(name.c_str() + 12, n)) {
+         kind = 2;
+      } else {
+         continue;
+      }
+      tFormat(path, "%s%s%s", conf.work_dir.c_str(), DIR_DELIM, name.c_str());
+      legacy.push_back(path);
+      FS = fopen(path.c_str(), "r");
+      if (!FS) continue;
+      line.clear();
+      tGetLine(line, FS);
+      fclose(FS);
+      tStrip(tRemoveEOL(line));
+      p = 0;
+      switch (kind) {
+      case 0:
+         if (tCaseFind(line, "max_used_slot") == 0) {
+            max_slot = (int)strtol(line.substr(14).c_str(), NULL, 10);
+         }
+         break;
+      case 1:
+         if (tParseCSV(dev, line, p) <= 0 || tParseCSV(w1, line, p) <= 0 || tParseCSV(w2, line, p) <= 0
+               || !state_field_int(w1.c_str(), num) || !state_field_int(w2.c_str(), start) || start <= 0) {
+            vlog.Warning("WARNING! magazine %d state file corrupt, ignoring it", n);
+            break;
+         }
+         br.dev = dev;
+         br.num_slots = num;
+         br.start_slot = start;
+         bay[n] = br;
+         break;
+      default:
+         if (tParseCSV(dev, line, p) != 1 || dev.empty() || tParseCSV(w1, line, p) != 1 || w1.empty()) {
+            vlog.Warning("WARNING! drive %d state file corrupt, ignoring it", n);
+            break;
+         }
+         dr.dev = dev;
+         dr.label = w1;
+         drive[n] = dr;
+         break;
+      }
+   }
+   closedir(d);
+   if (!legacy.empty()) {
+      migrated = true;
+      vlog.Notice("migrating %d state files to %s", (int)legacy.size(), CHANGER_STATE_FILE);
+   }
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to remove the state files of older versions
+ *-------------------------------------------------*/
+void ChangerStateFile::RemoveLegacy()
+{
+   size_t n;
+   for (n = 0; n < legacy.size(); n++) unlink(legacy[n].c_str());
+   legacy.clear();
+   migrated = false;
+}
+
+
+/*-------------------------------------------------
+ *  Method to write the changer state to the file changer.state in the work
+ *  directory, if it has changed since it was loaded or last committed.
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int ChangerStateFile::Commit()
+{
+   if (!Dirty()) return 0;  /* unchanged */
+   return WriteCheckpoint();
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to write the changer state to the file changer.state
+ *  in the work directory and discard the journal, whose records are then
+ *  included in the state file. The state is written to a temporary file,
+ *  which is flushed to disk and then renamed over the state file, so that
+ *  the state file always holds either the old or the new state in full.
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int ChangerStateFile::WriteCheckpoint()
+{
+   int fd, rc = 0;
+   mode_t old_mask;
+   struct stat st;
+   tString data(Serialize()), sname, tname;
+
+   tFormat(sname, "%s%s%s", conf.work_dir.c_str(), DIR_DELIM, CHANGER_STATE_FILE);
+   tFormat(tname, "%s.%d", sname.c_str(), (int)getpid());
    old_mask = umask(027);
-   FS = fopen(sname, "w");
-   if (!FS) {
-      /* Unable to open dynamic.conf file for writing */
+   fd = open(tname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0640);
+   umask(old_mask);
+   if (fd < 0) {
       rc = errno;
-      umask(old_mask);
-      vlog.Error("ERROR! cannot open dynamic.conf file for writing (errno=%d)", rc);
-      return;
+      vlog.Error("ERROR! errno=%d creating changer state file", rc);
+      return rc;
+   }
+   rc = write_state_data(fd, data.data(), data.size());
+#ifndef HAVE_WINDOWS_H
+   if (!rc && fsync(fd)) rc = errno;
+#endif
+   if (!rc && fstat(fd, &st)) rc = errno;
+   if (close(fd) && !rc) rc = errno;
+   if (!rc && rename(tname.c_str(), sname.c_str())) rc = errno;
+   if (rc) {
+      unlink(tname.c_str());
+      vlog.Error("ERROR! errno=%d writing changer state file", rc);
+      return rc;
    }
-   /* Save max slot number in use to dynamic configuration */
-   if (fprintf(FS, "max_used_slot=%d\n", max_slot) < 0) {
-      /* I/O error writing dynamic.conf file */
+   SetFileId(state_id, &st);
+   /* Make the rename itself durable */
+   sync_work_dir();
+   saved_generation = generation;
+   if (migrated) RemoveLegacy();
+   /* The journal's records are now part of the state file. Should removing
+    * the journal not reach the disk, its records are skipped on replay,
+    * since their sequence numbers are not beyond that of the state file. */
+   if (journal_records || journal_fd >= 0) {
+      unsynced = 0;
+      CloseJournal();
+      tFormat(tname, "%s%s%s", conf.work_dir.c_str(), DIR_DELIM, CHANGER_JOURNAL_FILE);
+      unlink(tname.c_str());
+      journal_len = 0;
+      journal_records = 0;
+      SetFileId(journal_id, NULL);
+   }
+   vlog.Debug("saved changer state");
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to replay the records of the file changer.journal in
+ *  the work directory that are newer than the state file. Reading stops at
+ *  the first incomplete or corrupt record, which is what a crash while
+ *  appending to the journal leaves behind. That record and any following
+ *  it are truncated from the journal when the next record is appended.
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int ChangerStateFile::ReplayJournal()
+{
+   int fd, rc, n, applied = 0;
+   ssize_t len;
+   size_t pos = 0;
+   unsigned long rseq;
+   const char *p, *end, *f1, *type, *f2, *f3, *f4;
+   tString jname, data;
+   char buf[4096];
+   struct stat st;
+   ChangerJournalHeader hdr;
+   DriveRecord dr;
+
+   tFormat(jname, "%s%s%s", conf.work_dir.c_str(), DIR_DELIM, CHANGER_JOURNAL_FILE);
+   fd = open(jname.c_str(), O_RDONLY);
+   if (fd < 0) {
       rc = errno;
-      fclose(FS);
-      unlink(sname);
-      umask(old_mask);
-      vlog.Error("ERROR! i/o error writing dynamic.conf file (errno=%d)", rc);
-      return;
+      if (rc == ENOENT) return 0;
+      vlog.Error("ERROR! errno=%d opening changer journal", rc);
+      return rc;
    }
-   fclose(FS);
+   if (fstat(fd, &st) == 0) SetFileId(journal_id, &st);
+   while ((len = read(fd, buf, sizeof(buf))) > 0) data.append(buf, len);
+   rc = len < 0 ? errno : 0;
+   close(fd);
+   if (rc) {
+      vlog.Error("ERROR! errno=%d reading changer journal", rc);
+      return rc;
+   }
+
+   while (pos + sizeof(hdr) <= data.size()) {
+      memcpy(&hdr, data.data() + pos, sizeof(hdr));
+      if (hdr.data_len == 0 || hdr.data_len > data.size() - pos - sizeof(hdr)) break;
+      p = data.data() + pos + sizeof(hdr);
+      end = p + hdr.data_len;
+      if (end[-1] != 0 || state_crc32(p, hdr.data_len) != hdr.crc) break;
+      f1 = next_state_field(p, end);
+      type = next_state_field(p, end);
+      f2 = next_state_field(p, end);
+      if (!state_field_ulong(f1, rseq) || !type || !state_field_int(f2, n)) break;
+      if (strcmp(type, "drive") == 0) {
+         f3 = next_state_field(p, end);
+         f4 = next_state_field(p, end);
+         if (!f4 || !f3[0] || !f4[0]) break;
+         if (rseq > seq) {
+            dr.dev = f3;
+            dr.label = f4;
+            drive[n] = dr;
+         }
+      } else if (strcmp(type, "unload") == 0) {
+         if (rseq > seq) drive.erase(n);
+      } else {
+         break;
+      }
+      if (rseq > seq) {
+         seq = rseq;
+         ++applied;
+      }
+      ++journal_records;
+      pos += sizeof(hdr) + hdr.data_len;
+   }
+   journal_len = (long)pos;
+   if (pos < data.size()) {
+      vlog.Warning("WARNING! discarding %d bytes of incomplete changer journal record",
+            (int)(data.size() - pos));
+   }
+   if (applied) vlog.Info("replayed %d changer journal records", applied);
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to open the file changer.journal in the work directory
+ *  for appending, dropping any incomplete record at its end.
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int ChangerStateFile::OpenJournal()
+{
+   int rc;
+   mode_t old_mask;
+   tString jname;
+   struct stat st;
+
+   tFormat(jname, "%s%s%s", conf.work_dir.c_str(), DIR_DELIM, CHANGER_JOURNAL_FILE);
+   old_mask = umask(027);
+   journal_fd = open(jname.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0640);
    umask(old_mask);
-   vlog.Notice("saved dynamic configuration (max used slot: %d)", max_slot);
+   if (journal_fd < 0) {
+      rc = errno;
+      vlog.Error("ERROR! errno=%d opening changer journal", rc);
+      return rc;
+   }
+   if (ftruncate(journal_fd, journal_len)) {
+      rc = errno;
+      CloseJournal();
+      vlog.Error("ERROR! errno=%d truncating changer journal", rc);
+      return rc;
+   }
+   if (fstat(journal_fd, &st) == 0) SetFileId(journal_id, &st);
+   /* Make a newly created journal durable */
+   if (journal_len == 0 && conf.journal_sync != JOURNAL_SYNC_NONE) sync_work_dir();
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to close the journal, first flushing to disk any
+ *  records not yet flushed.
+ *-------------------------------------------------*/
+void ChangerStateFile::CloseJournal()
+{
+   if (journal_fd < 0) return;
+   Sync();
+   close(journal_fd);
+   journal_fd = -1;
 }
 
 
 /*-------------------------------------------------
- *  Method to restore dynamic configuration info.
+ *  Method to record the current state of drive 'n' in the journal, after
+ *  the state was changed by SetDrive() or RemoveDrive(). Depending on the
+ *  Journal Sync config keyword, the record is flushed to disk immediately,
+ *  together with others once Journal Group records are pending, or left to
+ *  the operating system. Instead of a journal record, the complete state
+ *  file is written when the state has other uncommitted changes or when
+ *  the journal has reached Journal Checkpoint records. If another process
+ *  changed the saved state since it was loaded, the state is first loaded
+ *  again and the change to drive 'n' is applied to it, so that neither a
+ *  stale journal is appended to nor the other process's changes are lost.
+ *  On success returns zero, else returns errno.
  *-------------------------------------------------*/
-void DynamicConfig::restore()
+int ChangerStateFile::LogDrive(int n)
 {
    int rc;
-   tString line;
+   bool loaded;
+   tString data, rec;
+   ChangerJournalHeader hdr;
+   const DriveRecord *dr;
+   DriveRecord cur;
    struct stat st;
+
+   if (!Current()) {
+      vlog.Info("changer state was changed by another process, loading it again");
+      dr = GetDrive(n);
+      loaded = (dr != NULL);
+      if (dr) cur = *dr;
+      rc = Load();
+      if (rc) return rc;
+      if (loaded) SetDrive(n, cur);
+      else RemoveDrive(n);
+      if (!Dirty()) return 0;  /* already saved by the other process */
+   }
+   if (migrated || generation != saved_generation + 1 || journal_records >= conf.journal_checkpoint) {
+      return WriteCheckpoint();
+   }
+   if (journal_fd < 0 && (rc = OpenJournal()) != 0) return rc;
+
+   add_state_field(data, seq + 1);
+   dr = GetDrive(n);
+   if (dr) {
+      add_state_field(data, "drive");
+      add_state_field(data, n);
+      add_state_field(data, dr->dev.c_str());
+      add_state_field(data, dr->label.c_str());
+   } else {
+      add_state_field(data, "unload");
+      add_state_field(data, n);
+   }
+   hdr.data_len = (uint32_t)data.size();
+   hdr.crc = state_crc32(data.data(), data.size());
+   rec.assign((const char*)&hdr, sizeof(hdr));
+   rec += data;
+   rc = write_state_data(journal_fd, rec.data(), rec.size());
+   if (rc) {
+      /* Do not leave a partial record for the next record to follow */
+      if (ftruncate(journal_fd, journal_len)) rc = errno;
+      if (fstat(journal_fd, &st) == 0) SetFileId(journal_id, &st);
+      vlog.Error("ERROR! errno=%d writing changer journal", rc);
+      return rc;
+   }
+   if (fstat(journal_fd, &st) == 0) SetFileId(journal_id, &st);
+   journal_len += (long)rec.size();
+   ++journal_records;
+   ++seq;
+   saved_generation = generation;
+   if (conf.journal_sync != JOURNAL_SYNC_NONE) ++unsynced;
+   if (conf.journal_sync == JOURNAL_SYNC_OP
+         || (conf.journal_sync == JOURNAL_SYNC_GROUP && unsynced >= conf.journal_group)) {
+      rc = Sync();
+      if (rc) return rc;
+   }
+   vlog.Debug("journaled state of drive %d (record %lu)", n, seq);
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Method to flush to disk the journal records not yet flushed.
+ *  On success returns zero, else returns errno.
+ *-------------------------------------------------*/
+int ChangerStateFile::Sync()
+{
+   int rc = 0;
+
+   if (journal_fd < 0 || !unsynced) return 0;
+#ifndef HAVE_WINDOWS_H
+   if (fsync(journal_fd)) {
+      rc = errno;
+      vlog.Error("ERROR! errno=%d flushing changer journal", rc);
+   }
+#endif
+   unsynced = 0;
+   return rc;
+}
+
+
+
+///////////////////////////////////////////////////
+//  Class DynamicConfig
+///////////////////////////////////////////////////
+
+/*-------------------------------------------------
+ *  Method to save dynamic configuration info in the changer state 'sf',
+ *  if it changed. The caller commits the changer state to the work directory.
+ *-------------------------------------------------*/
+void DynamicConfig::save(ChangerStateFile &sf)
+{
+   if (max_slot < 10) max_slot = 10;
+   if (sf.SetMaxSlot(max_slot)) vlog.Notice("saved dynamic configuration (max used slot: %d)", max_slot);
+}
+
+
+/*-------------------------------------------------
+ *  Method to restore dynamic configuration info from the changer state 'sf'.
+ *-------------------------------------------------*/
+void DynamicConfig::restore(const ChangerStateFile &sf)
+{
+   max_slot = sf.MaxSlot();
+   if (max_slot < 10) max_slot = 10;
+}
+
+
+
+///////////////////////////////////////////////////
+//  Class MountpointCache
+///////////////////////////////////////////////////
+
+/*-------------------------------------------------
+ *  Method to save the cached UUID mountpoints, along with the signature
+ *  of the mount table they were found in, to a file in the work directory
+ *  named uuid_mounts. The file is only written if the cache has changed.
+ *-------------------------------------------------*/
+void MountpointCache::save()
+{
+   mode_t old_mask;
+   int rc = 0;
    FILE *FS;
+   tString tname;
    char sname[4096];
+   std::map<tString, Entry>::const_iterator p;
 
-   if (max_slot < 10) max_slot = 10;
-   /* Build path to dynamic.conf file */
-   snprintf(sname, sizeof(sname), "%s%sdynamic.conf", conf.work_dir.c_str(), DIR_DELIM);
-   /* Check for existing file */
-   if (stat(sname, &st)) {
-      /* dynamic configuration file not found */
+   if (!have_sig || !dirty) return;
+   snprintf(sname, sizeof(sname), "%s%suuid_mounts", conf.work_dir.c_str(), DIR_DELIM);
+   tFormat(tname, "%s.%d", sname, (int)getpid());
+   old_mask = umask(027);
+   FS = fopen(tname.c_str(), "w");
+   umask(old_mask);
+   if (!FS) {
+      vlog.Error("ERROR! cannot open uuid_mounts file for writing (errno=%d)", errno);
       return;
    }
-   /* Read dynamic.conf file */
+   if (fprintf(FS, "signature=%016llx\n", table_sig) < 0) rc = errno;
+   for (p = entry.begin(); !rc && p != entry.end(); p++) {
+      if (fprintf(FS, "%s %llu %llu %s\n", p->first.c_str(), p->second.dev, p->second.rdev,
+            p->second.mountp.c_str()) < 0) {
+         rc = errno;
+      }
+   }
+   if (fclose(FS) && !rc) rc = errno;
+   if (!rc && rename(tname.c_str(), sname)) rc = errno;
+   if (rc) {
+      unlink(tname.c_str());
+      vlog.Error("ERROR! i/o error writing uuid_mounts file (errno=%d)", rc);
+      return;
+   }
+   dirty = false;
+}
+
+
+/*-------------------------------------------------
+ *  Method to restore the cached UUID mountpoints from the work directory.
+ *  The cache is discarded if the system mount table has changed since it
+ *  was saved, or if the mount table's signature cannot be determined.
+ *-------------------------------------------------*/
+void MountpointCache::restore()
+{
+   FILE *FS;
+   char *line = NULL, *uuid, *mountp;
+   size_t line_sz = 0;
+   ssize_t len;
+   unsigned long long sig;
+   Entry ent;
+   char sname[4096];
+
+   entry.clear();
+   dirty = false;
+   have_sig = (GetMountTableSignature(&table_sig) == 0);
+   if (!have_sig) return;
+   snprintf(sname, sizeof(sname), "%s%suuid_mounts", conf.work_dir.c_str(), DIR_DELIM);
    FS = fopen(sname, "r");
    if (!FS) {
-      /* No read permission? */
-      rc = errno;
-      vlog.Error("ERROR! cannot open dynamic.conf file for restore (errno=%d)", rc);
+      dirty = true;
       return;
    }
-   if (tGetLine(line, FS) == NULL) {
-      rc = errno;
-      if (!feof(FS)) {
-         /* error reading bay state file */
-         fclose(FS);
-         vlog.Error("ERROR! i/o error reading dynamic.conf file (errno=%d)", rc);
-         return;
+   if (getline(&line, &line_sz, FS) <= 0 || sscanf(line, "signature=%llx", &sig) != 1
+         || sig != table_sig) {
+      /* Mount table has changed, so resolve all UUIDs again */
+      vlog.Debug("mount table changed, uuid mountpoint cache discarded");
+      dirty = true;
+   } else {
+      while ((len = getline(&line, &line_sz, FS)) > 0) {
+         while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = 0;
+         /* Each line is: uuid st_dev rdev mountpoint */
+         uuid = strtok(line, " ");
+         if (!uuid) continue;
+         mountp = strtok(NULL, " ");
+         if (!mountp) continue;
+         ent.dev = strtoull(mountp, NULL, 10);
+         mountp = strtok(NULL, " ");
+         if (!mountp) continue;
+         ent.rdev = strtoull(mountp, NULL, 10);
+         mountp = strtok(NULL, "");
+         if (!mountp || !mountp[0]) continue;
+         ent.mountp = mountp;
+         entry[tString(uuid)] = ent;
       }
    }
+   free(line);
    fclose(FS);
+}
 
-   /* Get magazine device (UUID or path specified in config) */
-   tStrip(tRemoveEOL(line));
-   if (tCaseFind(line, "max_used_slot") == 0) {
-      max_slot = (int)strtol(line.substr(14).c_str(), NULL, 10);
-      if (max_slot < 10) max_slot = 10;
+
+/*-------------------------------------------------
+ *  Method to get the cached mountpoint of the filesystem with UUID 'uuid'.
+ *  The cached mountpoint is only returned if it is still on the same
+ *  device as when it was cached and, where the system maintains
+ *  /dev/disk/by-uuid, the UUID still refers to the same block device.
+ *  Returns true if a current mountpoint was found, else false.
+ *-------------------------------------------------*/
+bool MountpointCache::Lookup(const tString &uuid, tString &mountp) const
+{
+   struct stat st;
+   unsigned long long rdev;
+   std::map<tString, Entry>::const_iterator p;
+
+   mountp.clear();
+   p = entry.find(uuid);
+   if (p == entry.end()) return false;
+   if (stat(p->second.mountp.c_str(), &st) || (unsigned long long)st.st_dev != p->second.dev) {
+      return false;
    }
+   if (p->second.rdev && (GetUUIDDevice(uuid.c_str(), &rdev) || rdev != p->second.rdev)) {
+      return false;
+   }
+   mountp = p->second.mountp;
+   return true;
 }
 
+
+/*-------------------------------------------------
+ *  Method to set the cached mountpoint of the filesystem with UUID 'uuid'
+ *  to 'mountp', or to remove it from the cache if 'mountp' is empty.
+ *-------------------------------------------------*/
+void MountpointCache::Update(const tString &uuid, const tString &mountp)
+{
+   struct stat st;
+   Entry ent;
+   std::map<tString, Entry>::iterator p;
+
+   p = entry.find(uuid);
+   if (mountp.empty() || stat(mountp.c_str(), &st)) {
+      if (p != entry.end()) {
+         entry.erase(p);
+         dirty = true;
+      }
+      return;
+   }
+   ent.dev = (unsigned long long)st.st_dev;
+   if (GetUUIDDevice(uuid.c_str(), &ent.rdev)) ent.rdev = 0;
+   ent.mountp = mountp;
+   if (p != entry.end() && p->second.dev == ent.dev && p->second.rdev == ent.rdev
+         && p->second.mountp == ent.mountp) {
+      return;
+   }
+   entry[uuid] = ent;
+   dirty = true;
+}
@@ -24,9 +24,16 @@
 #define CHANGERSTATE_H_
 
 #include <vector>
+#include <list>
+#include <set>
+#include <map>
 #include "tstring.h"
 #include "errhandler.h"
 
+struct stat;
+class ChangerStateFile;
+class MountpointCache;
+
 class MagazineSlot
 {
 public:
@@ -52,14 +59,17 @@ typedef std::vector<MagazineSlot> MagazineSlotArray;
 class MagazineState
 {
 public:
-   MagazineState() : mag_bay(-1), num_slots(0), start_slot(0), prev_num_slots(0), prev_start_slot(0) {}
+   MagazineState() : mag_bay(-1), num_slots(0), start_slot(0), prev_num_slots(0), prev_start_slot(0),
+         index_used(false) {}
 	MagazineState(const MagazineState &b);
 	virtual ~MagazineState() {}
 	MagazineState& operator=(const MagazineState &b);
 	void clear();
-   int save();
-	int restore();
-	int Mount();
+   int save(ChangerStateFile &sf);
+	int restore(const ChangerStateFile &sf);
+	int Mount(bool rescan = false);
+	int Probe(const MountpointCache &mcache, bool read_labels = false);
+	void RemoveVolumeIndex();
 	void SetBay(int bay, const char *dev);
 	inline void SetBay(int bay, const tString &dev) { SetBay(bay, dev.c_str()); }
    tString GetVolumePath(int mag_slot);
@@ -74,15 +84,21 @@ public:
 protected:
 	int ReadMagazineIndex();
 	int UpdateMagazineFormat();
+	int ScanVolumeFiles(std::list<tString> &vname);
+	int ReadVolumeIndex(const struct stat &dir_st, std::list<tString> *vname);
+	int SaveVolumeIndex(const struct stat &dir_st, const std::list<tString> &vname);
 public:
 	int mag_bay;
 	int num_slots;
 	int start_slot;
 	int prev_num_slots;
 	int prev_start_slot;
+	bool index_used;
 	tString mag_dev;
 	tString mountpoint;
+	tString known_mountpoint;
 	MagazineSlotArray mslot;
+	std::map<tString, int> label_slot;
    ErrorHandler verr;
 };
 
@@ -107,20 +123,170 @@ public:
 
 typedef std::vector<VirtualSlot> VirtualSlotArray;
 
+class FreeSlotRanges
+{
+public:
+   FreeSlotRanges() : end_slot(1) {}
+   virtual ~FreeSlotRanges() {}
+   void clear();
+   void Build(const VirtualSlotArray &vslot);
+   int Allocate(int count);
+   bool Reserve(int start, int count);
+   void Release(int start, int count);
+   inline int EndSlot() const { return end_slot; }
+protected:
+   void AddRange(int start, int len);
+   void RemoveRange(std::map<int, int>::iterator p);
+protected:
+   int end_slot;
+   std::map<int, int> by_start;
+   std::set<std::pair<int, int> > by_size;
+};
+
+/* Most slot ranges to name in 'update slots' before updating all slots */
+#define MAX_UPDATE_RANGES 8
+
+class SlotRangeSet
+{
+public:
+   SlotRangeSet() {}
+   virtual ~SlotRangeSet() {}
+   inline void clear() { ranges.clear(); }
+   inline bool empty() const { return ranges.empty(); }
+   void Add(int first, int last);
+   void Add(const SlotRangeSet &b);
+   bool Parse(const char *list);
+   tString Format() const;
+   inline int NumRanges() const { return (int)ranges.size(); }
+   int NumSlots() const;
+protected:
+   std::map<int, int> ranges;  /* first slot -> last slot, never overlapping or adjacent */
+};
+
+#define CHANGER_STATE_FILE "changer.state"
+#define CHANGER_JOURNAL_FILE "changer.journal"
+
+/* Persistent state of the changer's magazine bays, virtual slot assignments,
+ * and drives, kept in the single file changer.state in the work directory.
+ * The file is replaced atomically on commit and carries a CRC of its contents.
+ * Each change to the state advances its generation, so that the file is only
+ * written when the state actually changed since it was loaded or committed.
+ * Drive transitions are appended to the journal file changer.journal, rather
+ * than rewriting the state file, and the journal is replayed on load. Once
+ * the journal grows too large, it is compacted into a new state file. */
+class ChangerStateFile
+{
+public:
+   struct BayRecord
+   {
+      tString dev;       /* magazine device (directory or UUID) */
+      int num_slots;     /* number of volumes on the magazine */
+      int start_slot;    /* first virtual slot assigned to the magazine */
+   };
+   struct DriveRecord
+   {
+      tString dev;       /* device of the magazine the volume was loaded from */
+      tString label;     /* label of the loaded volume */
+   };
+public:
+   ChangerStateFile() : max_slot(0), generation(0), saved_generation(0), migrated(false),
+         seq(0), journal_fd(-1), journal_len(0), journal_records(0), unsynced(0)
+   {
+      SetFileId(state_id, NULL);
+      SetFileId(journal_id, NULL);
+   }
+   ~ChangerStateFile() { CloseJournal(); }
+   void clear();
+   int Load();
+   int Commit();
+   int LogDrive(int n);
+   int Sync();
+   const BayRecord* GetBay(int n) const;
+   bool SetBay(int n, const BayRecord &rec);
+   bool RemoveBay(int n);
+   const DriveRecord* GetDrive(int n) const;
+   bool SetDrive(int n, const DriveRecord &rec);
+   bool RemoveDrive(int n);
+   int MaxDrive() const;
+   bool SetMaxSlot(int n);
+   inline int MaxSlot() const { return max_slot; }
+   inline bool Dirty() const { return generation != saved_generation || migrated; }
+   bool Current() const;
+protected:
+   struct FileId
+   {
+      bool exists;
+      unsigned long long dev;
+      unsigned long long ino;
+      long long size;
+      long mtime;
+   };
+   static void SetFileId(FileId &id, const struct stat *st);
+   static bool SameFile(const FileId &id, const tString &fname);
+   int LoadLegacy();
+   void RemoveLegacy();
+   tString Serialize() const;
+   bool Parse(const char *buf, size_t len);
+   int WriteCheckpoint();
+   int ReplayJournal();
+   int OpenJournal();
+   void CloseJournal();
+protected:
+   int max_slot;
+   std::map<int, BayRecord> bay;
+   std::map<int, DriveRecord> drive;
+   unsigned long generation;        /* incremented by each change */
+   unsigned long saved_generation;  /* generation last loaded or committed */
+   bool migrated;
+   tStringArray legacy;   /* state files of older versions to remove after migration */
+   unsigned long seq;     /* sequence number of the last journal record applied */
+   int journal_fd;
+   long journal_len;      /* length of the valid records in the journal */
+   int journal_records;   /* number of records in the journal */
+   int unsynced;          /* number of journal records not yet flushed to disk */
+   FileId state_id;       /* state file as last read or written */
+   FileId journal_id;     /* journal as last read or written */
+};
+
 class DynamicConfig
 {
 public:
    DynamicConfig() : max_slot(0) {}
-   void save();
-   void restore();
+   void save(ChangerStateFile &sf);
+   void restore(const ChangerStateFile &sf);
 public:
    int max_slot;
 };
 
+/* Mountpoints of UUID magazines, saved in the work directory so that
+ * UUIDs need not be resolved again while the mount table is unchanged */
+class MountpointCache
+{
+public:
+   MountpointCache() : table_sig(0), have_sig(false), dirty(false) {}
+   void save();
+   void restore();
+   bool Lookup(const tString &uuid, tString &mountp) const;
+   inline bool Known(const tString &uuid) const { return entry.find(uuid) != entry.end(); }
+   inline bool Current() const { return have_sig && !dirty; }
+   void Update(const tString &uuid, const tString &mountp);
+protected:
+   unsigned long long table_sig;
+   bool have_sig;
+   bool dirty;
+   struct Entry
+   {
+      unsigned long long dev;    /* st_dev of the mountpoint */
+      unsigned long long rdev;   /* block device number, zero if unknown */
+      tString mountp;
+   };
+   std::map<tString, Entry> entry;
+};
+
 class DriveState
 {
 public:
-   DriveState() : drv(-1), vs(-1) {}
+   DriveState() : drv(-1), vs(-1), link_known(false) {}
    DriveState(const DriveState &b);
    virtual ~DriveState() {}
    DriveState& operator=(const DriveState &b);
@@ -130,6 +296,8 @@ public:
 public:
    int drv;
    int vs;
+   bool link_known;   /* true if the drive's symlink is known to point to 'link' */
+   tString link;      /* target of the drive's symlink, or empty if it has none */
 };
 
 typedef std::vector<DriveState> DriveStateArray;
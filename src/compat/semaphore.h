@@ -33,6 +33,8 @@ typedef union
   long int __align;
 } sem_t;
 
+#define SEM_FAILED ((sem_t*)0)
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -0,0 +1,824 @@
+/* dirclient.cpp
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2020 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+ *
+ *  Provides a client for the Bacula Director's console protocol, so that
+ *  console commands can be issued without running the bconsole program.
+ *
+ *  Messages in both directions are a 4 byte network order length followed
+ *  by that many bytes of data. A negative length is a signal, such as the
+ *  end of a command's output or a prompt for further input. The console
+ *  sends a "Hello" message and then the console and Director each
+ *  authenticate the other with a CRAM-MD5 exchange keyed by the MD5 digest
+ *  of the Director's password. TLS is not supported, so a Director that
+ *  requires TLS for consoles cannot be used.
+ */
+
+#include "config.h"
+#include "compat_defs.h"
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_CTYPE_H
+#include <ctype.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifndef HAVE_WINDOWS_H
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#endif
+
+#include "loghandler.h"
+#include "dirclient.h"
+
+#ifndef HAVE_WINDOWS_H
+
+/* Name the default (unrestricted) console authenticates as */
+#define CONSOLE_NAME "*UserAgent*"
+
+/* Largest message accepted from the Director */
+#define MAX_DIRECTOR_MSG (1024 * 1024)
+
+/* Bacula network signals (negative message lengths) */
+#define BNET_EOD            -1
+#define BNET_TERMINATE      -4
+#define BNET_HEARTBEAT      -6
+#define BNET_HB_RESPONSE    -7
+#define BNET_INVALID_CMD   -13
+#define BNET_CMD_FAILED    -14
+#define BNET_SELECT_INPUT  -19
+#define BNET_YESNO         -24
+#define BNET_SUB_PROMPT    -27
+#define BNET_TEXT_INPUT    -28
+
+/*------------------------------------------------------------------
+ *  MD5 message digest (RFC 1321) and HMAC-MD5 (RFC 2104)
+ *-----------------------------------------------------------------*/
+
+typedef struct _md5_ctx_s
+{
+   uint32_t state[4];
+   uint64_t count;
+   unsigned char buf[64];
+} MD5_CTX_T;
+
+#define MD5_F(x, y, z) (((x) & (y)) | (~(x) & (z)))
+#define MD5_G(x, y, z) (((x) & (z)) | ((y) & ~(z)))
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+#define MD5_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static const uint32_t md5_k[64] = {
+   0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+   0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+   0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+   0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+   0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+   0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+   0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+   0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const int md5_r[64] = {
+   7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+   5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+   4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+   6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static void md5_transform(uint32_t *state, const unsigned char *block)
+{
+   uint32_t a = state[0], b = state[1], c = state[2], d = state[3], f, t, m[16];
+   int i, g;
+
+   for (i = 0; i < 16; i++) {
+      m[i] = (uint32_t)block[i * 4] | ((uint32_t)block[i * 4 + 1] << 8)
+            | ((uint32_t)block[i * 4 + 2] << 16) | ((uint32_t)block[i * 4 + 3] << 24);
+   }
+   for (i = 0; i < 64; i++) {
+      if (i < 16) {
+         f = MD5_F(b, c, d);
+         g = i;
+      } else if (i < 32) {
+         f = MD5_G(b, c, d);
+         g = (5 * i + 1) & 15;
+      } else if (i < 48) {
+         f = MD5_H(b, c, d);
+         g = (3 * i + 5) & 15;
+      } else {
+         f = MD5_I(b, c, d);
+         g = (7 * i) & 15;
+      }
+      t = d;
+      d = c;
+      c = b;
+      b = b + MD5_ROTL(a + f + md5_k[i] + m[g], md5_r[i]);
+      a = t;
+   }
+   state[0] += a;
+   state[1] += b;
+   state[2] += c;
+   state[3] += d;
+}
+
+static void md5_init(MD5_CTX_T &ctx)
+{
+   ctx.state[0] = 0x67452301;
+   ctx.state[1] = 0xefcdab89;
+   ctx.state[2] = 0x98badcfe;
+   ctx.state[3] = 0x10325476;
+   ctx.count = 0;
+}
+
+static void md5_update(MD5_CTX_T &ctx, const unsigned char *data, size_t len)
+{
+   size_t used = (size_t)(ctx.count & 63), n;
+
+   ctx.count += len;
+   while (len) {
+      n = 64 - used;
+      if (n > len) n = len;
+      memcpy(ctx.buf + used, data, n);
+      used += n;
+      data += n;
+      len -= n;
+      if (used == 64) {
+         md5_transform(ctx.state, ctx.buf);
+         used = 0;
+      }
+   }
+}
+
+static void md5_final(MD5_CTX_T &ctx, unsigned char *digest)
+{
+   unsigned char pad[72];
+   uint64_t bits = ctx.count * 8;
+   size_t padlen = 64 - (size_t)(ctx.count & 63);
+   int i;
+
+   if (padlen < 9) padlen += 64;
+   memset(pad, 0, sizeof(pad));
+   pad[0] = 0x80;
+   for (i = 0; i < 8; i++) pad[padlen - 8 + i] = (unsigned char)(bits >> (8 * i));
+   md5_update(ctx, pad, padlen);
+   for (i = 0; i < 16; i++) digest[i] = (unsigned char)(ctx.state[i / 4] >> (8 * (i % 4)));
+}
+
+static void hmac_md5(const unsigned char *text, size_t text_len, const unsigned char *key,
+      size_t key_len, unsigned char *digest)
+{
+   MD5_CTX_T ctx;
+   unsigned char k_ipad[64], k_opad[64], tk[16];
+   int i;
+
+   if (key_len > 64) {
+      md5_init(ctx);
+      md5_update(ctx, key, key_len);
+      md5_final(ctx, tk);
+      key = tk;
+      key_len = 16;
+   }
+   memset(k_ipad, 0, sizeof(k_ipad));
+   memcpy(k_ipad, key, key_len);
+   memcpy(k_opad, k_ipad, sizeof(k_opad));
+   for (i = 0; i < 64; i++) {
+      k_ipad[i] ^= 0x36;
+      k_opad[i] ^= 0x5c;
+   }
+   md5_init(ctx);
+   md5_update(ctx, k_ipad, 64);
+   md5_update(ctx, text, text_len);
+   md5_final(ctx, digest);
+   md5_init(ctx);
+   md5_update(ctx, k_opad, 64);
+   md5_update(ctx, digest, 16);
+   md5_final(ctx, digest);
+}
+
+
+/*
+ *  Function to encode binary data in base64 the way Bacula does, which is
+ *  without padding. If 'compatible' is false, bytes are sign extended and the
+ *  final bits are not left aligned, matching older Bacula versions.
+ */
+static tString bacula_base64(const unsigned char *bin, size_t len, bool compatible)
+{
+   static const char digits[] =
+         "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+   uint32_t reg = 0;
+   int rem = 0;
+   size_t i = 0;
+   tString out;
+
+   while (i < len) {
+      if (rem < 6) {
+         reg <<= 8;
+         if (compatible) reg |= (uint8_t)bin[i++];
+         else reg |= (uint32_t)(int32_t)(int8_t)bin[i++];
+         rem += 8;
+      }
+      out += digits[(reg >> (rem - 6)) & 0x3f];
+      rem -= 6;
+   }
+   if (rem) {
+      if (compatible) out += digits[(reg & ((1 << rem) - 1)) << (6 - rem)];
+      else out += digits[reg & ((1 << rem) - 1)];
+   }
+   return out;
+}
+
+
+/*------------------------------------------------------------------
+ *  bconsole configuration file parsing
+ *-----------------------------------------------------------------*/
+
+/*
+ *  Function to split a Bacula resource file into tokens. Quoted strings
+ *  become a single token with the quotes removed, comments are dropped,
+ *  and '{', '}', '=', ';', and newlines are returned as separate tokens.
+ */
+static void tokenize_bacula_conf(const tString &text, tStringList &tokens)
+{
+   size_t p = 0, start;
+   tString tok;
+
+   while (p < text.size()) {
+      if (text[p] == '#') {
+         while (p < text.size() && text[p] != '\n') p++;
+         continue;
+      }
+      if (strchr("{}=;\n", text[p])) {
+         tokens.push_back(tString(1, text[p] == ';' ? '\n' : text[p]));
+         p++;
+         continue;
+      }
+      if (isspace(text[p])) {
+         p++;
+         continue;
+      }
+      if (text[p] == '"') {
+         tok.clear();
+         for (++p; p < text.size() && text[p] != '"'; p++) {
+            if (text[p] == '\\' && p + 1 < text.size()) ++p;
+            tok += text[p];
+         }
+         if (p < text.size()) ++p;
+         tokens.push_back("\"" + tok);
+         continue;
+      }
+      start = p;
+      while (p < text.size() && !isspace(text[p]) && !strchr("{}=;#\"", text[p])) p++;
+      tokens.push_back(text.substr(start, p - start));
+   }
+}
+
+
+/*
+ *  Function to read the Director name, address, port, and password from the
+ *  first Director resource of a bconsole configuration file.
+ *  On success returns zero, else sets an error message and returns errno.
+ */
+int DirectorClient::ReadConfig(const char *path)
+{
+   FILE *fs;
+   char buf[4096];
+   size_t n;
+   int depth = 0;
+   bool in_dir = false, found = false;
+   tString text, key, val, resource;
+   tStringList tokens;
+   tStringListIterator t;
+
+   verr.clear();
+   fs = fopen(path, "r");
+   if (!fs) {
+      verr.SetErrorWithErrno(errno, "cannot open bconsole config %s", path);
+      return verr.GetError();
+   }
+   while ((n = fread(buf, 1, sizeof(buf), fs)) > 0) text.append(buf, n);
+   fclose(fs);
+
+   dir_name.clear();
+   address.clear();
+   password.clear();
+   port = DEFAULT_DIRECTOR_PORT;
+   tokenize_bacula_conf(text, tokens);
+   key.clear();
+   for (t = tokens.begin(); t != tokens.end() && !found; t++) {
+      if (*t == "{") {
+         ++depth;
+         if (depth == 1) {
+            tToLower(resource);
+            in_dir = (resource == "director");
+         }
+         key.clear();
+         continue;
+      }
+      if (*t == "}") {
+         --depth;
+         if (depth == 0 && in_dir) found = true;
+         key.clear();
+         resource.clear();
+         continue;
+      }
+      if (*t == "\n") {
+         key.clear();
+         continue;
+      }
+      if (depth == 0) {
+         resource = *t;
+         continue;
+      }
+      if (!in_dir || depth != 1) continue;
+      if (*t == "=") {
+         /* Value is the next token */
+         ++t;
+         if (t == tokens.end()) break;
+         val = (*t)[0] == '"' ? t->substr(1) : *t;
+         tToLower(key);
+         if (key == "name") dir_name = val;
+         else if (key == "address") address = val;
+         else if (key == "dirport") port = (int)strtol(val.c_str(), NULL, 10);
+         else if (key == "password") password = val;
+         key.clear();
+         continue;
+      }
+      /* Keywords may be written with embedded spaces, eg. "DIR Port" */
+      key += *t;
+   }
+   if (!found) {
+      verr.SetError(EINVAL, "no Director resource in bconsole config %s", path);
+      return EINVAL;
+   }
+   if (address.empty() || password.empty() || port <= 0 || port > 65535) {
+      verr.SetError(EINVAL, "Director resource in %s must specify Address, DIRport, and Password", path);
+      return EINVAL;
+   }
+   return 0;
+}
+
+
+/*------------------------------------------------------------------
+ *  Class DirectorClient
+ *-----------------------------------------------------------------*/
+
+DirectorClient::DirectorClient() : sock(-1), timeout(30), port(DEFAULT_DIRECTOR_PORT)
+{
+}
+
+DirectorClient::~DirectorClient()
+{
+   Close();
+}
+
+
+/*
+ *  Function to wait for a socket to become ready for reading or writing.
+ *  On success returns zero, else returns errno.
+ */
+static int wait_socket(int fd, short events, int timeout_sec)
+{
+   struct pollfd pfd;
+   int rc;
+
+   pfd.fd = fd;
+   pfd.events = events;
+   do {
+      rc = poll(&pfd, 1, timeout_sec * 1000);
+   } while (rc < 0 && errno == EINTR);
+   if (rc < 0) return errno;
+   if (rc == 0) return ETIMEDOUT;
+   return 0;
+}
+
+
+/*
+ *  Function to write a buffer completely to a socket, waiting no longer
+ *  than 'timeout_sec' seconds for the socket to accept more data.
+ *  On success returns zero, else returns errno.
+ */
+static int send_all(int fd, const char *buf, size_t len, int timeout_sec)
+{
+   ssize_t rc;
+
+   while (len) {
+      if ((rc = wait_socket(fd, POLLOUT, timeout_sec)) != 0) return rc;
+      rc = send(fd, buf, len, MSG_NOSIGNAL);
+      if (rc < 0) {
+         if (errno == EINTR || errno == EAGAIN) continue;
+         return errno;
+      }
+      buf += rc;
+      len -= rc;
+   }
+   return 0;
+}
+
+
+/*
+ *  Method to send a message to the Director.
+ *  On success returns zero, else closes the connection and returns errno.
+ */
+int DirectorClient::SendMsg(const char *msg, size_t len)
+{
+   uint32_t hdr = htonl((uint32_t)len);
+   tString pkt((const char*)&hdr, sizeof(hdr));
+   int rc;
+
+   if (sock < 0) return ENOTCONN;
+   pkt.append(msg, len);
+   if ((rc = send_all(sock, pkt.data(), pkt.size(), timeout)) != 0) {
+      verr.SetErrorWithErrno(rc, "error sending to Director");
+      Close();
+   }
+   return rc;
+}
+
+
+/*
+ *  Method to send a signal to the Director.
+ *  On success returns zero, else closes the connection and returns errno.
+ */
+int DirectorClient::SendSignal(int sig)
+{
+   uint32_t hdr = htonl((uint32_t)sig);
+   int rc;
+
+   if (sock < 0) return ENOTCONN;
+   if ((rc = send_all(sock, (const char*)&hdr, sizeof(hdr), timeout)) != 0) {
+      verr.SetErrorWithErrno(rc, "error sending to Director");
+      Close();
+   }
+   return rc;
+}
+
+
+/*
+ *  Method to receive the next message or signal from the Director. If a
+ *  signal is received, 'sig' is set to the (negative) signal, else 'sig' is
+ *  set to zero and the message is placed in 'msg'.
+ *  On success returns zero, else closes the connection and returns errno.
+ */
+int DirectorClient::RecvMsg(tString &msg, int &sig)
+{
+   unsigned char hdr[4];
+   char buf[4096];
+   size_t need = sizeof(hdr), got = 0;
+   int32_t len;
+   ssize_t rc;
+
+   msg.clear();
+   sig = 0;
+   if (sock < 0) return ENOTCONN;
+   /* Read length, then message */
+   for (int part = 0; part < 2; part++) {
+      while (got < need) {
+         if ((rc = wait_socket(sock, POLLIN, timeout)) != 0) {
+            verr.SetErrorWithErrno(rc, "error receiving from Director");
+            Close();
+            return rc;
+         }
+         if (part == 0) rc = recv(sock, hdr + got, need - got, 0);
+         else rc = recv(sock, buf, need - got < sizeof(buf) ? need - got : sizeof(buf), 0);
+         if (rc < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+         if (rc <= 0) {
+            rc = rc ? errno : ECONNRESET;
+            verr.SetErrorWithErrno(rc, "error receiving from Director");
+            Close();
+            return rc;
+         }
+         if (part) msg.append(buf, rc);
+         got += rc;
+      }
+      if (part) break;
+      len = (int32_t)(((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16)
+            | ((uint32_t)hdr[2] << 8) | (uint32_t)hdr[3]);
+      if (len < 0) {
+         sig = len;
+         return 0;
+      }
+      if (len > MAX_DIRECTOR_MSG) {
+         verr.SetError(EPROTO, "message of %d bytes from Director is too long", len);
+         Close();
+         return EPROTO;
+      }
+      need = len;
+      got = 0;
+   }
+   return 0;
+}
+
+
+/*
+ *  Method to answer the Director's CRAM-MD5 challenge.
+ *  On success returns zero, else returns errno.
+ */
+int DirectorClient::RespondToChallenge()
+{
+   int rc, sig, tls = 0;
+   char chal[256];
+   bool compatible = true;
+   unsigned char hmac[16];
+   tString msg, resp;
+
+   if ((rc = RecvMsg(msg, sig)) != 0) return rc;
+   if (sig || msg.size() >= sizeof(chal)) {
+      verr.SetError(EPROTO, "unexpected reply from Director to Hello");
+      return EPROTO;
+   }
+   if (sscanf(msg.c_str(), "auth cram-md5c %255s ssl=%d", chal, &tls) != 2) {
+      compatible = false;
+      if (sscanf(msg.c_str(), "auth cram-md5 %255s ssl=%d", chal, &tls) != 2) {
+         tStrip(msg);
+         verr.SetError(EPROTO, "Director refused connection: %s", msg.c_str());
+         return EPROTO;
+      }
+   }
+   if (tls == 2) {
+      verr.SetError(EPROTO, "Director requires TLS, which is not supported by the native console");
+      return EPROTO;
+   }
+   hmac_md5((const unsigned char*)chal, strlen(chal), (const unsigned char*)password.c_str(),
+         password.size(), hmac);
+   resp = bacula_base64(hmac, sizeof(hmac), compatible);
+   if ((rc = SendMsg(resp.c_str(), resp.size() + 1)) != 0) return rc;
+   if ((rc = RecvMsg(msg, sig)) != 0) return rc;
+   if (sig || msg.compare(0, 12, "1000 OK auth") != 0) {
+      verr.SetError(EACCES, "Director rejected password for %s", CONSOLE_NAME);
+      return EACCES;
+   }
+   return 0;
+}
+
+
+/*
+ *  Method to issue a CRAM-MD5 challenge to the Director, so that the Director
+ *  must prove it also knows the password.
+ *  On success returns zero, else returns errno.
+ */
+int DirectorClient::ChallengeDirector()
+{
+   int rc, sig;
+   unsigned char hmac[16];
+   struct timeval tv;
+   tString chal, msg;
+
+   gettimeofday(&tv, NULL);
+   srandom((unsigned int)(tv.tv_usec ^ tv.tv_sec ^ getpid()));
+   tFormat(chal, "<%u.%u@vchanger>", (unsigned int)random(), (unsigned int)tv.tv_sec);
+   tFormat(msg, "auth cram-md5c %s ssl=0\n", chal.c_str());
+   if ((rc = SendMsg(msg)) != 0) return rc;
+   if ((rc = RecvMsg(msg, sig)) != 0) return rc;
+   if (sig) {
+      verr.SetError(EPROTO, "unexpected signal %d from Director during authentication", sig);
+      return EPROTO;
+   }
+   msg.erase(msg.find_last_not_of(tString("\r\n\0", 3)) + 1);
+   hmac_md5((const unsigned char*)chal.c_str(), chal.size(), (const unsigned char*)password.c_str(),
+         password.size(), hmac);
+   if (msg != bacula_base64(hmac, sizeof(hmac), true) && msg != bacula_base64(hmac, sizeof(hmac), false)) {
+      SendMsg(tString("1999 Authorization failed.\n"));
+      verr.SetError(EACCES, "Director failed to authenticate - wrong password or not a Director");
+      return EACCES;
+   }
+   return SendMsg(tString("1000 OK auth\n"));
+}
+
+
+/*
+ *  Method to perform the console's side of the authentication handshake.
+ *  On success returns zero, else returns errno.
+ */
+int DirectorClient::Authenticate()
+{
+   int rc, sig;
+   tString msg;
+
+   tFormat(msg, "Hello %s calling\n", CONSOLE_NAME);
+   if ((rc = SendMsg(msg)) != 0) return rc;
+   if ((rc = RespondToChallenge()) != 0) return rc;
+   if ((rc = ChallengeDirector()) != 0) return rc;
+   if ((rc = RecvMsg(msg, sig)) != 0) return rc;
+   if (sig || msg.compare(0, 7, "1000 OK") != 0) {
+      tStrip(msg);
+      verr.SetError(EACCES, "Director refused console: %s", msg.c_str());
+      return EACCES;
+   }
+   tStrip(msg);
+   vlog.Debug("director: %s", msg.c_str());
+   return 0;
+}
+
+
+/*
+ *  Method to connect to the Director and authenticate. The Director's
+ *  address and password must first have been read with ReadConfig(). The
+ *  value of 'timeout_sec' is used for connecting and for each subsequent
+ *  send or receive.
+ *  On success returns zero, else sets an error message and returns errno.
+ */
+int DirectorClient::Connect(int timeout_sec)
+{
+   int rc = 0, fd = -1, on = 1;
+   socklen_t len;
+   char portstr[16];
+   struct addrinfo hints, *res = NULL, *ai;
+   MD5_CTX_T ctx;
+   unsigned char digest[16];
+   tString pw_md5;
+
+   Close();
+   verr.clear();
+   timeout = timeout_sec;
+   snprintf(portstr, sizeof(portstr), "%d", port);
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   rc = getaddrinfo(address.c_str(), portstr, &hints, &res);
+   if (rc) {
+      verr.SetError(EHOSTUNREACH, "cannot resolve Director address %s: %s", address.c_str(),
+            gai_strerror(rc));
+      return EHOSTUNREACH;
+   }
+   for (ai = res; ai; ai = ai->ai_next) {
+#ifdef SOCK_CLOEXEC
+      fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+#else
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+#endif
+      if (fd < 0) {
+         rc = errno;
+         continue;
+      }
+      /* Connect without blocking longer than the timeout */
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+      rc = errno;
+      if (rc == EINPROGRESS) {
+         rc = wait_socket(fd, POLLOUT, timeout);
+         if (rc == 0) {
+            len = sizeof(rc);
+            if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &rc, &len)) rc = errno;
+            if (rc == 0) break;
+         }
+      }
+      close(fd);
+      fd = -1;
+   }
+   freeaddrinfo(res);
+   if (fd < 0) {
+      verr.SetErrorWithErrno(rc, "cannot connect to Director at %s:%d", address.c_str(), port);
+      return rc ? rc : ECONNREFUSED;
+   }
+   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+   sock = fd;
+
+   /* The key for CRAM-MD5 is the hex MD5 digest of the password */
+   md5_init(ctx);
+   md5_update(ctx, (const unsigned char*)password.c_str(), password.size());
+   md5_final(ctx, digest);
+   for (rc = 0; rc < 16; rc++) {
+      snprintf(portstr, sizeof(portstr), "%02x", digest[rc]);
+      pw_md5 += portstr;
+   }
+   password.swap(pw_md5);
+   rc = Authenticate();
+   password.swap(pw_md5);
+   if (rc) {
+      Close();
+      return rc;
+   }
+   vlog.Info("connected to Director %s at %s:%d", dir_name.c_str(), address.c_str(), port);
+   return 0;
+}
+
+
+/*
+ *  Method to issue a console command. The output of the command is placed
+ *  in 'output'. Each time the Director prompts for input, the next string in
+ *  'answers' is sent. If the Director prompts for more input than there
+ *  are answers, an empty line is sent to cancel the prompt and the command
+ *  fails with EINVAL.
+ *  On success returns zero, else returns errno.
+ */
+int DirectorClient::Command(const char *cmd, const tStringList &answers, tString &output)
+{
+   int rc, sig, result = 0;
+   tString msg;
+   tStringListConstIterator ans = answers.begin();
+
+   output.clear();
+   verr.clear();
+   if (sock < 0) {
+      verr.SetError(ENOTCONN, "not connected to Director");
+      return ENOTCONN;
+   }
+   if ((rc = SendMsg(cmd, strlen(cmd))) != 0) return rc;
+   for (;;) {
+      if ((rc = RecvMsg(msg, sig)) != 0) return rc;
+      if (!sig) {
+         output += msg;
+         continue;
+      }
+      switch (sig) {
+      case BNET_EOD:
+         /* End of command */
+         return result;
+      case BNET_SUB_PROMPT:
+      case BNET_TEXT_INPUT:
+      case BNET_YESNO:
+      case BNET_SELECT_INPUT:
+         /* Director is prompting for input */
+         if (ans == answers.end()) {
+            verr.SetError(EINVAL, "unexpected prompt from Director");
+            result = EINVAL;
+            rc = SendMsg("", 0);
+         } else {
+            output += *ans;
+            output += "\n";
+            rc = SendMsg(*ans);
+            ++ans;
+         }
+         if (rc) return rc;
+         break;
+      case BNET_HEARTBEAT:
+         if ((rc = SendSignal(BNET_HB_RESPONSE)) != 0) return rc;
+         break;
+      case BNET_INVALID_CMD:
+      case BNET_CMD_FAILED:
+         verr.SetError(EINVAL, "Director reports command failed");
+         result = EINVAL;
+         break;
+      case BNET_TERMINATE:
+         verr.SetError(ECONNRESET, "Director terminated connection");
+         Close();
+         return ECONNRESET;
+      default:
+         /* Other signals are informational */
+         break;
+      }
+   }
+}
+
+
+/*
+ *  Method to close the connection to the Director.
+ */
+void DirectorClient::Close()
+{
+   uint32_t hdr;
+
+   if (sock < 0) return;
+   /* Tell Director this console is terminating */
+   hdr = htonl((uint32_t)BNET_TERMINATE);
+   send(sock, &hdr, sizeof(hdr), MSG_NOSIGNAL);
+   close(sock);
+   sock = -1;
+}
+
+#endif
@@ -0,0 +1,68 @@
+/*  dirclient.h
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2020 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+*/
+
+#ifndef DIRCLIENT_H_
+#define DIRCLIENT_H_
+
+#include "tstring.h"
+#include "errhandler.h"
+
+#define DEFAULT_DIRECTOR_PORT 9101
+
+/*
+ *  Client for the Bacula Director's console protocol. Connects to the
+ *  Director defined in a bconsole configuration file, authenticates as the
+ *  default console, and issues console commands over a single connection.
+ */
+class DirectorClient
+{
+public:
+   DirectorClient();
+   ~DirectorClient();
+   int ReadConfig(const char *path);
+   int Connect(int timeout_sec);
+   int Command(const char *cmd, const tStringList &answers, tString &output);
+   void Close();
+   inline bool IsConnected() const { return sock >= 0; }
+   inline const tString& DirectorName() const { return dir_name; }
+   inline int GetError() { return verr.GetError(); }
+   inline const char* GetErrorMsg() const { return verr.GetErrorMsg(); }
+protected:
+   int SendMsg(const char *msg, size_t len);
+   int SendMsg(const tString &msg) { return SendMsg(msg.c_str(), msg.size()); }
+   int SendSignal(int sig);
+   int RecvMsg(tString &msg, int &sig);
+   int RespondToChallenge();
+   int ChallengeDirector();
+   int Authenticate();
+protected:
+   int sock;
+   int timeout;
+   int port;
+   tString dir_name;
+   tString address;
+   tString password;
+   ErrorHandler verr;
+};
+
+#endif /* DIRCLIENT_H_ */
@@ -0,0 +1,557 @@
+/* dirclient_test.cpp
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2020 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+ *
+ *  Test of the native console client, run by 'make check'. A mock Director
+ *  listening on the loopback interface speaks the length-prefixed console
+ *  protocol and performs the mutual CRAM-MD5 authentication, so that the
+ *  client can be tested without a Bacula installation. The client source
+ *  is included so that the mock Director shares its MD5 and base64 code.
+ */
+
+#include "dirclient.cpp"
+
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+#include "vconf.h"
+#include "bconsole.h"
+
+#ifndef HAVE_WINDOWS_H
+
+#define MOCK_PASSWORD "mock-director-secret"
+#define MOCK_STORAGE "mockchanger"
+
+static int failures = 0;
+static tString test_dir;
+
+
+/*
+ *  Function to report the result of one check.
+ */
+static void check(bool ok, const char *what)
+{
+   printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+   if (!ok) ++failures;
+}
+
+
+/*------------------------------------------------------------------
+ *  Mock Director
+ *-----------------------------------------------------------------*/
+
+/*
+ *  Function to write a buffer completely to the mock Director's client.
+ *  Returns zero on success, else returns errno.
+ */
+static int mock_write(int fd, const void *buf, size_t len)
+{
+   return send_all(fd, (const char*)buf, len, 10);
+}
+
+
+/*
+ *  Function to send a message, or a signal if 'sig' is negative.
+ *  Returns zero on success, else returns errno.
+ */
+static int mock_send(int fd, const tString &msg, int sig = 0)
+{
+   uint32_t hdr = htonl((uint32_t)(sig ? sig : (int)msg.size()));
+   int rc = mock_write(fd, &hdr, sizeof(hdr));
+   if (rc || sig) return rc;
+   return mock_write(fd, msg.data(), msg.size());
+}
+
+
+/*
+ *  Function to receive a message from the client. A signal is returned in
+ *  'sig', otherwise 'sig' is set to zero.
+ *  Returns zero on success, else returns errno.
+ */
+static int mock_recv(int fd, tString &msg, int &sig)
+{
+   unsigned char hdr[4];
+   char buf[4096];
+   size_t got = 0, need = sizeof(hdr);
+   ssize_t n;
+   int32_t len;
+
+   msg.clear();
+   sig = 0;
+   while (got < need) {
+      if (wait_socket(fd, POLLIN, 10)) return ETIMEDOUT;
+      n = recv(fd, hdr + got, need - got, 0);
+      if (n <= 0) return ECONNRESET;
+      got += n;
+   }
+   len = (int32_t)(((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16)
+         | ((uint32_t)hdr[2] << 8) | (uint32_t)hdr[3]);
+   if (len < 0) {
+      sig = len;
+      return 0;
+   }
+   while ((int32_t)msg.size() < len) {
+      if (wait_socket(fd, POLLIN, 10)) return ETIMEDOUT;
+      n = recv(fd, buf, len - msg.size() < sizeof(buf) ? len - msg.size() : sizeof(buf), 0);
+      if (n <= 0) return ECONNRESET;
+      msg.append(buf, n);
+   }
+   return 0;
+}
+
+
+/*
+ *  Function to compute the CRAM-MD5 response to 'chal' for 'password', the
+ *  way a Director does, keyed by the hex MD5 digest of the password.
+ */
+static tString mock_cram_response(const tString &chal, const char *password)
+{
+   MD5_CTX_T ctx;
+   unsigned char digest[16], hmac[16];
+   char hex[3];
+   tString key;
+   int i;
+
+   md5_init(ctx);
+   md5_update(ctx, (const unsigned char*)password, strlen(password));
+   md5_final(ctx, digest);
+   for (i = 0; i < 16; i++) {
+      snprintf(hex, sizeof(hex), "%02x", digest[i]);
+      key += hex;
+   }
+   hmac_md5((const unsigned char*)chal.c_str(), chal.size(), (const unsigned char*)key.c_str(),
+         key.size(), hmac);
+   return bacula_base64(hmac, sizeof(hmac), true);
+}
+
+
+/*
+ *  Function to append a line to the log of commands received by the mock
+ *  Director, which the test reads back.
+ */
+static void mock_log(const tString &line)
+{
+   FILE *fs;
+   tString path(test_dir + "/director.log");
+
+   fs = fopen(path.c_str(), "a");
+   if (!fs) return;
+   fprintf(fs, "%s\n", line.c_str());
+   fclose(fs);
+}
+
+
+/*
+ *  Function to authenticate a console connection as a Director does,
+ *  challenging the console first and then answering its challenge.
+ *  Returns zero if the console was authenticated.
+ */
+static int mock_authenticate(int fd)
+{
+   int sig;
+   char chal[256];
+   tString msg, mychal("<1234.5678@mock-dir>");
+
+   if (mock_recv(fd, msg, sig) || msg.compare(0, 6, "Hello ") != 0) return -1;
+   tFormat(msg, "auth cram-md5c %s ssl=0\n", mychal.c_str());
+   if (mock_send(fd, msg)) return -1;
+   if (mock_recv(fd, msg, sig)) return -1;
+   msg.erase(msg.find_last_not_of(tString("\r\n\0", 3)) + 1);
+   if (msg != mock_cram_response(mychal, MOCK_PASSWORD)) {
+      mock_log("auth failed");
+      mock_send(fd, tString("1999 Authorization failed.\n"));
+      return -1;
+   }
+   if (mock_send(fd, tString("1000 OK auth\n"))) return -1;
+   if (mock_recv(fd, msg, sig) || sscanf(msg.c_str(), "auth cram-md5c %255s", chal) != 1) return -1;
+   if (mock_send(fd, mock_cram_response(tString(chal), MOCK_PASSWORD))) return -1;
+   if (mock_recv(fd, msg, sig) || msg.compare(0, 12, "1000 OK auth") != 0) return -1;
+   return mock_send(fd, tString("1000 OK: 103 mock-dir Version: 13.0.0\n"));
+}
+
+
+/*
+ *  Function to perform a label command, prompting twice for confirmation
+ *  as the Director does for 'label barcodes'.
+ *  Returns zero on success, else returns errno.
+ */
+static int mock_label(int fd)
+{
+   int n, sig, rc;
+   tString msg;
+
+   mock_send(fd, tString("The following Volumes will be labeled:\n"));
+   for (n = 0; n < 2; n++) {
+      mock_send(fd, tString("Do you want to label these Volumes? (yes|no): "));
+      if ((rc = mock_send(fd, tString(), BNET_YESNO)) != 0) return rc;
+      if ((rc = mock_recv(fd, msg, sig)) != 0) return rc;
+      mock_log("answer " + msg);
+      if (msg != "yes") {
+         mock_send(fd, tString("Label command cancelled.\n"));
+         mock_send(fd, tString(), BNET_CMD_FAILED);
+         return mock_send(fd, tString(), BNET_EOD);
+      }
+   }
+   mock_send(fd, tString("Catalog record for Volume \"vol1\", Slot 1 successfully created.\n"));
+   mock_send(fd, tString("Catalog record for Volume \"vol2\", Slot 2 successfully created.\n"));
+   return mock_send(fd, tString(), BNET_EOD);
+}
+
+
+/*
+ *  Function to serve one console connection. The command "fail" fails with
+ *  BNET_CMD_FAILED, "heartbeat" sends a heartbeat before its output, and
+ *  "quit" makes the Director terminate the connection. Other commands
+ *  succeed, echoing their command line and the number of commands issued
+ *  so far on the connection.
+ */
+static void mock_serve(int fd)
+{
+   int sig, count = 0;
+   tString msg, out;
+
+   if (mock_authenticate(fd)) return;
+   mock_log("connected");
+   for (;;) {
+      if (mock_recv(fd, msg, sig)) return;
+      if (sig == BNET_TERMINATE) {
+         mock_log("terminated");
+         return;
+      }
+      if (sig == BNET_HB_RESPONSE) {
+         mock_log("heartbeat response");
+         continue;
+      }
+      if (sig) continue;
+      mock_log("command " + msg);
+      ++count;
+      if (msg.compare(0, 6, "label ") == 0) {
+         if (mock_label(fd)) return;
+      } else if (msg == "fail") {
+         mock_send(fd, tString("Command failed.\n"));
+         mock_send(fd, tString(), BNET_CMD_FAILED);
+         mock_send(fd, tString(), BNET_EOD);
+      } else if (msg == "quit") {
+         mock_send(fd, tString(), BNET_TERMINATE);
+         return;
+      } else {
+         if (msg == "heartbeat") mock_send(fd, tString(), BNET_HEARTBEAT);
+         tFormat(out, "%s: command %d on this connection\n", msg.c_str(), count);
+         mock_send(fd, out);
+         mock_send(fd, tString(), BNET_EOD);
+      }
+   }
+}
+
+
+/*
+ *  Function to start the mock Director in a child process listening on the
+ *  loopback interface. Its port is placed in 'port'.
+ *  Returns the child's pid, or -1 on error.
+ */
+static int start_mock_director(int &port)
+{
+   int lfd, fd, pid, on = 1;
+   struct sockaddr_in addr;
+   socklen_t len = sizeof(addr);
+
+   lfd = socket(AF_INET, SOCK_STREAM, 0);
+   if (lfd < 0) return -1;
+   setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) || listen(lfd, 4)
+         || getsockname(lfd, (struct sockaddr*)&addr, &len)) {
+      close(lfd);
+      return -1;
+   }
+   port = ntohs(addr.sin_port);
+   pid = fork();
+   if (pid) {
+      close(lfd);
+      return pid;
+   }
+   for (;;) {
+      fd = accept(lfd, NULL, NULL);
+      if (fd < 0) continue;
+      mock_serve(fd);
+      close(fd);
+   }
+}
+
+
+/*
+ *  Function to find a loopback port on which nothing is listening.
+ *  Returns the port, or -1 on error.
+ */
+static int unused_port()
+{
+   int fd, port;
+   struct sockaddr_in addr;
+   socklen_t len = sizeof(addr);
+
+   fd = socket(AF_INET, SOCK_STREAM, 0);
+   if (fd < 0) return -1;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || getsockname(fd, (struct sockaddr*)&addr, &len)) {
+      close(fd);
+      return -1;
+   }
+   port = ntohs(addr.sin_port);
+   close(fd);
+   return port;
+}
+
+
+/*------------------------------------------------------------------
+ *  Test helpers
+ *-----------------------------------------------------------------*/
+
+/*
+ *  Function to write file 'name' in the test directory.
+ *  Returns the file's path.
+ */
+static tString write_test_file(const char *name, const tString &text, mode_t mode = 0600)
+{
+   FILE *fs;
+   tString path(test_dir + "/" + name);
+
+   fs = fopen(path.c_str(), "w");
+   if (fs) {
+      fwrite(text.c_str(), 1, text.size(), fs);
+      fclose(fs);
+   }
+   chmod(path.c_str(), mode);
+   return path;
+}
+
+
+/*
+ *  Function to read file 'name' in the test directory.
+ */
+static tString read_test_file(const char *name)
+{
+   FILE *fs;
+   char buf[4096];
+   size_t n;
+   tString text, path(test_dir + "/" + name);
+
+   fs = fopen(path.c_str(), "r");
+   if (!fs) return text;
+   while ((n = fread(buf, 1, sizeof(buf), fs)) > 0) text.append(buf, n);
+   fclose(fs);
+   return text;
+}
+
+
+/*
+ *  Function to write a bconsole config file naming a Director on the
+ *  loopback interface at 'port' with password 'password'.
+ *  Returns the file's path.
+ */
+static tString write_bconsole_conf(const char *name, int port, const char *password)
+{
+   tString text;
+
+   tFormat(text, "# bconsole config\nDirector {\n  Name = mock-dir\n  DIRport = %d\n"
+         "  Address = 127.0.0.1\n  Password = \"%s\"\n}\n", port, password);
+   return write_test_file(name, text);
+}
+
+
+/*------------------------------------------------------------------
+ *  Tests
+ *-----------------------------------------------------------------*/
+
+/*
+ *  Function to test authentication and several commands, including a
+ *  label command with prompts and a failing command, over one connection.
+ */
+static void test_commands(int port)
+{
+   int rc;
+   tString conf_path, output;
+   tStringList none, answers;
+   DirectorClient dir;
+
+   conf_path = write_bconsole_conf("good.conf", port, MOCK_PASSWORD);
+   check(dir.ReadConfig(conf_path.c_str()) == 0, "read bconsole config");
+   check(dir.DirectorName() == "mock-dir", "Director name from config");
+   rc = dir.Connect(10);
+   check(rc == 0 && dir.IsConnected(), "authenticate with correct password");
+   if (rc) return;
+
+   rc = dir.Command("update slots storage=\"" MOCK_STORAGE "\" drive=\"0\"", none, output);
+   check(rc == 0 && output.find("command 1 on this connection") != tString::npos,
+         "first command succeeds");
+
+   answers.push_back("yes");
+   answers.push_back("yes");
+   rc = dir.Command("label storage=\"" MOCK_STORAGE "\" pool=\"Default\" barcodes", answers, output);
+   check(rc == 0 && output.find("Slot 2 successfully created") != tString::npos,
+         "label answers both yes/yes prompts");
+
+   answers.pop_back();
+   rc = dir.Command("label storage=\"" MOCK_STORAGE "\" pool=\"Default\" barcodes", answers, output);
+   check(rc == EINVAL && dir.IsConnected(), "label with too few answers fails and cancels prompt");
+
+   rc = dir.Command("fail", none, output);
+   check(rc == EINVAL && output.find("Command failed") != tString::npos,
+         "BNET_CMD_FAILED fails command up to BNET_EOD");
+   check(dir.IsConnected(), "connection usable after failed command");
+
+   rc = dir.Command("heartbeat", none, output);
+   check(rc == 0 && output.find("command 5 on this connection") != tString::npos,
+         "heartbeat answered and later command on same connection succeeds");
+
+   rc = dir.Command("quit", none, output);
+   check(rc == ECONNRESET && !dir.IsConnected(), "BNET_TERMINATE from Director closes connection");
+   dir.Close();
+
+   output = read_test_file("director.log");
+   check(output.find("answer yes\nanswer \n") != tString::npos, "empty line sent to cancel unanswered prompt");
+   check(output.find("heartbeat response") != tString::npos, "heartbeat response sent");
+}
+
+
+/*
+ *  Function to test that a wrong password is refused.
+ */
+static void test_wrong_password(int port)
+{
+   int rc;
+   tString conf_path;
+   DirectorClient dir;
+
+   conf_path = write_bconsole_conf("bad.conf", port, "not-the-password");
+   check(dir.ReadConfig(conf_path.c_str()) == 0, "read bconsole config with wrong password");
+   rc = dir.Connect(10);
+   check(rc == EACCES && !dir.IsConnected(), "authentication with wrong password refused");
+}
+
+
+/*
+ *  Function to set up the changer configuration for the bconsole tests,
+ *  using the bconsole config 'bc_conf' and a stub bconsole program that
+ *  records its input and echoes the marker lines bconsole would echo.
+ */
+static void setup_changer_conf(const tString &bc_conf)
+{
+   tString stub;
+
+   tFormat(stub, "#!/bin/sh\nwhile IFS= read -r l; do\n  echo \"$l\" >> \"%s/bconsole.in\"\n"
+         "  case \"$l\" in\n  \"@echo \"*) echo \"${l#@echo }\";;\n  esac\ndone\n", test_dir.c_str());
+   conf.storage_name = MOCK_STORAGE;
+   conf.work_dir = test_dir;
+   conf.bconsole = write_test_file("bconsole", stub, 0700);
+   conf.bconsole_config = bc_conf;
+   conf.native_console = true;
+}
+
+
+/*
+ *  Function to test issuing update and label commands through the native
+ *  console, as the bconsole worker does.
+ */
+static void test_native_console(int port)
+{
+   LabelPoolMap pools;
+   tString text;
+
+   unlink((test_dir + "/bconsole.in").c_str());
+   unlink((test_dir + "/director.log").c_str());
+   setup_changer_conf(write_bconsole_conf("good.conf", port, MOCK_PASSWORD));
+   pools["Default"] = "1-2";
+   IssueBconsoleCommands(true, tString("1-2"), pools);
+   text = read_test_file("director.log");
+   check(text.find("command update slots=1-2 storage=\"" MOCK_STORAGE "\"") != tString::npos
+         && text.find("command label storage=\"" MOCK_STORAGE "\" pool=\"Default\" slots=1-2 barcodes")
+         != tString::npos, "update and label issued over one native console connection");
+   check(text.find("connected") == text.rfind("connected"), "commands share one connection");
+   check(read_test_file("bconsole.in").empty(), "bconsole not run when Director reachable");
+   text = read_test_file(LABEL_SUMMARY_FILE);
+   check(text.find("status=ok labeled=2") != tString::npos, "label summary records labeled volumes");
+}
+
+
+/*
+ *  Function to test that bconsole is run when the Director refuses the
+ *  connection.
+ */
+static void test_fallback()
+{
+   int port = unused_port();
+   tString text;
+   LabelPoolMap pools;
+
+   unlink((test_dir + "/bconsole.in").c_str());
+   setup_changer_conf(write_bconsole_conf("refused.conf", port, MOCK_PASSWORD));
+   IssueBconsoleCommands(true, tString(), pools);
+   text = read_test_file("bconsole.in");
+   check(text.find("update slots storage=\"" MOCK_STORAGE "\" drive=\"0\"") != tString::npos,
+         "refused connection falls back to bconsole");
+}
+
+
+int main(int argc, char *argv[])
+{
+   int pid, port = 0, status;
+   char tmpl[] = "/tmp/vchanger-test.XXXXXX";
+
+   signal(SIGPIPE, SIG_IGN);
+   if (!mkdtemp(tmpl)) {
+      perror("mkdtemp");
+      return 1;
+   }
+   test_dir = tmpl;
+   pid = start_mock_director(port);
+   if (pid < 0) {
+      fprintf(stderr, "cannot start mock Director: errno=%d\n", errno);
+      return 77;  /* skip */
+   }
+   test_commands(port);
+   test_wrong_password(port);
+   test_native_console(port);
+   test_fallback();
+   kill(pid, SIGTERM);
+   waitpid(pid, &status, 0);
+   if (!failures) {
+      if (system(("rm -rf '" + test_dir + "'").c_str())) {}
+   }
+   printf("%d checks failed\n", failures);
+   return failures ? 1 : 0;
+}
+
+#else
+int main(int argc, char *argv[])
+{
+   return 77;  /* skip: the native console is not supported on Windows */
+}
+#endif
@@ -56,6 +56,9 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "compat/gettimeofday.h"
 #include "compat/readlink.h"
@@ -64,6 +67,7 @@
 #include "util.h"
 #include "loghandler.h"
 #include "bconsole.h"
+#include "uuidlookup.h"
 #include "diskchanger.h"
 #include "vconf.h"
 
@@ -73,60 +77,205 @@
  *=================================================*/
 
 
+/* Maximum number of threads used to mount magazines concurrently */
+#define MAX_MOUNT_THREADS 8
+
+/* Queue of magazines shared by the magazine mount threads */
+struct MagazineMountQueue
+{
+   MagazineStateArray *mag;
+   const ChangerStateFile *state;
+   size_t next;
+   bool rescan;
+#ifdef HAVE_PTHREAD_H
+   pthread_mutex_t mut;
+#endif
+};
+
+
 /*-------------------------------------------------
- *  Protected method to read previous state of magazine bays.
- *  Returns zero on success, else negative and sets lasterr
+ *  Function run by each magazine mount thread. Takes the next unprocessed
+ *  magazine from the queue, restores its previous state, and determines its
+ *  mountpoint and volume files, until no magazines remain. Each magazine is
+ *  only accessed by the thread that took it.
+ *------------------------------------------------*/
+static void* MountMagazines(void *arg)
+{
+   MagazineMountQueue *q = (MagazineMountQueue*)arg;
+   size_t n;
+
+   for (;;) {
+#ifdef HAVE_PTHREAD_H
+      pthread_mutex_lock(&q->mut);
+#endif
+      n = q->next++;
+#ifdef HAVE_PTHREAD_H
+      pthread_mutex_unlock(&q->mut);
+#endif
+      if (n >= q->mag->size()) break;
+      /* Restore previous slot count and starting virtual slot */
+      (*q->mag)[n].restore(*q->state);
+      /* Get mountpoint and build magazine slot array  */
+      (*q->mag)[n].Mount(q->rescan);
+   }
+   return NULL;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to read previous state of magazine bays and
+ *  mount them. Magazines are restored and scanned concurrently by
+ *  up to MAX_MOUNT_THREADS threads. If 'rescan' is true, magazine
+ *  directories are read even when their volume index is current.
  *-------------------------------------------------*/
-void DiskChanger::InitializeMagazines()
+void DiskChanger::InitializeMagazines(bool rescan)
 {
-   int n;
+   int n, num_threads = 0, hits = 0, misses = 0, uuid_mags = 0;
+   bool resolve_uuids = false;
    MagazineState m;
+   MagazineMountQueue q;
+   MountpointCache mcache;
+   struct timeval t0, t1;
+#ifdef HAVE_PTHREAD_H
+   pthread_t tid[MAX_MOUNT_THREADS];
+#endif
 
+   /* Create magazines in bay order, so that slot assignment does not
+    * depend on the order in which the magazines finish mounting */
    magazine.clear();
    for (n = 0; (size_t)n < conf.magazine.size(); n++) {
       m.SetBay(n, conf.magazine[n].c_str());
       m.prev_num_slots = 0;
       m.prev_start_slot = 0;
       magazine.push_back(m);
-      /* Restore previous slot count and starting virtual slot */
-      magazine[n].restore();
-      /* Get mountpoint and build magazine slot array  */
-      magazine[n].Mount();
    }
+   if (magazine.empty()) return;
+
+   /* Use the cached mountpoints of UUID magazines when the mount table is
+    * unchanged and they are still on the same device. Otherwise, the
+    * mount table is read once and shared by the UUID lookups of all
+    * magazines. */
+   gettimeofday(&t0, NULL);
+   for (n = 0; n < (int)magazine.size(); n++) {
+      if (tCaseFind(magazine[n].mag_dev, "uuid:") != 0) continue;
+      if (uuid_mags++ == 0) mcache.restore();
+      if (rescan || !mcache.Lookup(magazine[n].mag_dev.substr(5), magazine[n].known_mountpoint)) {
+         resolve_uuids = true;
+      }
+   }
+   if (resolve_uuids) LoadMountTable();
+
+   /* Restore and mount magazines concurrently, with this thread
+    * also taking magazines from the queue */
+   q.mag = &magazine;
+   q.state = &state;
+   q.next = 0;
+   q.rescan = rescan;
+#ifdef HAVE_PTHREAD_H
+   pthread_mutex_init(&q.mut, NULL);
+   while (num_threads < MAX_MOUNT_THREADS && (size_t)num_threads + 1 < magazine.size()) {
+      if (pthread_create(&tid[num_threads], NULL, MountMagazines, &q)) break;
+      ++num_threads;
+   }
+#endif
+   MountMagazines(&q);
+#ifdef HAVE_PTHREAD_H
+   for (n = 0; n < num_threads; n++) pthread_join(tid[n], NULL);
+   pthread_mutex_destroy(&q.mut);
+#endif
+   if (resolve_uuids) FreeMountTable();
+   if (uuid_mags) {
+      for (n = 0; n < (int)magazine.size(); n++) {
+         if (tCaseFind(magazine[n].mag_dev, "uuid:") != 0) continue;
+         mcache.Update(magazine[n].mag_dev.substr(5), magazine[n].mountpoint);
+      }
+      mcache.save();
+   }
+   gettimeofday(&t1, NULL);
+   vlog.Debug("mounted %d magazines using %d threads in %ld ms", (int)magazine.size(), num_threads + 1,
+         (long)((t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_usec - t0.tv_usec) / 1000));
+   for (n = 0; n < (int)magazine.size(); n++) {
+      if (magazine[n].empty()) continue;
+      if (magazine[n].index_used) ++hits;
+      else ++misses;
+   }
+   vlog.Info("magazine volume index hits=%d misses=%d", hits, misses);
 }
 
 
 /*-------------------------------------------------
  *  Protected method to find the start of an empty range of
- *  'count' virtual slots, adding slots if needed.
+ *  'count' virtual slots, adding slots if needed. The range
+ *  is allocated from the changer's free slot ranges.
  *  Returns the starting slot number of the range found.
  *------------------------------------------------*/
 int DiskChanger::FindEmptySlotRange(int count)
+{
+   int start = free_slots.Allocate(count);
+   GrowSlots(free_slots.EndSlot());
+   return start;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to add empty virtual slots so that the
+ *  highest slot number is 'end' - 1.
+ *------------------------------------------------*/
+void DiskChanger::GrowSlots(int end)
 {
    VirtualSlot vs;
-   int start = 0, n = 1, found = 0;
-   /* Find next empty slot */
-   while (n < (int)vslot.size() && vslot[n].mag_bay >= 0) n++;
-   start = n;
-   while (n < (int)vslot.size() && found < count) {
-      if (vslot[n].mag_bay < 0) {
-         ++found;
-         ++n;
-      } else {
-         found = 0;
-         while (n < (int)vslot.size() && vslot[n].mag_bay >= 0) n++;
-         start = n;
-      }
-   }
-   if (found >= count) return start;
-   while (found < count) {
-      vs.vs = n++;
+   if ((int)vslot.size() >= end) return;
+   vslot.reserve(end);
+   while ((int)vslot.size() < end) {
+      vs.vs = (int)vslot.size();
       vslot.push_back(vs);
-      ++found;
    }
-   return start;
 }
 
+/*-------------------------------------------------
+ *  Protected method to record that the contents of the 'count' virtual
+ *  slots beginning at slot 'start' have changed, so that Bacula needs an
+ *  'update slots' for them.
+ *------------------------------------------------*/
+void DiskChanger::SlotsChanged(int start, int count)
+{
+   needs_update = true;
+   if (start > 0 && count > 0) changed_slots.Add(start, start + count - 1);
+}
+
+
+/*-------------------------------------------------
+ *  Method to get the list of slots, of the form "1-5,9", that need an
+ *  'update slots' in Bacula. Returns an empty string if all slots should
+ *  be updated, either because which slots changed is unknown or because
+ *  the changes are scattered over too many ranges or over more than half
+ *  of the changer's slots.
+ *------------------------------------------------*/
+tString DiskChanger::UpdateSlotList() const
+{
+   if (changed_slots.empty() || changed_slots.NumRanges() > MAX_UPDATE_RANGES
+         || changed_slots.NumSlots() * 2 > (int)vslot.size() - 1) {
+      return tString();
+   }
+   return changed_slots.Format();
+}
+
+
+/*-------------------------------------------------
+ *  Method to get the list of slots, of the form "1-5,9", holding the
+ *  volumes created by CreateVolumes() that Bacula needs to label. Returns
+ *  an empty string if no volumes were created or if all slots should be
+ *  labeled.
+ *------------------------------------------------*/
+tString DiskChanger::LabelSlotList() const
+{
+   if (new_volume_slots.empty() || new_volume_slots.NumRanges() > MAX_UPDATE_RANGES) {
+      return tString();
+   }
+   return new_volume_slots.Format();
+}
+
+
 /*-------------------------------------------------
  *  Protected method to initialize array of virtual slot and
  *  assign magazine volumes to virtual slots. When possible,
@@ -166,7 +315,7 @@ void DiskChanger::InitializeVirtSlots()
             vlog.Warning("update slots needed. magazine %d no longer mounted; previous: %d volumes in slots %d-%d", m,
                   magazine[m].prev_num_slots, magazine[m].prev_start_slot,
                   magazine[m].prev_start_slot + magazine[m].prev_num_slots - 1);
-            needs_update = true;
+            SlotsChanged(magazine[m].prev_start_slot, magazine[m].prev_num_slots);
          }
          continue;
       }
@@ -178,7 +327,7 @@ void DiskChanger::InitializeVirtSlots()
           * needs new slot assignment and also 'update slots' will be needed */
          vlog.Warning("update slots needed. magazine %d has %d volumes, previously had %d", m,
                   magazine[m].num_slots, magazine[m].prev_num_slots);
-         needs_update = true;
+         SlotsChanged(magazine[m].prev_start_slot, magazine[m].prev_num_slots);
          continue;
       }
       if (magazine[m].num_slots == 0) {
@@ -200,7 +349,7 @@ void DiskChanger::InitializeVirtSlots()
           * 'update slots' will also be needed. */
          vlog.Warning("update slots needed. magazine %d previous slots %d-%d are not available", m,
                   magazine[m].prev_start_slot, magazine[m].prev_start_slot + magazine[m].prev_num_slots - 1);
-         needs_update = true;
+         SlotsChanged(magazine[m].prev_start_slot, magazine[m].prev_num_slots);
          continue;
       }
       /* Assign this magazine's volumes to the same slots as previously assigned */
@@ -215,6 +364,7 @@ void DiskChanger::InitializeVirtSlots()
    }
 
    /* Assign slots to mounted magazines that have not already been assigned. */
+   free_slots.Build(vslot);
    for (m = 0; m < (int)magazine.size(); m++) {
       if (magazine[m].empty() || magazine[m].start_slot > 0) continue;
       if (magazine[m].num_slots == 0) continue;
@@ -224,19 +374,22 @@ void DiskChanger::InitializeVirtSlots()
          vslot[v].mag_bay = m;
          vslot[v].mag_slot = s;
       }
+      SlotsChanged(magazine[m].start_slot, magazine[m].num_slots);
       vlog.Notice("%d volumes on magazine %d assigned slots %d-%d", magazine[m].num_slots, m,
             magazine[m].start_slot, magazine[m].start_slot + magazine[m].num_slots - 1);
    }
 
    /* Save updated state of magazines */
    for (m = 0; m < (int)magazine.size(); m++) {
-      magazine[m].save();
+      magazine[m].save(state);
    }
    /* Update dynamic configuration info */
-   if ((int)vslot.size() >= dconf.max_slot) {
+   if ((int)vslot.size() - 1 > dconf.max_slot) {
       dconf.max_slot = (int)vslot.size() - 1;
-      dconf.save();
    }
+   dconf.save(state);
+   /* Write the changer state only if it changed */
+   state.Commit();
 }
 
 
@@ -246,44 +399,12 @@ void DiskChanger::InitializeVirtSlots()
  *------------------------------------------------*/
 int DiskChanger::InitializeDrives()
 {
-   int n, rc, max_drive = -1;
-   DIR *d;
-   struct dirent *de;
+   int n, max_drive = 0;
    DriveState ds;
-   tString tmp;
 
-   /* For each drive for which a state file exists. try to restore its state */
-   d = opendir(conf.work_dir.c_str());
-   if (!d) {
-      rc = errno;
-      verr.SetErrorWithErrno(rc, "error %d accessing work directory", rc);
-      vlog.Error("ERROR! %s", verr.GetErrorMsg());
-      return rc;
-   }
-   de = readdir(d);
-   while (de) {
-      /* Find next drive state file */
-      tmp = de->d_name;
-      if (tmp.find("drive_state-") == 0) {
-         tmp.erase(0, 12);
-         if (tmp.find_first_of("0123456789") == tString::npos) {
-            de = readdir(d);
-            continue;
-         }
-         if (tmp.find_first_not_of("0123456789") != tString::npos) {
-            de = readdir(d);
-            continue;
-         }
-         n = (int)strtol(tmp.c_str(), NULL, 10);
-         if (n > max_drive) max_drive = n;
-      }
-      de = readdir(d);
-   }
-   closedir(d);
-   if (max_drive < 0) {
-      /* No drive state files exist, so create at least one drive */
-      max_drive = 0;
-   }
+   /* Create drives up to the highest numbered drive having a saved state,
+    * or at least one drive */
+   if (state.MaxDrive() > 0) max_drive = state.MaxDrive();
 
    /* Restore last known state of virtual drives where possible.  */
    for (n = 0; n <= max_drive; n++) {
@@ -294,6 +415,8 @@ int DiskChanger::InitializeDrives()
          vlog.Error("ERROR! %s", verr.GetErrorMsg());
       }
    }
+   /* Drop the saved state of drives that could not be restored */
+   state.Commit();
    return 0;
 }
 
@@ -312,12 +435,13 @@ void DiskChanger::SetMaxDrive(int need)
 }
 
 /*
- *  Method to create symlink for drive pointing to currently loaded volume file
+ *  Method to create symlink for drive pointing to currently loaded volume file.
+ *  An existing symlink is atomically replaced if it points elsewhere.
  */
 int DiskChanger::CreateDriveSymlink(int drv)
 {
    int mag, mslot, rc;
-   tString sname, fname;
+   tString sname, tname, fname;
    char lname[4096];
 
    if (drv < 0 || drv >= (int)drive.size()) {
@@ -335,27 +459,47 @@ int DiskChanger::CreateDriveSymlink(int drv)
       verr.SetError(ENOENT, "cannot create symlink for unloaded drive %d", drv);
       return ENOENT;
    }
+   if (drive[drv].link_known && drive[drv].link == fname) {
+      /* symlink was already found or created by this process */
+      return 0;
+   }
    tFormat(sname, "%s%s%d", conf.work_dir.c_str(), DIR_DELIM, drv);
-   rc = readlink(sname.c_str(), lname, sizeof(lname));
-   if (rc > 0) {
+   if (!drive[drv].link_known) {
+      rc = readlink(sname.c_str(), lname, sizeof(lname));
       if (rc >= (int)sizeof(lname)) {
          verr.SetError(ENAMETOOLONG, "symlink target too long on readlink for drive %d", drv);
          return ENAMETOOLONG;
       }
-      lname[rc] = 0;
-      if (fname == lname) {
-         /* symlink already exists */
-         vlog.Info("found symlink for drive %d -> %s", drv, fname.c_str());
-         return 0;
+      if (rc > 0) {
+         lname[rc] = 0;
+         if (fname == lname) {
+            /* symlink already exists */
+            drive[drv].link_known = true;
+            drive[drv].link = fname;
+            vlog.Info("found symlink for drive %d -> %s", drv, fname.c_str());
+            return 0;
+         }
       }
-      /* Symlink points to wrong mountpoint, so delete and re-create */
-      if (RemoveDriveSymlink(drv)) return EEXIST;
    }
-   if (symlink(fname.c_str(), sname.c_str())) {
+   /* Create the symlink under a temporary name and rename it over the
+    * drive's symlink, so that re-targeting it is atomic and the drive
+    * never appears to be missing */
+   tFormat(tname, "%s.%d.tmp", sname.c_str(), (int)getpid());
+   unlink(tname.c_str());
+   if (symlink(fname.c_str(), tname.c_str())) {
+      rc = errno;
+      verr.SetErrorWithErrno(rc, "error %d creating symlink for drive %d", rc, drv);
+      return rc;
+   }
+   if (rename(tname.c_str(), sname.c_str())) {
       rc = errno;
+      unlink(tname.c_str());
+      drive[drv].link_known = false;
       verr.SetErrorWithErrno(rc, "error %d creating symlink for drive %d", rc, drv);
       return rc;
    }
+   drive[drv].link_known = true;
+   drive[drv].link = fname;
    vlog.Notice("created symlink for drive %d -> %s", drv, fname.c_str());
    return 0;
 }
@@ -374,15 +518,27 @@ int DiskChanger::RemoveDriveSymlink(int drv)
       verr.SetError(EINVAL, "cannot delete symlink for invalid drive %d", drv);
       return EINVAL;
    }
+   if (drive[drv].link_known && drive[drv].link.empty()) {
+      /* symlink is already known not to exist */
+      return 0;
+   }
    /* Remove symlink pointing to loaded volume file */
    tFormat(sname, "%s%s%d", conf.work_dir.c_str(), DIR_DELIM, drv);
    if (unlink(sname.c_str())) {
-      if (errno == ENOENT) return 0;  /* Ignore if not found */
+      if (errno == ENOENT) {
+         /* Ignore if not found */
+         drive[drv].link_known = true;
+         drive[drv].link.clear();
+         return 0;
+      }
       /* System error preventing deletion of symlink */
       rc = errno;
+      drive[drv].link_known = false;
       verr.SetErrorWithErrno(errno, "error %d deleting symlink for drive %d: ", rc, drv);
       return rc;
    }
+   drive[drv].link_known = true;
+   drive[drv].link.clear();
    vlog.Notice("deleted symlink for drive %d", drv);
    return 0;
 }
@@ -390,75 +546,55 @@ int DiskChanger::RemoveDriveSymlink(int drv)
 
 /*-------------------------------------------------
  *  Method to save current drive state, device string and
- *  volume label (filename), to a file in the work
- *  directory named "drive_state-N", where N is the drive number.
+ *  volume label (filename), in the changer state and record
+ *  it in the changer journal.
  *  On success returns zero, else on error sets lasterr and
  *  returns errno.
  *-------------------------------------------------*/
 int DiskChanger::SaveDriveState(int drv)
 {
-   mode_t old_mask;
-   FILE *FS;
    int rc, mag, mslot;
-   tString sname;
+   bool changed;
+   ChangerStateFile::DriveRecord rec;
 
    if (drv < 0 || drv >= (int)drive.size()) {
       verr.SetError(EINVAL, "cannot save state of invalid drive %d", drv);
       return EINVAL;
    }
-   /* Delete old state file */
-   tFormat(sname, "%s%sdrive_state-%d", conf.work_dir.c_str(), DIR_DELIM, drv);
    if (drive[drv].empty()) {
-      if (access(sname.c_str(), F_OK) == 0) {
-         vlog.Notice("deleted state file for drive %d", drv);
-      }
-      unlink(sname.c_str());
-      return 0;
+      /* Delete old state */
+      changed = state.RemoveDrive(drv);
+   } else {
+      mag = vslot[drive[drv].vs].mag_bay;
+      mslot = vslot[drive[drv].vs].mag_slot;
+      rec.dev = magazine[mag].mag_dev;
+      rec.label = magazine[mag].GetVolumeLabel(mslot);
+      changed = state.SetDrive(drv, rec);
    }
-   old_mask = umask(027);
-   FS = fopen(sname.c_str(), "w");
-   if (!FS) {
-      /* Unable to open state file */
-      rc = errno;
-      umask(old_mask);
-      verr.SetErrorWithErrno(rc, "failed opening state file for drive %d", drv);
-      return rc;
-   }
-   mag = vslot[drive[drv].vs].mag_bay;
-   mslot = vslot[drive[drv].vs].mag_slot;
-   if (fprintf(FS, "%s,%s\n", magazine[mag].mag_dev.c_str(),
-               magazine[mag].GetVolumeLabel(mslot)) < 0) {
-      /* I/O error writing state file */
-      rc = errno;
-      fclose(FS);
-      umask(old_mask);
-      verr.SetErrorWithErrno(rc, "error %d writing state file for drive %d", rc, drv);
+   if (!changed) return 0;
+   rc = state.LogDrive(drv);
+   if (rc) {
+      verr.SetErrorWithErrno(rc, "error %d saving state of drive %d", rc, drv);
       return rc;
    }
-   fclose(FS);
-   umask(old_mask);
-   vlog.Notice("wrote state file for drive %d", drv);
+   if (drive[drv].empty()) vlog.Notice("deleted state of drive %d", drv);
+   else vlog.Notice("saved state of drive %d", drv);
    return 0;
 }
 
 
 /*-------------------------------------------------
- *  Method to restore drive state from a file in the work directory
- *  named "drive_state-N", where N is drive_number. If the volume
+ *  Method to restore drive state from the changer state. If the volume
  *  previously loaded is available, then restore drive to the loaded
  *  state, otherwise set drive unloaded and remove the symlink and
- *  state file for this drive.
+ *  saved state for this drive.
  *  On success returns zero, else on error sets lasterr and
  *  returns errno.
  *-------------------------------------------------*/
 int DiskChanger::RestoreDriveState(int drv)
 {
    int rc, v, m, ms;
-   tString line, dev, labl;
-   size_t p;
-   struct stat st;
-   FILE *FS;
-   tString sname;
+   const ChangerStateFile::DriveRecord *rec;
 
    if (drv < 0 || drv >= (int)drive.size()) {
       verr.SetError(EINVAL, "cannot restore state of invalid drive %d", drv);
@@ -466,63 +602,22 @@ int DiskChanger::RestoreDriveState(int drv)
    }
    drive[drv].clear();
 
-   /* Check for existing state file */
-   tFormat(sname, "%s%sdrive_state-%d", conf.work_dir.c_str(), DIR_DELIM, drv);
-   if (stat(sname.c_str(), &st)) {
-      /* drive state file not found, so drive is not loaded */
+   /* Check for saved state */
+   rec = state.GetDrive(drv);
+   if (!rec) {
+      /* drive state not found, so drive is not loaded */
       RemoveDriveSymlink(drv);
       vlog.Info("drive %d previously unloaded", drv);
       return 0;
    }
-   /* Read loaded volume info from state file */
-   FS = fopen(sname.c_str(), "r");
-   if (!FS) {
-      /* Error opening state file, so leave drive unloaded */
-      verr.SetError(EACCES, "drive %d state file is not readable", drv);
-      return EACCES;
-   }
-   if (tGetLine(line, FS) == NULL) {
-      if (!feof(FS)) {
-         /* i/o error reading line from state file. Change state to unloaded */
-         rc = ferror(FS);
-         fclose(FS);
-         unlink(sname.c_str());
-         RemoveDriveSymlink(drv);
-         verr.SetErrorWithErrno(rc, "error %d reading state file for drive %d", rc, drv);
-         return rc;
-      }
-   }
-   fclose(FS);
-   tStrip(tRemoveEOL(line));
-   /* Extract the device drive was last loaded from */
-   p = 0;
-   rc = tParseCSV(dev, line, p);
-   if (rc != 1 || dev.empty()) {
-      /* Device string not found. Change state to unloaded. */
-      verr.SetError(EINVAL, "deleting corrupt state file for drive %d", drv);
-      unlink(sname.c_str());
-      RemoveDriveSymlink(drv);
-      return EINVAL;
-   }
-   /* Extract label of volume drive was last loaded from */
-   rc = tParseCSV(labl, line, p);
-   if (rc != 1 || labl.empty()) {
-      /* Label string not found. Change state to unloaded. */
-      verr.SetError(EINVAL, "deleting corrupt state file for drive %d", drv);
-      unlink(sname.c_str());
-      RemoveDriveSymlink(drv);
-      return EINVAL;
-   }
 
    /* Find virtual slot assigned the volume file last loaded in drive */
-   for (v = 1; v < (int)vslot.size(); v++) {
-      if (labl == GetVolumeLabel(v)) break;
-   }
-   if (v >= (int)vslot.size()) {
+   v = FindVolumeSlot(rec->label, rec->dev);
+   if (v < 0) {
       /* Volume last loaded is no longer available. Change state to unloaded. */
       vlog.Notice("volume %s no longer available, unloading drive %d",
-                  labl.c_str(), drv);
-      unlink(sname.c_str());
+                  rec->label.c_str(), drv);
+      state.RemoveDrive(drv);
       RemoveDriveSymlink(drv);
       return 0;
    }
@@ -545,25 +640,246 @@ int DiskChanger::RestoreDriveState(int drv)
 }
 
 
+/*-------------------------------------------------
+ *  Protected method to find the virtual slot containing the volume with
+ *  label 'labl'. The magazine whose device string is 'dev' is searched
+ *  first, then all other mounted magazines in bay order.
+ *  On success returns the virtual slot number, else negative.
+ *------------------------------------------------*/
+int DiskChanger::FindVolumeSlot(const tString &labl, const tString &dev)
+{
+   int m, n, ms, v;
+
+   for (n = -1; n < (int)magazine.size(); n++) {
+      if (n < 0) {
+         /* Try magazine the volume was last loaded from first */
+         for (m = 0; m < (int)magazine.size() && magazine[m].mag_dev != dev; m++) ;
+         if (m >= (int)magazine.size()) continue;
+      } else {
+         m = n;
+      }
+      if (magazine[m].empty()) continue;
+      ms = magazine[m].GetVolumeSlot(labl);
+      if (ms < 0) continue;
+      v = magazine[m].start_slot + ms;
+      if (v > 0 && v < (int)vslot.size() && vslot[v].mag_bay == m && vslot[v].mag_slot == ms)
+         return v;
+   }
+   return -1;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to read the labels of the volumes on magazine 'm'
+ *  from its volume index, keeping the slot range restored from the
+ *  saved changer state.
+ *  Returns zero on success, or non-zero if the index is not current.
+ *------------------------------------------------*/
+int DiskChanger::ProbeMagazineLabels(int m, const MountpointCache &mcache)
+{
+   if (magazine[m].Probe(mcache, true) != magazine[m].prev_num_slots) return -1;
+   magazine[m].start_slot = magazine[m].prev_start_slot;
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to restore the state of drive 'drv' from the saved
+ *  changer state without changing anything. The drive's symlink must
+ *  point to the volume saved as loaded in the drive, or must not exist
+ *  if the drive is unloaded.
+ *  Returns zero on success, or non-zero if the saved state is not current.
+ *------------------------------------------------*/
+int DiskChanger::RestoreDriveFromState(int drv, const MountpointCache &mcache)
+{
+   int rc, err, m, ms;
+   const ChangerStateFile::DriveRecord *dr;
+   tString sname, fname;
+   char lname[4096];
+
+   tFormat(sname, "%s%s%d", conf.work_dir.c_str(), DIR_DELIM, drv);
+   rc = readlink(sname.c_str(), lname, sizeof(lname));
+   err = errno;
+   dr = state.GetDrive(drv);
+   if (!dr) {
+      /* Full initialization would remove the symlink of an unloaded drive */
+      if (rc >= 0 || err != ENOENT) return -1;
+      drive[drv].link_known = true;
+      drive[drv].link.clear();
+      return 0;
+   }
+   if (rc <= 0 || rc >= (int)sizeof(lname)) return -1;
+   lname[rc] = 0;
+   /* Find the slot of the volume, which must be on the magazine it was loaded from */
+   for (m = 0; m < (int)magazine.size() && magazine[m].mag_dev != dr->dev; m++) ;
+   if (m >= (int)magazine.size() || magazine[m].prev_num_slots < 1) return -1;
+   if (magazine[m].mslot.empty() && ProbeMagazineLabels(m, mcache)) return -1;
+   ms = magazine[m].GetVolumeSlot(dr->label);
+   if (ms < 0) return -1;
+   fname = magazine[m].GetVolumePath(ms);
+   if (fname != lname) return -1;
+   drive[drv].vs = magazine[m].start_slot + ms;
+   drive[drv].link_known = true;
+   drive[drv].link = fname;
+   vslot[drive[drv].vs].drv = drv;
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to initialize the part of the changer given by
+ *  'scope' from the saved changer state, without changing the state,
+ *  the magazines' volume indexes, or the drives' symlinks. Each magazine
+ *  is probed using its volume index, without reading magazine
+ *  directories, and must match its saved state. For CHANGER_INIT_SLOTS,
+ *  only the number of virtual slots and the magazines' slot ranges are
+ *  set. CHANGER_INIT_LOADED also sets the state of drive 'drv', reading
+ *  the labels of only the magazine holding its volume. CHANGER_INIT_ALL
+ *  reads the labels of all magazines and sets the state of all drives.
+ *  Returns zero on success, or non-zero if the saved state is not current,
+ *  meaning the full initialization would change it.
+ *------------------------------------------------*/
+int DiskChanger::InitializeFromState(int scope, int drv)
+{
+   int n, count, last = 0, m, ms, uuid_mags = 0;
+   MagazineState mag;
+   MountpointCache mcache;
+   VirtualSlot vs;
+   DriveState ds;
+   const ChangerStateFile::BayRecord *br;
+
+   if (drv < 0 || state.Dirty()) return -1;
+   /* Check that every magazine is as it was when the state was saved */
+   for (n = 0; n < (int)conf.magazine.size(); n++) {
+      mag.SetBay(n, conf.magazine[n].c_str());
+      if (tCaseFind(mag.mag_dev, "uuid:") == 0 && uuid_mags++ == 0) mcache.restore();
+      count = mag.Probe(mcache, scope == CHANGER_INIT_ALL);
+      if (count == -1) return -1;
+      br = state.GetBay(n);
+      mag.prev_num_slots = 0;
+      mag.prev_start_slot = 0;
+      if (count < 1) {
+         /* Unmounted or empty magazines have no saved state */
+         if (br) return -1;
+      } else {
+         if (!br || br->dev != mag.mag_dev || br->num_slots != count) return -1;
+         mag.start_slot = mag.prev_start_slot = br->start_slot;
+         mag.prev_num_slots = count;
+         if (mag.start_slot + count - 1 > last) last = mag.start_slot + count - 1;
+      }
+      magazine.push_back(mag);
+   }
+
+   /* Create the virtual slots the full initialization would assign */
+   if (last > dconf.max_slot || state.MaxSlot() != dconf.max_slot) return -1;
+   for (n = 0; n <= dconf.max_slot; n++) {
+      vs.vs = n;
+      vslot.push_back(vs);
+   }
+   for (m = 0; m < (int)magazine.size(); m++) {
+      for (ms = 0; ms < magazine[m].prev_num_slots; ms++) {
+         n = magazine[m].start_slot + ms;
+         if (!vslot[n].empty()) return -1;  /* overlapping slot ranges */
+         vslot[n].mag_bay = m;
+         vslot[n].mag_slot = ms;
+      }
+   }
+   if (scope == CHANGER_INIT_SLOTS) return 0;
+
+   /* Restore the drives, creating at least one */
+   n = state.MaxDrive() > drv ? state.MaxDrive() : drv;
+   while ((int)drive.size() <= n) {
+      ds.drv = (int)drive.size();
+      drive.push_back(ds);
+   }
+   if (scope == CHANGER_INIT_LOADED) return RestoreDriveFromState(drv, mcache);
+   for (n = 0; n < (int)drive.size(); n++) {
+      if (RestoreDriveFromState(n, mcache)) return -1;
+   }
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Protected method to clear the changer and read the saved state of
+ *  magazines, virtual slots, and drives.
+ *  On success, returns zero. On error, sets lasterr and returns errno.
+ *------------------------------------------------*/
+int DiskChanger::LoadState()
+{
+   int rc;
+
+   magazine.clear();
+   vslot.clear();
+   drive.clear();
+   rc = state.Load();
+   if (rc) {
+      verr.SetErrorWithErrno(rc, "error %d reading changer state", rc);
+      vlog.Error("ERROR! %s", verr.GetErrorMsg());
+      return rc;
+   }
+   dconf.restore(state);
+   needs_update = false;
+   changed_slots.clear();
+   new_volume_slots.clear();
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Method to initialize the part of the changer that a read-only command
+ *  needs, given by 'scope', from the saved changer state. Nothing is
+ *  written, so this may be called while holding the changer's command
+ *  lock shared. Drive 'drv' is the drive a CHANGER_INIT_LOADED command
+ *  reports on.
+ *  On success, returns zero. If the saved state is not current, meaning
+ *  that Initialize() must be called to update it, returns ESTALE. On
+ *  error, sets lasterr and returns errno.
+ *------------------------------------------------*/
+int DiskChanger::InitializeReadOnly(int scope, int drv)
+{
+   int rc;
+   struct timeval t0, t1;
+
+   gettimeofday(&t0, NULL);
+   rc = LoadState();
+   if (rc) return rc;
+   rc = InitializeFromState(scope, drv);
+   gettimeofday(&t1, NULL);
+   if (rc) {
+      vlog.Info("saved changer state is not current");
+      magazine.clear();
+      vslot.clear();
+      drive.clear();
+      return ESTALE;
+   }
+   vlog.Debug("initialized changer from saved state in %ld us",
+         (long)((t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_usec - t0.tv_usec)));
+   return 0;
+}
+
+
 /*-------------------------------------------------
  *  Method to initialize changer parameters and state of magazines,
- *  virtual slots, and virtual drives.
+ *  virtual slots, and virtual drives. If 'rescan' is true, magazine
+ *  volume indexes are ignored and all magazine directories are read.
+ *  The saved changer state is updated as needed, so the changer's
+ *  command lock must be held exclusively.
  *  On success, returns zero. On error, returns negative.
  *  In either case, obtains a lock on the changer unless the lock operation
  *  itself fails. The lock will be released when the DiskChanger object
  *  is destroyed.
  *------------------------------------------------*/
-int DiskChanger::Initialize()
+int DiskChanger::Initialize(bool rescan)
 {
-   /* Make sure we have a lock on this changer */
-   magazine.clear();
-   vslot.clear();
-   drive.clear();
-   dconf.restore();
-   needs_update = false;
+   int rc;
+
+   /* Read saved state of magazines, virtual slots, and drives */
+   rc = LoadState();
+   if (rc) return rc;
 
    /* Initialize array of mounted magazines */
-   InitializeMagazines();
+   InitializeMagazines(rescan);
 
    /* Initialize array of virtual slots */
    InitializeVirtSlots();
@@ -583,6 +899,7 @@ int DiskChanger::Initialize()
 int DiskChanger::LoadDrive(int drv, int slot)
 {
    int rc, m, ms;
+   tString fname;
 
    if (drv < 0) {
       verr.SetError(EINVAL, "invalid drive number %d", drv);
@@ -611,21 +928,36 @@ int DiskChanger::LoadDrive(int drv, int slot)
       vlog.Error("ERROR! %s", verr.GetErrorMsg());
       return ENOENT;
    }
-   /* Create symlink for drive pointing to volume file */
-   drive[drv].vs = slot;
-   if ((rc = CreateDriveSymlink(drv))) {
-      drive[drv].vs = -1;
+   /* Only writable files are volumes, but a volume index read in place of
+    * the magazine directory does not notice a volume file made read-only
+    * since the index was saved. Refuse to load such a file, and drop the
+    * index so that the magazine is rescanned next time. */
+   m = vslot[slot].mag_bay;
+   ms = vslot[slot].mag_slot;
+   fname = magazine[m].GetVolumePath(ms);
+   if (access(fname.c_str(), W_OK)) {
+      rc = errno;
+      magazine[m].RemoveVolumeIndex();
+      verr.SetErrorWithErrno(rc, "volume file %s in slot %d is not writable", fname.c_str(), slot);
       vlog.Error("ERROR! %s", verr.GetErrorMsg());
       return rc;
    }
-   /* Save state of newly loaded drive */
+   /* Save state of newly loaded drive ahead of creating its symlink, so that
+    * recovery from a crash in between recreates the symlink */
+   drive[drv].vs = slot;
    if ((rc = SaveDriveState(drv)) != 0) {
-      /* Error writing drive state file */
-      RemoveDriveSymlink(drv);
+      /* Error writing drive state */
       drive[drv].vs = -1;
       vlog.Error("ERROR! %s", verr.GetErrorMsg());
       return rc;
    }
+   /* Create symlink for drive pointing to volume file */
+   if ((rc = CreateDriveSymlink(drv))) {
+      vlog.Error("ERROR! %s", verr.GetErrorMsg());
+      drive[drv].vs = -1;
+      SaveDriveState(drv);
+      return rc;
+   }
    /* Assign virtual slot to drive */
    vslot[slot].drv = drv;
    m = vslot[slot].mag_bay;
@@ -636,14 +968,14 @@ int DiskChanger::LoadDrive(int drv, int slot)
 
 
 /*-------------------------------------------------
- *  Method to unload volume in virtual drive 'drv'. Deletes symlink
- *  and state file for the drive.
+ *  Method to unload volume in virtual drive 'drv'. Records the
+ *  unload in the changer journal and deletes the drive's symlink.
  *  On success, returns zero. Otherwise sets lasterr and returns
  *  errno.
  *------------------------------------------------*/
 int DiskChanger::UnloadDrive(int drv)
 {
-   int rc;
+   int rc, slot;
 
    if (drv < 0) {
       verr.SetError(EINVAL, "invalid drive number %d", drv);
@@ -655,16 +987,19 @@ int DiskChanger::UnloadDrive(int drv)
       /* Drive is already empty so assume successful */
       return 0;
    }
-   /* Remove drive's symlink */
-   if ((rc = RemoveDriveSymlink(drv)) != 0) {
+   /* Save unloaded state of drive ahead of removing its symlink, so that
+    * recovery from a crash in between removes the stale symlink */
+   slot = drive[drv].vs;
+   drive[drv].vs = -1;
+   if ((rc = SaveDriveState(drv)) != 0) {
+      drive[drv].vs = slot;
       vlog.Error("ERROR! %s", verr.GetErrorMsg());
       return rc;
    }
    /* Remove virtual slot assignment */
-   vslot[drive[drv].vs].drv = -1;
-   drive[drv].vs = -1;
-   /* Update drive state file (will delete state file due to negative slot number) */
-   if ((rc = SaveDriveState(drv)) != 0) {
+   vslot[slot].drv = -1;
+   /* Remove drive's symlink */
+   if ((rc = RemoveDriveSymlink(drv)) != 0) {
       vlog.Error("ERROR! %s", verr.GetErrorMsg());
       return rc;
    }
@@ -673,6 +1008,61 @@ int DiskChanger::UnloadDrive(int drv)
 }
 
 
+/*-------------------------------------------------
+ *  Protected method to assign virtual slots to the volumes added to
+ *  magazine 'bay', which had 'prev_count' volumes before they were
+ *  created. The magazine's slot range is extended in place when the
+ *  slots following it are free, otherwise the magazine is moved to a
+ *  new range large enough to hold all of its volumes.
+ *------------------------------------------------*/
+void DiskChanger::AssignNewVolumeSlots(int bay, int prev_count)
+{
+   MagazineState &mag = magazine[bay];
+   int s, v, first = 0, old_start = mag.start_slot, added = mag.num_slots - prev_count;
+   std::vector<int> drv;
+
+   if (added < 1) return;
+   if (prev_count > 0 && old_start > 0 && free_slots.Reserve(old_start + prev_count, added)) {
+      /* Extend existing range */
+      GrowSlots(free_slots.EndSlot());
+      first = prev_count;
+      SlotsChanged(old_start + prev_count, added);
+   } else {
+      /* Move magazine to a new range, keeping loaded drives with their volumes */
+      drv.assign(mag.num_slots, -1);
+      if (prev_count > 0 && old_start > 0) {
+         for (s = 0; s < prev_count; s++) {
+            v = old_start + s;
+            drv[s] = vslot[v].drv;
+            vslot[v].clear();
+         }
+         free_slots.Release(old_start, prev_count);
+         SlotsChanged(old_start, prev_count);
+      }
+      mag.start_slot = FindEmptySlotRange(mag.num_slots);
+      SlotsChanged(mag.start_slot, mag.num_slots);
+      for (s = 0; s < mag.num_slots; s++) {
+         if (drv[s] >= 0) {
+            vslot[mag.start_slot + s].drv = drv[s];
+            drive[drv[s]].vs = mag.start_slot + s;
+         }
+      }
+   }
+   for (s = first; s < mag.num_slots; s++) {
+      v = mag.start_slot + s;
+      vslot[v].mag_bay = bay;
+      vslot[v].mag_slot = s;
+   }
+   new_volume_slots.Add(mag.start_slot + prev_count, mag.start_slot + mag.num_slots - 1);
+   vlog.Notice("%d volumes on magazine %d assigned slots %d-%d", mag.num_slots, bay,
+         mag.start_slot, mag.start_slot + mag.num_slots - 1);
+   if ((int)vslot.size() - 1 > dconf.max_slot) {
+      dconf.max_slot = (int)vslot.size() - 1;
+      dconf.save(state);
+   }
+}
+
+
 /*-------------------------------------------------
  *  Method to create new volume files in virtual slots 'slot1' through 'slot2'.
  *  Use volume labels (barcodes) of the form prefix + '_' + mag_slot_number, where
@@ -685,7 +1075,7 @@ int DiskChanger::CreateVolumes(int bay, int count, int start, const char *label_
 {
    MagazineSlot vol;
    tString label, label_prefix(label_prefix_in);
-   int i;
+   int i, prev_count;
 
    if (bay < 0 || bay >= (int)magazine.size()) {
       verr.SetError(EINVAL, "invalid magazine");
@@ -693,6 +1083,7 @@ int DiskChanger::CreateVolumes(int bay, int count, int start, const char *label_
       return -1;
    }
    if (count < 1) count = 1;
+   prev_count = magazine[bay].num_slots;
    tStrip(tRemoveEOL(label_prefix));
    if (label_prefix.empty()) {
       /* Default prefix is storage-name_magazine-number */
@@ -717,13 +1108,19 @@ int DiskChanger::CreateVolumes(int bay, int count, int start, const char *label_
       fprintf(stdout, "creating label '%s'\n", label.c_str());
       if (magazine[bay].CreateVolume(label)) {
          /* On failure, update magazine state if any were created */
-         if (i) magazine[bay].save();
+         if (i) {
+            AssignNewVolumeSlots(bay, prev_count);
+            magazine[bay].save(state);
+            state.Commit();
+         }
          return -1;
       }
       ++start;
    }
    /* Update magazine state */
-   magazine[bay].save();
+   AssignNewVolumeSlots(bay, prev_count);
+   magazine[bay].save(state);
+   state.Commit();
    /* New mag state will require 'update slots' and 'label barcodes' in Bacula */
    needs_update = true;
    needs_label = true;
@@ -27,12 +27,19 @@
 #include "errhandler.h"
 #include "changerstate.h"
 
+/* Parts of the changer a command needs initialized */
+#define CHANGER_INIT_FULL 0     /* full initialization, which may update the saved state */
+#define CHANGER_INIT_SLOTS 1    /* number of virtual slots, from the saved state */
+#define CHANGER_INIT_LOADED 2   /* also the slot loaded in one drive, from the saved state */
+#define CHANGER_INIT_ALL 3      /* all magazines, slots, and drives, from the saved state */
+
 class DiskChanger
 {
 public:
    DiskChanger() : needs_update(false), needs_label(false)  {}
    virtual ~DiskChanger() {};
-   int Initialize();
+   int Initialize(bool rescan = false);
+   int InitializeReadOnly(int scope, int drv = 0);
    int LoadDrive(int drv, int slot);
    int UnloadDrive(int drv);
    int CreateVolumes(int bay, int count, int start = -1, const char *label_prefix = "");
@@ -53,9 +60,18 @@ public:
    inline const char* GetErrorMsg() const { return verr.GetErrorMsg(); }
    inline bool NeedsUpdate() const { return needs_update; }
    inline bool NeedsLabel() const { return needs_label; }
+   inline bool StateCurrent() const { return state.Current(); }
+   tString UpdateSlotList() const;
+   tString LabelSlotList() const;
 protected:
-   void InitializeMagazines();
+   void InitializeMagazines(bool rescan);
+   int LoadState();
+   int InitializeFromState(int scope, int drv);
+   int ProbeMagazineLabels(int m, const MountpointCache &mcache);
+   int RestoreDriveFromState(int drv, const MountpointCache &mcache);
    int FindEmptySlotRange(int count);
+   void GrowSlots(int end);
+   void AssignNewVolumeSlots(int bay, int prev_count);
    int InitializeDrives();
    void InitializeVirtSlots();
    void SetMaxDrive(int n);
@@ -63,14 +79,20 @@ protected:
    int RemoveDriveSymlink(int drv);
    int SaveDriveState(int drv);
    int RestoreDriveState(int drv);
+   int FindVolumeSlot(const tString &labl, const tString &dev);
+   void SlotsChanged(int start, int count);
 protected:
    bool needs_update;
    bool needs_label;
    ErrorHandler verr;
    DynamicConfig dconf;
+   ChangerStateFile state;
    MagazineStateArray magazine;
    DriveStateArray drive;
    VirtualSlotArray vslot;
+   FreeSlotRanges free_slots;
+   SlotRangeSet changed_slots;
+   SlotRangeSet new_volume_slots;
 };
 
 #endif /*DISKCHANGER_H_*/
@@ -0,0 +1,633 @@
+/*  hotplug.cpp
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2020 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+ *
+ *  Listener for block device hotplug events (uevents). When a filesystem
+ *  used as a magazine by any of the changers is attached, it is mounted
+ *  and the changers using it are refreshed. When it is detached, it is
+ *  unmounted and the changers using it are refreshed. This replaces the
+ *  chain of udev rules and mount scripts.
+*/
+
+#include "config.h"
+#include "compat_defs.h"
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_DIRENT_H
+#include <dirent.h>
+#endif
+#include <algorithm>
+
+#include "compat/getline.h"
+#include "loghandler.h"
+#include "vconf.h"
+#include "uuidlookup.h"
+#include "hotplug.h"
+
+
+/*
+ *  Function to get the list of changer configuration files in directory
+ *  'dir', which are the regular files whose names end in ".conf", in
+ *  alphabetical order.
+ *  On success returns zero, else returns errno.
+ */
+int ListConfigFiles(const char *dir, tStringArray &files)
+{
+#ifdef HAVE_DIRENT_H
+   DIR *d;
+   struct dirent *de;
+   struct stat st;
+   size_t len;
+   tString path;
+
+   files.clear();
+   d = opendir(dir);
+   if (!d) return errno;
+   while ((de = readdir(d)) != NULL) {
+      len = strlen(de->d_name);
+      if (len < 6 || de->d_name[0] == '.' || strcmp(de->d_name + len - 5, ".conf")) continue;
+      tFormat(path, "%s%s%s", dir, DIR_DELIM, de->d_name);
+      if (stat(path.c_str(), &st) || !S_ISREG(st.st_mode)) continue;
+      files.push_back(path);
+   }
+   closedir(d);
+   std::sort(files.begin(), files.end());
+   return 0;
+#else
+   files.clear();
+   return ENOSYS;
+#endif
+}
+
+
+#if defined(__linux__) && defined(HAVE_MNTENT_H) && defined(HAVE_SYS_MOUNT_H)
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#include <mntent.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/sysmacros.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+
+#ifndef MNT_DETACH
+#define MNT_DETACH 2
+#endif
+
+/* Netlink multicast group of uevents re-broadcast by udev after it has
+ * added properties such as ID_FS_UUID */
+#define UDEV_MONITOR_GROUP 2
+/* Header of uevents broadcast by udev */
+#define UDEV_MONITOR_PREFIX "libudev"
+#define UDEV_MONITOR_MAGIC 0xfeedcafe
+#define UEVENT_BUFFER_SIZE (128 * 1024)
+
+/* Properties of a uevent */
+typedef std::map<tString, tString> UEVENT;
+
+/* Changer config files using each magazine filesystem, keyed by lowercase UUID */
+static tStringListMap uuid_changers;
+
+static volatile sig_atomic_t hotplug_stop = 0;
+static volatile sig_atomic_t hotplug_reload = 0;
+
+
+static void hotplug_signal(int sig)
+{
+   if (sig == SIGHUP) hotplug_reload = 1;
+   else hotplug_stop = 1;
+}
+
+
+/*
+ *  Function to build the table of changers using each magazine that is
+ *  specified by filesystem UUID, reading each changer's config file once.
+ *  Returns the number of UUID magazines found.
+ */
+static int load_changer_table(const HOTPLUG_OPTS &opts)
+{
+   int count = 0;
+   size_t n, m;
+   tString uuid;
+   tStringArray files(opts.config_files);
+
+   uuid_changers.clear();
+   if (files.empty() && ListConfigFiles(DEFAULT_CONFIG_DIR, files)) {
+      vlog.Error("hotplug: errno=%d reading directory %s", errno, DEFAULT_CONFIG_DIR);
+      return 0;
+   }
+   for (n = 0; n < files.size(); n++) {
+      VchangerConfig cf;
+      if (!cf.Read(files[n])) {
+         vlog.Error("hotplug: skipping config file %s", files[n].c_str());
+         continue;
+      }
+      for (m = 0; m < cf.magazine.size(); m++) {
+         if (tCaseFind(cf.magazine[m], "uuid:") != 0) continue;
+         uuid = cf.magazine[m].substr(5);
+         tToLower(tStrip(uuid));
+         if (uuid.empty()) continue;
+         uuid_changers[uuid].push_back(files[n]);
+         ++count;
+      }
+   }
+   vlog.Info("hotplug: watching %d magazines of %d changers", count, (int)files.size());
+   return count;
+}
+
+
+/*
+ *  Function to look up the filesystem with UUID 'uuid' in /etc/fstab.
+ *  If found, returns true with its mountpoint, type, and options in
+ *  'dir', 'type', and 'options'.
+ */
+static bool find_fstab_entry(const tString &uuid, tString &dir, tString &type, tString &options)
+{
+   FILE *fs;
+   struct mntent *ent, ent_buf;
+   char str_buf[4096];
+   const char *spec;
+   bool found = false;
+
+   fs = setmntent(_PATH_MNTTAB, "r");
+   if (!fs) return false;
+   while ((ent = getmntent_r(fs, &ent_buf, str_buf, sizeof(str_buf))) != NULL) {
+      spec = ent->mnt_fsname;
+      if (strncasecmp(spec, "UUID=", 5) == 0) spec += 5;
+      else if (strncmp(spec, "/dev/disk/by-uuid/", 18) == 0) spec += 18;
+      else continue;
+      if (strcasecmp(spec, uuid.c_str()) == 0) {
+         dir = ent->mnt_dir;
+         type = ent->mnt_type;
+         options = ent->mnt_opts;
+         found = true;
+         break;
+      }
+   }
+   endmntent(fs);
+   return found;
+}
+
+
+/*
+ *  Function to convert a comma separated list of mount options, as used
+ *  by mount(8) and fstab, into mount flags and a filesystem specific data
+ *  string for the mount system call. Options only meaningful to mount(8)
+ *  are ignored.
+ */
+static void parse_mount_options(const tString &options, unsigned long &flags, tString &data)
+{
+   static const struct {
+      const char *name;
+      unsigned long flag;
+      bool clear;
+   } opt_flags[] = {
+      { "ro", MS_RDONLY, false }, { "rw", MS_RDONLY, true },
+      { "nosuid", MS_NOSUID, false }, { "suid", MS_NOSUID, true },
+      { "nodev", MS_NODEV, false }, { "dev", MS_NODEV, true },
+      { "noexec", MS_NOEXEC, false }, { "exec", MS_NOEXEC, true },
+      { "sync", MS_SYNCHRONOUS, false }, { "async", MS_SYNCHRONOUS, true },
+      { "dirsync", MS_DIRSYNC, false }, { "noatime", MS_NOATIME, false },
+      { "atime", MS_NOATIME, true }, { "nodiratime", MS_NODIRATIME, false },
+      { "diratime", MS_NODIRATIME, true }, { "relatime", MS_RELATIME, false },
+      { "norelatime", MS_RELATIME, true }, { "strictatime", MS_STRICTATIME, false },
+      { NULL, 0, false } };
+   static const char *ignored[] = { "defaults", "auto", "noauto", "user", "nouser", "users",
+         "owner", "group", "nofail", "_netdev", NULL };
+   size_t pos = 0, end;
+   int n;
+   tString opt;
+
+   flags = 0;
+   data.clear();
+   while (pos < options.size()) {
+      end = options.find(',', pos);
+      if (end == tString::npos) end = options.size();
+      opt = options.substr(pos, end - pos);
+      pos = end + 1;
+      if (opt.empty() || opt.compare(0, 2, "x-") == 0) continue;
+      for (n = 0; opt_flags[n].name; n++) {
+         if (opt == opt_flags[n].name) break;
+      }
+      if (opt_flags[n].name) {
+         if (opt_flags[n].clear) flags &= ~opt_flags[n].flag;
+         else flags |= opt_flags[n].flag;
+         continue;
+      }
+      for (n = 0; ignored[n]; n++) {
+         if (opt == ignored[n]) break;
+      }
+      if (ignored[n]) continue;
+      if (!data.empty()) data += ",";
+      data += opt;
+   }
+}
+
+
+/*
+ *  Function to mount the filesystem on device 'dev' at 'dir'. If 'type'
+ *  is empty or "auto", each block device filesystem type listed in
+ *  /proc/filesystems is tried in turn.
+ *  On success returns zero, else returns errno.
+ */
+static int mount_magazine(const tString &dev, const tString &dir, const tString &type,
+      const tString &options)
+{
+   int rc;
+   unsigned long flags;
+   tString data, fstype;
+   FILE *fs;
+   char *line = NULL, *p;
+   size_t line_sz = 0;
+   ssize_t len;
+
+   parse_mount_options(options, flags, data);
+   if (!type.empty() && type != "auto") {
+      if (mount(dev.c_str(), dir.c_str(), type.c_str(), flags, data.empty() ? NULL : data.c_str())) {
+         return errno;
+      }
+      return 0;
+   }
+   fs = fopen("/proc/filesystems", "r");
+   if (!fs) return errno;
+   rc = ENODEV;
+   while ((len = getline(&line, &line_sz, fs)) > 0) {
+      if (strncmp(line, "nodev", 5) == 0) continue;
+      for (p = line; *p == ' ' || *p == '\t'; p++) ;
+      while (len && (line[len - 1] == '\n' || line[len - 1] == ' ')) line[--len] = 0;
+      if (!*p) continue;
+      fstype = p;
+      if (mount(dev.c_str(), dir.c_str(), fstype.c_str(), flags, data.empty() ? NULL : data.c_str()) == 0) {
+         rc = 0;
+         break;
+      }
+      rc = errno;
+      if (rc != EINVAL && rc != ENODEV) break;
+   }
+   free(line);
+   fclose(fs);
+   return rc;
+}
+
+
+/*
+ *  Function to refresh each changer using the magazine with UUID 'uuid'
+ */
+static void refresh_changers(const tString &uuid, HotplugRefreshHandler handler)
+{
+   int rc;
+   tStringListConstIterator p;
+   const tStringList &files = uuid_changers[uuid];
+
+   for (p = files.begin(); p != files.end(); p++) {
+      rc = handler(p->c_str());
+      if (rc) vlog.Error("hotplug: refresh of %s failed rc=%d", p->c_str(), rc);
+      else vlog.Info("hotplug: refreshed %s", p->c_str());
+   }
+}
+
+
+/*
+ *  Function to handle the attachment of the magazine filesystem with UUID
+ *  'uuid' on device 'devname'. The filesystem is mounted at the mountpoint
+ *  given for it in /etc/fstab, if any, or else in a subdirectory of the
+ *  configured mount directory named for the UUID.
+ */
+static void magazine_added(const tString &uuid, const tString &devname, const tString &fs_type,
+      const HOTPLUG_OPTS &opts, HotplugRefreshHandler handler)
+{
+   int rc;
+   tString dir, type, options, dev(devname);
+   char mountp[4096];
+
+   if (GetMountpointFromUUID(mountp, sizeof(mountp), uuid.c_str()) == 0) {
+      vlog.Info("hotplug: magazine %s already mounted at %s", uuid.c_str(), mountp);
+      refresh_changers(uuid, handler);
+      return;
+   }
+   if (!find_fstab_entry(uuid, dir, type, options)) {
+      tFormat(dir, "%s%s%s", opts.mount_dir.c_str(), DIR_DELIM, uuid.c_str());
+      type = fs_type;
+      options = opts.mount_options;
+   }
+   if (dev.empty()) tFormat(dev, "/dev/disk/by-uuid/%s", uuid.c_str());
+   if (mkdir(dir.c_str(), 0750) && errno != EEXIST) {
+      vlog.Error("hotplug: errno=%d creating mountpoint %s", errno, dir.c_str());
+      return;
+   }
+   rc = mount_magazine(dev, dir, type, options);
+   if (rc) {
+      vlog.Error("hotplug: errno=%d mounting %s at %s", rc, dev.c_str(), dir.c_str());
+      return;
+   }
+   vlog.Notice("hotplug: mounted magazine %s (%s) at %s", uuid.c_str(), dev.c_str(), dir.c_str());
+   refresh_changers(uuid, handler);
+}
+
+
+/*
+ *  Function to handle the detachment of the magazine filesystem with UUID
+ *  'uuid' from the device with device number 'devno'. If the filesystem is
+ *  still mounted, it is unmounted, lazily if it is busy, since the device
+ *  is already gone.
+ */
+static void magazine_removed(const tString &uuid, unsigned long long devno, HotplugRefreshHandler handler)
+{
+   char mountp[4096];
+
+   if (devno && GetDevnoMountpoint(mountp, sizeof(mountp), devno) == 0) {
+      if (umount(mountp) && (errno != EBUSY || umount2(mountp, MNT_DETACH))) {
+         vlog.Error("hotplug: errno=%d unmounting %s", errno, mountp);
+      } else {
+         vlog.Notice("hotplug: unmounted magazine %s from %s", uuid.c_str(), mountp);
+      }
+   }
+   refresh_changers(uuid, handler);
+}
+
+
+/*
+ *  Function to handle a uevent. Only the addition and removal of block
+ *  devices holding a filesystem used as a magazine are acted on.
+ */
+static void handle_uevent(UEVENT &ev, const HOTPLUG_OPTS &opts, HotplugRefreshHandler handler)
+{
+   tString uuid(ev["ID_FS_UUID"]);
+   const tString &action = ev["ACTION"];
+   unsigned long long devno = 0;
+
+   if (ev["SUBSYSTEM"] != "block" || uuid.empty()) return;
+   tToLower(tStrip(uuid));
+   if (uuid_changers.find(uuid) == uuid_changers.end()) {
+      vlog.Debug("hotplug: ignoring %s of filesystem %s", action.c_str(), uuid.c_str());
+      return;
+   }
+   vlog.Info("hotplug: %s of magazine %s device %s", action.c_str(), uuid.c_str(), ev["DEVNAME"].c_str());
+   if (action == "add") {
+      magazine_added(uuid, ev["DEVNAME"], ev["ID_FS_TYPE"], opts, handler);
+   } else if (action == "remove") {
+      if (!ev["MAJOR"].empty() && !ev["MINOR"].empty()) {
+         devno = (unsigned long long)makedev(strtoul(ev["MAJOR"].c_str(), NULL, 10),
+               strtoul(ev["MINOR"].c_str(), NULL, 10));
+      }
+      magazine_removed(uuid, devno, handler);
+   }
+}
+
+
+/*
+ *  Function to add a property of the form KEY=VALUE to a uevent.
+ */
+static void add_uevent_property(UEVENT &ev, const char *prop, size_t len)
+{
+   const char *eq = (const char*)memchr(prop, '=', len);
+   if (!eq || eq == prop) return;
+   ev[tString(prop, eq - prop)] = tString(eq + 1, prop + len - eq - 1);
+}
+
+
+/*
+ *  Function to read uevents from the file 'fname', or stdin if "-", and
+ *  handle each of them, until end of file. Each uevent is a block of
+ *  KEY=VALUE lines, as printed by 'udevadm monitor --property', ending
+ *  with an empty line. Other lines are ignored.
+ *  Returns zero on success, else errno.
+ */
+static int read_uevent_file(const char *fname, const HOTPLUG_OPTS &opts, HotplugRefreshHandler handler)
+{
+   FILE *fs;
+   char *line = NULL;
+   size_t line_sz = 0;
+   ssize_t len;
+   UEVENT ev;
+
+   if (strcmp(fname, "-") == 0) fs = stdin;
+   else fs = fopen(fname, "r");
+   if (!fs) {
+      vlog.Error("hotplug: errno=%d opening uevent file %s", errno, fname);
+      return errno;
+   }
+   while (!hotplug_stop) {
+      len = getline(&line, &line_sz, fs);
+      if (len > 0) {
+         while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = 0;
+         if (len) {
+            add_uevent_property(ev, line, len);
+            continue;
+         }
+      } else if (len < 0 && errno == EINTR && !feof(fs)) {
+         clearerr(fs);
+         continue;
+      }
+      if (!ev.empty()) {
+         if (hotplug_reload) {
+            hotplug_reload = 0;
+            load_changer_table(opts);
+         }
+         handle_uevent(ev, opts, handler);
+         ev.clear();
+      }
+      if (len < 0) break;
+   }
+   free(line);
+   if (fs != stdin) fclose(fs);
+   return 0;
+}
+
+
+/*
+ *  Function to parse a uevent message received from udev. The message
+ *  has a header giving the offset and length of the properties, which are
+ *  NUL terminated KEY=VALUE strings.
+ *  Returns zero on success, else -1 if the message is invalid.
+ */
+static int parse_udev_message(const char *buf, size_t len, UEVENT &ev)
+{
+   uint32_t magic, hdr_size, prop_off, prop_len;
+   size_t n, end;
+
+   ev.clear();
+   if (len < 24 || memcmp(buf, UDEV_MONITOR_PREFIX, sizeof(UDEV_MONITOR_PREFIX))) return -1;
+   memcpy(&magic, buf + 8, 4);
+   memcpy(&hdr_size, buf + 12, 4);
+   memcpy(&prop_off, buf + 16, 4);
+   memcpy(&prop_len, buf + 20, 4);
+   if (ntohl(magic) != UDEV_MONITOR_MAGIC || hdr_size > len || prop_off < hdr_size
+         || prop_off > len || prop_len > len - prop_off) {
+      return -1;
+   }
+   end = prop_off + prop_len;
+   for (n = prop_off; n < end; ) {
+      const char *prop = buf + n;
+      const char *nul = (const char*)memchr(prop, 0, end - n);
+      size_t plen = nul ? (size_t)(nul - prop) : end - n;
+      add_uevent_property(ev, prop, plen);
+      n += plen + 1;
+   }
+   return 0;
+}
+
+
+/*
+ *  Function to listen for uevents broadcast by udev on a netlink socket
+ *  and handle each of them, until terminated by a signal. Messages not
+ *  sent by root are ignored, so that unprivileged users cannot cause
+ *  filesystems to be mounted.
+ *  Returns zero on normal termination, else errno.
+ */
+static int listen_uevents(const HOTPLUG_OPTS &opts, HotplugRefreshHandler handler)
+{
+   int fd, rc, on = 1, rcvbuf = 1024 * 1024;
+   ssize_t len;
+   struct sockaddr_nl addr, sender;
+   struct iovec iov;
+   struct msghdr msg;
+   struct cmsghdr *cmsg;
+   struct ucred *cred;
+   char cbuf[CMSG_SPACE(sizeof(struct ucred))];
+   char *buf;
+   UEVENT ev;
+
+   fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+   if (fd < 0) {
+      rc = errno;
+      vlog.Error("hotplug: errno=%d creating netlink socket", rc);
+      return rc;
+   }
+   memset(&addr, 0, sizeof(addr));
+   addr.nl_family = AF_NETLINK;
+   addr.nl_groups = UDEV_MONITOR_GROUP;
+   if (bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+      rc = errno;
+      close(fd);
+      vlog.Error("hotplug: errno=%d binding netlink socket", rc);
+      return rc;
+   }
+   setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on));
+   setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+   buf = (char*)malloc(UEVENT_BUFFER_SIZE);
+   if (!buf) {
+      close(fd);
+      return ENOMEM;
+   }
+
+   vlog.Notice("hotplug: listening for uevents pid=%d", getpid());
+   while (!hotplug_stop) {
+      if (hotplug_reload) {
+         hotplug_reload = 0;
+         load_changer_table(opts);
+      }
+      iov.iov_base = buf;
+      iov.iov_len = UEVENT_BUFFER_SIZE;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_name = &sender;
+      msg.msg_namelen = sizeof(sender);
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = cbuf;
+      msg.msg_controllen = sizeof(cbuf);
+      len = recvmsg(fd, &msg, 0);
+      if (len < 0) {
+         if (errno == EINTR) continue;
+         if (errno == ENOBUFS) {
+            vlog.Error("hotplug: uevents were lost");
+            continue;
+         }
+         rc = errno;
+         vlog.Error("hotplug: errno=%d receiving uevent", rc);
+         free(buf);
+         close(fd);
+         return rc;
+      }
+      if (msg.msg_flags & MSG_TRUNC) continue;
+      cmsg = CMSG_FIRSTHDR(&msg);
+      if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS) continue;
+      cred = (struct ucred*)CMSG_DATA(cmsg);
+      if (cred->uid != 0 || sender.nl_pid == 0) continue;
+      if (parse_udev_message(buf, (size_t)len, ev)) continue;
+      handle_uevent(ev, opts, handler);
+   }
+   free(buf);
+   close(fd);
+   vlog.Notice("hotplug: terminated pid=%d", getpid());
+   return 0;
+}
+
+
+/*
+ *  Function to run the hotplug listener. Loads the UUID magazines of all
+ *  changers, then handles uevents read from the file given in 'opts', or
+ *  else received from udev, until terminated by SIGTERM or SIGINT. SIGHUP
+ *  causes the changer config files to be read again. For each changer
+ *  affected by a uevent, 'handler' is called to refresh it.
+ *  Returns zero on normal termination, else returns errno.
+ */
+int RunHotplugListener(const HOTPLUG_OPTS &opts, HotplugRefreshHandler handler)
+{
+   struct sigaction sa;
+
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = hotplug_signal;
+   sigemptyset(&sa.sa_mask);
+   sa.sa_flags = 0;
+   sigaction(SIGTERM, &sa, NULL);
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGHUP, &sa, NULL);
+
+   load_changer_table(opts);
+   if (!opts.uevent_file.empty()) return read_uevent_file(opts.uevent_file.c_str(), opts, handler);
+   return listen_uevents(opts, handler);
+}
+
+#else
+/*
+ *  The hotplug listener is only supported on Linux
+ */
+int RunHotplugListener(const HOTPLUG_OPTS &opts, HotplugRefreshHandler handler)
+{
+   vlog.Error("hotplug mode is not supported on this platform");
+   return ENOSYS;
+}
+#endif
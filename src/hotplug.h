@@ -0,0 +1,49 @@
+/*  hotplug.h
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2020 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+*/
+
+#ifndef HOTPLUG_H_
+#define HOTPLUG_H_
+
+#include "tstring.h"
+
+#define DEFAULT_CONFIG_DIR "/etc/vchanger"
+#define DEFAULT_HOTPLUG_MOUNT_DIR "/mnt/vchanger"
+
+/* Settings of the hotplug listener */
+typedef struct _hotplug_opts_s
+{
+   tStringArray config_files;  /* changer config files, or empty for all in DEFAULT_CONFIG_DIR */
+   tString mount_dir;          /* directory under which magazines not in fstab are mounted */
+   tString mount_options;      /* mount options for magazines mounted under mount_dir */
+   tString uevent_file;        /* file to read uevents from instead of netlink, "-" for stdin */
+} HOTPLUG_OPTS;
+
+/* Handler called to refresh the changer defined by 'config_file' after one
+ * of its magazines has been attached or detached. Returns the exit code
+ * of the refresh. */
+typedef int (*HotplugRefreshHandler)(const char *config_file);
+
+int ListConfigFiles(const char *dir, tStringArray &files);
+int RunHotplugListener(const HOTPLUG_OPTS &opts, HotplugRefreshHandler handler);
+
+#endif /* HOTPLUG_H_ */
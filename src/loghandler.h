@@ -59,6 +59,7 @@ public:
    void Debug(const char *fmt, ... );
    void MajorDebug(const char *fmt, ... );
    inline bool UsingSyslog() { return use_syslog; }
+   inline int LogFileno() { return (use_syslog || !errfs) ? -1 : fileno(errfs); }
    friend void LogHandler_write(int level, const char *format, ...);
 protected:
    void Lock();
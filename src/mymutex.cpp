@@ -55,37 +55,458 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
 #ifdef HAVE_SEMAPHORE_H
 #include <semaphore.h>
 #endif
 
+#include "compat_defs.h"
 #include "compat/semaphore.h"
 #include "loghandler.h"
 #include "mypopen.h"
+#include "vconf.h"
+
+
+#ifdef HAVE_WINDOWS_H
+
+/* Maximum number of processes that may hold a shared lock at once */
+#define MYRWLOCK_MAX_READERS 64
+
+/* Handle of a reader/writer lock */
+typedef struct _myrwlock_s
+{
+   sem_t *gate;   /* held by a writer while waiting for and holding the lock */
+   sem_t *room;   /* one token per reader, all tokens taken by a writer */
+   int mode;      /* 0 = unlocked, 1 = shared, 2 = exclusive */
+} MYRWLOCK;
 
 
 /*
- *  Function to create a mutex owned by the caller. Waits up to max_wait seconds
- *  for the mutex to be created. If max_wait is negative, waits indefinitely. If
- *  max_wait is zero, tries once to create mutex and does not block.
+ *  Function to open (or create) the named semaphore 'name' belonging to the
+ *  changer given by 'storage_name' with initial value 'value'. Characters not
+ *  allowed in a semaphore name are replaced with underscores.
+ *  On success, returns the semaphore. On error, returns zero and sets errno.
+ */
+static sem_t* open_named_sem(const char *storage_name, const char *name, unsigned int value)
+{
+   sem_t *sem;
+   char *p, lockname[256];
+
+   if (!storage_name || !storage_name[0] || !name || !name[0]) {
+      /* Only create named mutex */
+      errno = EINVAL;
+      return 0;
+   }
+   snprintf(lockname, sizeof(lockname), "vchanger-%s-%s", storage_name, name);
+   for (p = lockname; *p; p++) {
+      if (*p == '\\') *p = '_';
+   }
+   sem = sem_open(lockname, O_CREAT, 0770, value);
+   if (sem == SEM_FAILED) return 0;
+   return sem;
+}
+
+
+/*
+ *  Function to wait on semaphore 'sem' until absolute time 'deadline'. If
+ *  'deadline' is zero, tries once and does not block.
+ *  On success, returns zero. On error, returns -1 and sets errno.
+ */
+static int wait_named_sem(sem_t *sem, time_t deadline)
+{
+   struct timespec ts;
+   int rc;
+
+   if (deadline == 0) return sem_trywait(sem);
+   ts.tv_sec = deadline;  /* semaphore.h functions use absolute time */
+   ts.tv_nsec = 0;
+   do {
+      rc = sem_timedwait(sem, &ts);
+   } while (rc && errno == EINTR);
+   return rc;
+}
+
+
+/*
+ *  Function to create a named mutex 'name' belonging to the changer given by
+ *  'storage_name', so that the mutexes of independent changers on the same
+ *  host do not block each other.
  *  On success, returns the handle of a named mutex. On error, returns zero and
  *  sets errno appropriately.
  */
-void* mymutex_create(const char *storage_name)
+void* mymutex_create(const char *storage_name, const char *name)
+{
+   return (void*)open_named_sem(storage_name, name, 1);
+}
+
+
+/*
+ *  Function to lock an opened mutex given by fd.
+ *  On success, returns zero. On error, returns -1 and
+ *  sets errno appropriately.
+ */
+int mymutex_lock(void *fd, time_t wait_sec)
 {
-   char lockname[4096];
+   return wait_named_sem((sem_t*)fd, wait_sec ? time(NULL) + wait_sec : 0);
+}
 
-   if (!storage_name || !storage_name[0]) {
-      /* Only create named mutex */
+
+/*
+ *  Function to unlock an opened mutex given by fd.
+ *  On success, returns zero. On error, returns -1 and
+ *  sets errno appropriately.
+ */
+int mymutex_unlock(void *fd)
+{
+   return sem_post((sem_t*)fd);
+}
+
+
+/*
+ *  Function to destroy a mutex. The caller must unlock the mutex first if
+ *  it holds it. The named semaphore is not unlinked, because another
+ *  process may be waiting on it, and a process opening the name afterward
+ *  would create a new semaphore and so would not be excluded by it.
+ *  On success, returns zero. On error, returns -1 and
+ *  sets errno appropriately.
+ */
+int mymutex_destroy(void *fd)
+{
+   if (!fd) {
       errno = EINVAL;
+      return -1;
+   }
+   return sem_close((sem_t*)fd);
+}
+
+
+/*
+ *  Function to create a named reader/writer lock 'name' belonging to the
+ *  changer given by 'storage_name'. Any number of processes, up to
+ *  MYRWLOCK_MAX_READERS, may hold the lock shared at once, while a process
+ *  holding it exclusively excludes all others. Writers are preferred. A
+ *  writer waiting for the lock blocks new readers, so that a steady stream
+ *  of readers cannot starve it.
+ *  On success, returns the handle of the lock. On error, returns zero and
+ *  sets errno appropriately.
+ */
+void* myrwlock_create(const char *storage_name, const char *name)
+{
+   MYRWLOCK *lk;
+   char sname[128];
+
+   lk = (MYRWLOCK*)malloc(sizeof(MYRWLOCK));
+   if (!lk) {
+      errno = ENOMEM;
       return 0;
    }
-#ifdef HAVE_WINDOWS_H
-   snprintf(lockname, sizeof(lockname), "vchanger-%s", storage_name);
+   lk->mode = 0;
+   snprintf(sname, sizeof(sname), "%s-gate", name ? name : "");
+   lk->gate = open_named_sem(storage_name, sname, 1);
+   if (!lk->gate) {
+      free(lk);
+      return 0;
+   }
+   snprintf(sname, sizeof(sname), "%s-room", name ? name : "");
+   lk->room = open_named_sem(storage_name, sname, MYRWLOCK_MAX_READERS);
+   if (!lk->room) {
+      sem_close(lk->gate);
+      free(lk);
+      return 0;
+   }
+   return (void*)lk;
+}
+
+
+/*
+ *  Function to obtain a shared lock on the reader/writer lock given by 'fd',
+ *  waiting up to 'wait_sec' seconds. A reader passes through the gate, so
+ *  that it waits behind any writer, then takes one token from the room.
+ *  On success, returns zero. On error, returns -1 and sets errno.
+ */
+int myrwlock_rdlock(void *fd, time_t wait_sec)
+{
+   MYRWLOCK *lk = (MYRWLOCK*)fd;
+   time_t deadline = wait_sec ? time(NULL) + wait_sec : 0;
+
+   if (!lk || lk->mode) {
+      errno = EINVAL;
+      return -1;
+   }
+   if (wait_named_sem(lk->gate, deadline)) return -1;
+   if (wait_named_sem(lk->room, deadline)) {
+      int rc = errno;
+      sem_post(lk->gate);
+      errno = rc;
+      return -1;
+   }
+   sem_post(lk->gate);
+   lk->mode = 1;
+   return 0;
+}
+
+
+/*
+ *  Function to obtain an exclusive lock on the reader/writer lock given by
+ *  'fd', waiting up to 'wait_sec' seconds. The writer holds the gate, so
+ *  that no new readers may enter, while taking every token from the room
+ *  as the current readers leave.
+ *  On success, returns zero. On error, returns -1 and sets errno.
+ */
+int myrwlock_wrlock(void *fd, time_t wait_sec)
+{
+   MYRWLOCK *lk = (MYRWLOCK*)fd;
+   time_t deadline = wait_sec ? time(NULL) + wait_sec : 0;
+   int n, rc;
+
+   if (!lk || lk->mode) {
+      errno = EINVAL;
+      return -1;
+   }
+   if (wait_named_sem(lk->gate, deadline)) return -1;
+   for (n = 0; n < MYRWLOCK_MAX_READERS; n++) {
+      if (wait_named_sem(lk->room, deadline)) {
+         /* Timed out waiting for readers, so give back tokens taken */
+         rc = errno;
+         while (n--) sem_post(lk->room);
+         sem_post(lk->gate);
+         errno = rc;
+         return -1;
+      }
+   }
+   lk->mode = 2;
+   return 0;
+}
+
+
+/*
+ *  Function to release the lock held on the reader/writer lock given by 'fd'.
+ *  On success, returns zero. On error, returns -1 and sets errno.
+ */
+int myrwlock_unlock(void *fd)
+{
+   MYRWLOCK *lk = (MYRWLOCK*)fd;
+   int n;
+
+   if (!lk || !lk->mode) {
+      errno = EINVAL;
+      return -1;
+   }
+   if (lk->mode == 2) {
+      for (n = 0; n < MYRWLOCK_MAX_READERS; n++) sem_post(lk->room);
+      sem_post(lk->gate);
+   } else {
+      sem_post(lk->room);
+   }
+   lk->mode = 0;
+   return 0;
+}
+
+
+/*
+ *  Function to destroy the reader/writer lock given by 'fd', releasing
+ *  the lock if it is held. As with mymutex_destroy(), the named semaphores
+ *  are not unlinked.
+ *  On success, returns zero. On error, returns -1 and sets errno.
+ */
+int myrwlock_destroy(void *fd)
+{
+   MYRWLOCK *lk = (MYRWLOCK*)fd;
+
+   if (!lk) {
+      errno = EINVAL;
+      return -1;
+   }
+   if (lk->mode) myrwlock_unlock(fd);
+   sem_close(lk->room);
+   sem_close(lk->gate);
+   free(lk);
+   return 0;
+}
+
 #else
-   snprintf(lockname, sizeof(lockname), "/vchanger-%s", storage_name);
+
+/*
+ *  On POSIX systems, locks are fcntl() record locks on lock files in the
+ *  changer's work directory. Unlike a named semaphore, a record lock is
+ *  released by the kernel when the process holding it exits for any reason,
+ *  so a vchanger process that is killed while holding a lock does not delay
+ *  the next command. Open file description locks are used where available,
+ *  so that locks are owned by the lock handle rather than by the process.
+ *
+ *  Byte 0 of a lock file is the mutex, or the gate of a reader/writer lock.
+ *  Byte 1 is the room of a reader/writer lock. Bytes from LOCK_OWNER_OFFSET
+ *  record the pid of the last exclusive holder and when it took the lock.
+ */
+#ifdef F_OFD_SETLK
+#define LOCK_SETLK F_OFD_SETLK
+#define LOCK_GETLK F_OFD_GETLK
+#else
+#define LOCK_SETLK F_SETLK
+#define LOCK_GETLK F_GETLK
 #endif
-   return (void*)sem_open(lockname, O_CREAT, 0770, 1);
+#define LOCK_GATE 0
+#define LOCK_ROOM 1
+#define LOCK_OWNER_OFFSET 16
+#define LOCK_OWNER_SIZE 64
+
+/* Handle of a mutex or reader/writer lock */
+typedef struct _mylock_s
+{
+   int fd;        /* open lock file */
+   int mode;      /* 0 = unlocked, 1 = shared, 2 = exclusive */
+   char name[64];
+} MYLOCK;
+
+
+/*
+ *  Function to open (or create) the lock file 'name'.lock in the work
+ *  directory. The file is closed on exec so that locks are not inherited
+ *  by bconsole or other programs run while they are held.
+ *  On success, returns a lock handle. On error, returns zero and sets errno.
+ */
+static MYLOCK* open_lock_file(const char *name)
+{
+   MYLOCK *lk;
+   int rc;
+   tString fname;
+
+   if (!name || !name[0] || conf.work_dir.empty()) {
+      errno = EINVAL;
+      return 0;
+   }
+   lk = (MYLOCK*)malloc(sizeof(MYLOCK));
+   if (!lk) {
+      errno = ENOMEM;
+      return 0;
+   }
+   lk->mode = 0;
+   strncpy(lk->name, name, sizeof(lk->name) - 1);
+   lk->name[sizeof(lk->name) - 1] = 0;
+   tFormat(fname, "%s%s%s.lock", conf.work_dir.c_str(), DIR_DELIM, name);
+#ifdef O_CLOEXEC
+   lk->fd = open(fname.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0660);
+#else
+   lk->fd = open(fname.c_str(), O_RDWR | O_CREAT, 0660);
+   if (lk->fd >= 0) fcntl(lk->fd, F_SETFD, FD_CLOEXEC);
+#endif
+   if (lk->fd < 0) {
+      rc = errno;
+      free(lk);
+      errno = rc;
+      return 0;
+   }
+   return lk;
+}
+
+
+/*
+ *  Function to set (type F_RDLCK or F_WRLCK) or clear (type F_UNLCK) a lock
+ *  on byte 'pos' of the lock file without blocking.
+ *  On success, returns zero. On error, returns -1 and sets errno.
+ */
+static int set_lock_byte(MYLOCK *lk, short type, off_t pos)
+{
+   struct flock fl;
+
+   memset(&fl, 0, sizeof(fl));
+   fl.l_type = type;
+   fl.l_whence = SEEK_SET;
+   fl.l_start = pos;
+   fl.l_len = 1;
+   return fcntl(lk->fd, LOCK_SETLK, &fl);
+}
+
+
+/*
+ *  Function to log the pid and lock time recorded by the holder of
+ *  an exclusive lock on 'lk'.
+ */
+static void log_lock_owner(MYLOCK *lk)
+{
+   char buf[LOCK_OWNER_SIZE + 1];
+   ssize_t n;
+   int pid = 0;
+   long since = 0;
+
+   n = pread(lk->fd, buf, LOCK_OWNER_SIZE, LOCK_OWNER_OFFSET);
+   if (n <= 0) return;
+   buf[n] = 0;
+   if (sscanf(buf, "pid=%d since=%ld", &pid, &since) == 2) {
+      vlog.Info("%s lock last taken exclusively by pid %d %ld seconds ago%s", lk->name,
+            pid, (long)time(NULL) - since,
+            kill(pid, 0) == 0 || errno == EPERM ? "" : " (no longer running)");
+   }
+}
+
+
+/*
+ *  Function to wait for a lock on byte 'pos' of the lock file until absolute
+ *  time 'deadline', polling with increasing delay. If 'deadline' is zero,
+ *  tries once and does not block.
+ *  On success, returns zero. On error, returns -1 and sets errno.
+ */
+static int wait_lock_byte(MYLOCK *lk, short type, off_t pos, time_t deadline)
+{
+   struct timespec ts;
+   long delay_ms = 5;
+   bool logged = false;
+   time_t start = time(NULL);
+
+   for (;;) {
+      if (set_lock_byte(lk, type, pos) == 0) return 0;
+      if (errno != EAGAIN && errno != EACCES && errno != EINTR) return -1;
+      if (deadline == 0) {
+         errno = EAGAIN;
+         return -1;
+      }
+      if (time(NULL) >= deadline) {
+         errno = ETIMEDOUT;
+         return -1;
+      }
+      if (!logged && time(NULL) - start >= 2) {
+         log_lock_owner(lk);
+         logged = true;
+      }
+      ts.tv_sec = delay_ms / 1000;
+      ts.tv_nsec = (delay_ms % 1000) * 1000000L;
+      nanosleep(&ts, NULL);
+      if (delay_ms < 200) delay_ms *= 2;
+   }
+}
+
+
+/*
+ *  Function to record this process as the holder of an exclusive lock
+ */
+static void record_lock_owner(MYLOCK *lk)
+{
+   char buf[LOCK_OWNER_SIZE];
+
+   memset(buf, ' ', sizeof(buf));
+   snprintf(buf, sizeof(buf) - 1, "pid=%d since=%ld", (int)getpid(), (long)time(NULL));
+   buf[strlen(buf)] = ' ';
+   buf[sizeof(buf) - 1] = '\n';
+   if (pwrite(lk->fd, buf, sizeof(buf), LOCK_OWNER_OFFSET) < 0) {
+      vlog.Debug("errno=%d recording owner of %s lock", errno, lk->name);
+   }
+}
+
+
+/*
+ *  Function to create a named mutex 'name' belonging to the changer. The
+ *  mutex is a lock on the file 'name'.lock in the changer's work directory,
+ *  so the mutexes of independent changers do not block each other.
+ *  'storage_name' is only used on Windows, where named semaphores are used.
+ *  On success, returns the handle of a named mutex. On error, returns zero and
+ *  sets errno appropriately.
+ */
+void* mymutex_create(const char *storage_name, const char *name)
+{
+   (void)storage_name;
+   return (void*)open_lock_file(name);
 }
 
 
@@ -96,11 +517,16 @@ void* mymutex_create(const char *storage_name)
  */
 int mymutex_lock(void *fd, time_t wait_sec)
 {
-   struct timespec ts;
-   if (wait_sec == 0) return sem_trywait((sem_t*)fd);
-   ts.tv_sec = time(NULL) + wait_sec;  /* semaphore.h functions use absolute time */
-   ts.tv_nsec = 0;
-   return sem_timedwait((sem_t*)fd, &ts);
+   MYLOCK *lk = (MYLOCK*)fd;
+
+   if (!lk || lk->mode) {
+      errno = EINVAL;
+      return -1;
+   }
+   if (wait_lock_byte(lk, F_WRLCK, LOCK_GATE, wait_sec ? time(NULL) + wait_sec : 0)) return -1;
+   lk->mode = 2;
+   record_lock_owner(lk);
+   return 0;
 }
 
 
@@ -111,21 +537,143 @@ int mymutex_lock(void *fd, time_t wait_sec)
  */
 int mymutex_unlock(void *fd)
 {
-   return sem_post((sem_t*)fd);
+   MYLOCK *lk = (MYLOCK*)fd;
+
+   if (!lk || !lk->mode) {
+      errno = EINVAL;
+      return -1;
+   }
+   lk->mode = 0;
+   return set_lock_byte(lk, F_UNLCK, LOCK_GATE);
 }
 
 
 /*
- *  Function to destroy a mutex owned by the caller.
+ *  Function to destroy a mutex owned by the caller, releasing it if held.
+ *  The lock file is left in place, because another process may have it open.
  *  On success, returns zero. On error, returns -1 and
  *  sets errno appropriately.
  */
-void mymutex_destroy(const char *name, void *fd)
+int mymutex_destroy(void *fd)
 {
-   if (fd) {
-      sem_post((sem_t*)fd);
-      sem_close((sem_t*)fd);
+   MYLOCK *lk = (MYLOCK*)fd;
+   int rc;
+
+   if (!lk) {
+      errno = EINVAL;
+      return -1;
    }
-   if (name && name[0]) sem_unlink(name);
+   rc = close(lk->fd);
+   free(lk);
+   return rc;
 }
 
+
+/*
+ *  Function to create a named reader/writer lock 'name' belonging to the
+ *  changer. Any number of processes may hold the lock shared at once, while
+ *  a process holding it exclusively excludes all others. Writers are
+ *  preferred. A writer waiting for the lock holds the gate, which blocks
+ *  new readers, so that a steady stream of readers cannot starve it.
+ *  'storage_name' is only used on Windows, where named semaphores are used.
+ *  On success, returns the handle of the lock. On error, returns zero and
+ *  sets errno appropriately.
+ */
+void* myrwlock_create(const char *storage_name, const char *name)
+{
+   (void)storage_name;
+   return (void*)open_lock_file(name);
+}
+
+
+/*
+ *  Function to obtain a shared lock on the reader/writer lock given by 'fd',
+ *  waiting up to 'wait_sec' seconds. A reader passes through the gate, so
+ *  that it waits behind any writer, then takes a shared lock on the room.
+ *  On success, returns zero. On error, returns -1 and sets errno.
+ */
+int myrwlock_rdlock(void *fd, time_t wait_sec)
+{
+   MYLOCK *lk = (MYLOCK*)fd;
+   time_t deadline = wait_sec ? time(NULL) + wait_sec : 0;
+   int rc;
+
+   if (!lk || lk->mode) {
+      errno = EINVAL;
+      return -1;
+   }
+   if (wait_lock_byte(lk, F_WRLCK, LOCK_GATE, deadline)) return -1;
+   if (wait_lock_byte(lk, F_RDLCK, LOCK_ROOM, deadline)) {
+      rc = errno;
+      set_lock_byte(lk, F_UNLCK, LOCK_GATE);
+      errno = rc;
+      return -1;
+   }
+   set_lock_byte(lk, F_UNLCK, LOCK_GATE);
+   lk->mode = 1;
+   return 0;
+}
+
+
+/*
+ *  Function to obtain an exclusive lock on the reader/writer lock given by
+ *  'fd', waiting up to 'wait_sec' seconds. The writer holds the gate, so
+ *  that no new readers may enter, while waiting for the current readers to
+ *  leave the room.
+ *  On success, returns zero. On error, returns -1 and sets errno.
+ */
+int myrwlock_wrlock(void *fd, time_t wait_sec)
+{
+   MYLOCK *lk = (MYLOCK*)fd;
+   time_t deadline = wait_sec ? time(NULL) + wait_sec : 0;
+   int rc;
+
+   if (!lk || lk->mode) {
+      errno = EINVAL;
+      return -1;
+   }
+   if (wait_lock_byte(lk, F_WRLCK, LOCK_GATE, deadline)) return -1;
+   if (wait_lock_byte(lk, F_WRLCK, LOCK_ROOM, deadline)) {
+      rc = errno;
+      set_lock_byte(lk, F_UNLCK, LOCK_GATE);
+      errno = rc;
+      return -1;
+   }
+   lk->mode = 2;
+   record_lock_owner(lk);
+   return 0;
+}
+
+
+/*
+ *  Function to release the lock held on the reader/writer lock given by 'fd'.
+ *  On success, returns zero. On error, returns -1 and sets errno.
+ */
+int myrwlock_unlock(void *fd)
+{
+   MYLOCK *lk = (MYLOCK*)fd;
+   int rc;
+
+   if (!lk || !lk->mode) {
+      errno = EINVAL;
+      return -1;
+   }
+   rc = set_lock_byte(lk, F_UNLCK, LOCK_ROOM);
+   if (lk->mode == 2 && set_lock_byte(lk, F_UNLCK, LOCK_GATE)) rc = -1;
+   lk->mode = 0;
+   return rc;
+}
+
+
+/*
+ *  Function to destroy the reader/writer lock given by 'fd', releasing
+ *  the lock if it is held.
+ *  On success, returns zero. On error, returns -1 and sets errno.
+ */
+int myrwlock_destroy(void *fd)
+{
+   return mymutex_destroy(fd);
+}
+
+
+#endif
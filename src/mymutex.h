@@ -24,9 +24,14 @@
 #include <time.h>
 #endif
 
-void* mymutex_create(const char *storage_name);
+void* mymutex_create(const char *storage_name, const char *name);
 int mymutex_lock(void* fd, time_t wait_sec);
 int mymutex_unlock(void* fd);
-int mymutex_destroy(const char *storage_name, void* fd);
+int mymutex_destroy(void* fd);
+void* myrwlock_create(const char *storage_name, const char *name);
+int myrwlock_rdlock(void* fd, time_t wait_sec);
+int myrwlock_wrlock(void* fd, time_t wait_sec);
+int myrwlock_unlock(void* fd);
+int myrwlock_destroy(void* fd);
 
 #endif /* _MYPOPEN_H_ */
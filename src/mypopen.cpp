@@ -44,50 +44,56 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef _POSIX_SPAWN
+#include <spawn.h>
+#endif
+#ifndef HAVE_WINDOWS_H
+#include <poll.h>
+#endif
+#include <vector>
 
+#include "compat/gettimeofday.h"
 #include "loghandler.h"
 #include "mypopen.h"
 
+/* Seconds allowed for a command to exit after SIGTERM before it is killed */
+#define MYPOPEN_KILL_GRACE 5
+/* Milliseconds to keep reading output after a command exits, while its
+ * descendants may still hold the pipes open */
+#define MYPOPEN_DRAIN_MS 500
+
 /*
- *  Function to parse command line into argv and argc.
- *  cmd is command line to be executed. Arguments in cmd will be
- *  parsed and copied to buffer. On output, each element of argv[]
- *  will point to a NULL-terminated string located in buffer.
- *  argv[0] will point to the command and argc will be updated to
- *  indicate the number of arguments found (including the command
- *  in argv[0]). On input, if *argv_in is NULL, then memory for
- *  the argv[] array will be allocated and the caller will be
- *  responsible for freeing it. If *argv_in is non-null, then
- *  *argc must be set to the max number of elements that *argv_in
- *  can hold, including the terminating NULL pointer.
+ *  Function to parse command line into arguments. Arguments are separated
+ *  by whitespace. A single or double quoted string is treated as a single
+ *  argument, within which a backslash escapes the next character. The
+ *  parsed arguments are placed in 'args', and on return argv[] holds
+ *  pointers to each argument in 'args' followed by a terminating NULL
+ *  pointer, so 'args' must not be modified while argv[] is in use.
+ *  Returns zero on success, or -1 if no arguments were found.
  */
-static int mypopen_args(const char *cmd, char* (&argv)[50], int &argc, char *buffer, size_t buffer_sz)
+static int mypopen_args(const char *cmd, tStringArray &args, std::vector<char*> &argv)
 {
-   char quote, *b, *b1;
-   const char *p;
-   int maxargs = 50;
-
-   /* Initialize arg array */
-   if (argc < 2) return -1;
-   maxargs = argc;
-   argc = 0;
-   memset(argv, 0, maxargs * sizeof(char*));
-   /* Initialize arg buffer */
-   if (strlen(cmd) + 1 >= buffer_sz) return -1;
-   *buffer = '\0';
-
-   /* Parse args */
-   b = buffer;
-   p = cmd;
-   b1 = b;
-   --maxargs; /* Ensure room for trailing NULL arg ptr */
+   char quote;
+   const char *p = cmd;
+   size_t n;
+
+   args.clear();
+   argv.clear();
    while (*p) {
       /* skip whitespace between args */
       if (isspace(*p)) {
          ++p;
          continue;
       }
-      /* Copy next arg to buffer */
+      args.push_back(tString());
+      tString &arg = args.back();
+      /* Copy next arg */
       if (*p == '"' || *p == '\'') {
          /* Quoted string is treated as one arg */
          quote = *p;
@@ -97,36 +103,26 @@ static int mypopen_args(const char *cmd, char* (&argv)[50], int &argc, char *buf
                ++p;
                if (*p == 0) break;
             }
-            *b = *p;
-            ++b;
+            arg += *p;
             ++p;
          }
+         if (*p) ++p;
       } else {
          /* Arg is space-delimited */
          while (*p && !isspace(*p)) {
-            *b = *p;
-            ++b;
+            arg += *p;
             ++p;
          }
       }
-      *b = '\0';
-      ++b;
-      /* Set argument array pointer */
-      argv[argc] = b1;
-      /* Position to next arg */
-      b1 = b;
-      argc += 1;
-      if (argc >= maxargs) {
-         /* Max args exceeded */
-         argc = 0;
-         return -1;
-      }
    }
    /* Check for no args at all */
-   if (argc == 0) {
-      return -1;
+   if (args.empty()) return -1;
+   /* Build argv[] array */
+   argv.reserve(args.size() + 1);
+   for (n = 0; n < args.size(); n++) {
+      argv.push_back(&args[n][0]);
    }
-
+   argv.push_back(NULL);
    return 0;
 }
 
@@ -146,8 +142,93 @@ static void CloseAllPipes(int *pipe_in, int *pipe_out, int *pipe_err)
 
 
 
+#ifndef HAVE_WINDOWS_H
+extern char **environ;
+
 /*
- *  Function to fork a child process, specifying the command and arguments to be
+ *  Function to create a pipe with the close-on-exec flag set on both ends,
+ *  so that pipe ends are never leaked into unrelated child processes.
+ *  On success returns zero, else returns -1 and sets errno.
+ */
+static int pipe_cloexec(int *fds)
+{
+#if defined(O_CLOEXEC) && defined(__linux__)
+   return pipe2(fds, O_CLOEXEC);
+#else
+   int rc;
+   if (pipe(fds)) return -1;
+   if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) || fcntl(fds[1], F_SETFD, FD_CLOEXEC)) {
+      rc = errno;
+      close(fds[0]);
+      close(fds[1]);
+      fds[0] = fds[1] = -1;
+      errno = rc;
+      return -1;
+   }
+   return 0;
+#endif
+}
+
+
+/*
+ *  Function to start a child process running argv[0], with the child's stdin,
+ *  stdout, and stderr made duplicates of child_fd[0], child_fd[1], and
+ *  child_fd[2] respectively. A child_fd[] value of -1 leaves the child
+ *  inheriting the parent's corresponding file. Files in close_fd[] are
+ *  closed in the child after its standard files have been assigned.
+ *  Uses posix_spawn where available, so that the cost of starting the
+ *  child does not depend on the size of the parent process.
+ *  On success, returns the pid of the child. On error, returns -1 and sets errno.
+ */
+static int spawn_child(char **argv, const int *child_fd, const int *close_fd, int close_count)
+{
+   int n;
+#ifdef _POSIX_SPAWN
+   int rc;
+   pid_t pid;
+   posix_spawn_file_actions_t fa;
+
+   rc = posix_spawn_file_actions_init(&fa);
+   if (rc) {
+      errno = rc;
+      return -1;
+   }
+   for (n = 0; n < 3 && !rc; n++) {
+      if (child_fd[n] >= 0) rc = posix_spawn_file_actions_adddup2(&fa, child_fd[n], n);
+   }
+   for (n = 0; n < close_count && !rc; n++) {
+      if (close_fd[n] > STDERR_FILENO) rc = posix_spawn_file_actions_addclose(&fa, close_fd[n]);
+   }
+   if (!rc) rc = posix_spawnp(&pid, argv[0], &fa, NULL, argv, environ);
+   posix_spawn_file_actions_destroy(&fa);
+   if (rc) {
+      errno = rc;
+      return -1;
+   }
+   return pid;
+#else
+   int pid;
+
+   pid = fork();
+   if (pid == 0) {
+      /* Child must not log or otherwise take locks that may have been
+       * held by another thread of the parent at the time of the fork */
+      for (n = 0; n < 3; n++) {
+         if (child_fd[n] >= 0) dup2(child_fd[n], n);
+      }
+      for (n = 0; n < close_count; n++) {
+         if (close_fd[n] > STDERR_FILENO) close(close_fd[n]);
+      }
+      execvp(argv[0], argv);
+      _exit(127);
+   }
+   return pid;
+#endif
+}
+
+
+/*
+ *  Function to start a child process, specifying the command and arguments to be
  *  run in the child and the child's standard i/o files. If fno_stdXXX is NULL,
  *  then the child will inherit the parent's stdXXX. If *fno_stdXXX is -1, then
  *  a pipe will be created with the child's stdXXX being one end of the pipe and
@@ -156,13 +237,12 @@ static void CloseAllPipes(int *pipe_in, int *pipe_out, int *pipe_err)
  *  used as the corresponding stdXXX in the child.
  *  On success, returns the pid of the child. On error, returns -1 and sets errno.
  */
-#ifndef HAVE_WINDOWS_H
 static int do_mypopen_raw(const char *cline, int *fno_stdin, int *fno_stdout, int *fno_stderr)
 {
-   int rc, pipe_in[2], pipe_out[2], pipe_err[2];
-   int n, pid = -1, argc = 50;
-   char* argv[50];
-   char argbuf[4096];
+   int rc, n, pid, pipe_in[2], pipe_out[2], pipe_err[2];
+   int child_fd[3] = { -1, -1, -1 }, close_fd[3], close_count = 0;
+   tStringArray args;
+   std::vector<char*> argv;
 
    /* Sanity check parameters */
    if (!cline || !cline[0]) {
@@ -177,8 +257,7 @@ static int do_mypopen_raw(const char *cline, int *fno_stdin, int *fno_stdout, in
    }
 
    /* Build argv array from command line string */
-   if (mypopen_args(cline, argv, argc, argbuf, sizeof(argbuf))) {
-      /* Invalid args, so terminate child */
+   if (mypopen_args(cline, args, argv)) {
       vlog.Debug("popen: invalid cmdline args for child");
       errno = EINVAL;
       return -1;
@@ -188,15 +267,13 @@ static int do_mypopen_raw(const char *cline, int *fno_stdin, int *fno_stdout, in
    if (fno_stdin) {
       if (*fno_stdin < 0) {
          /* Caller requests a pipe by specifying descriptor -1 */
-         rc = pipe(pipe_in);
-         if (rc) {
-            /* error creating pipe */
-            return -1;
-         }
+         if (pipe_cloexec(pipe_in)) return -1;
+         child_fd[0] = pipe_in[0];
          vlog.Debug("popen: child stdin uses pipe (%d -> %d)", pipe_in[0], pipe_in[1]);
-      } else if (*fno_stdin == STDIN_FILENO) {
-         /* Caller specified stdin so just let child inherit it */
-         fno_stdin = NULL;
+      } else if (*fno_stdin != STDIN_FILENO) {
+         /* Child's stdin will read from caller's input file */
+         child_fd[0] = *fno_stdin;
+         close_fd[close_count++] = *fno_stdin;
       }
    }
 
@@ -204,18 +281,19 @@ static int do_mypopen_raw(const char *cline, int *fno_stdin, int *fno_stdout, in
    if (fno_stdout) {
       if (*fno_stdout < 0) {
          /* Caller requests a pipe by specifying descriptor -1 */
-         rc = pipe(pipe_out);
-         if (rc) {
-            /* error creating pipe */
+         if (pipe_cloexec(pipe_out)) {
             rc = errno;
             CloseAllPipes(pipe_in, pipe_out, pipe_err);
             errno = rc;
             return -1;
          }
+         child_fd[1] = pipe_out[1];
          vlog.Debug("popen: child stdout uses pipe (%d -> %d)", pipe_out[0], pipe_out[1]);
-      } else {
-         if (*fno_stdout == STDOUT_FILENO) fno_stdout = NULL;
-         else fsync(*fno_stdout);
+      } else if (*fno_stdout != STDOUT_FILENO) {
+         /* Child's stdout will write to caller's output file */
+         fsync(*fno_stdout);
+         child_fd[1] = *fno_stdout;
+         close_fd[close_count++] = *fno_stdout;
       }
    }
 
@@ -223,115 +301,43 @@ static int do_mypopen_raw(const char *cline, int *fno_stdin, int *fno_stdout, in
    if (fno_stderr) {
       if (*fno_stderr < 0) {
          /* Caller requests a pipe by specifying descriptor -1 */
-         rc = pipe(pipe_err);
-         if (rc) {
-            /* error creating pipe */
+         if (pipe_cloexec(pipe_err)) {
             rc = errno;
             CloseAllPipes(pipe_in, pipe_out, pipe_err);
             errno = rc;
             return -1;
          }
+         child_fd[2] = pipe_err[1];
          vlog.Debug("popen: child stderr uses pipe (%d -> %d)", pipe_err[0], pipe_err[1]);
-      } else {
-         if (*fno_stderr == STDERR_FILENO) fno_stderr = NULL;
-         else fsync(*fno_stderr);
+      } else if (*fno_stderr != STDERR_FILENO) {
+         /* Child's stderr will write to caller's error file */
+         fsync(*fno_stderr);
+         child_fd[2] = *fno_stderr;
+         close_fd[close_count++] = *fno_stderr;
       }
    }
 
-   /* fork a child process to run the command in */
-   vlog.Debug("popen: forking now");
-   pid = fork();
-   switch (pid)
-   {
-   case -1: /* error creating process */
+   /* Start child process. Pipe ends are close-on-exec, so the child keeps
+    * only the ends assigned to its standard files */
+   vlog.Debug("popen: starting '%s' with %d args", argv[0], (int)args.size() - 1);
+   pid = spawn_child(&argv[0], child_fd, close_fd, close_count);
+   if (pid < 0) {
       rc = errno;
+      vlog.Debug("popen: failed to start '%s' errno=%d", argv[0], rc);
       CloseAllPipes(pipe_in, pipe_out, pipe_err);
       errno = rc;
       return -1;
-
-   case 0: /* child is running */
-      /* close pipe ends always used by parent */
-      vlog.Debug("popen: child closing pipe ends %d,%d,%d used by parent", pipe_in[1], pipe_out[0], pipe_err[0]);
-      if (pipe_in[1] >= 0) close(pipe_in[1]);
-      if (pipe_out[0] >= 0) close(pipe_out[0]);
-      if (pipe_err[0] >= 0) close(pipe_err[0]);
-      /* assign child's stdin */
-      if (fno_stdin) {
-         if (*fno_stdin < 0) {
-            /* Read end of pipe will be child's stdin */
-            vlog.Debug("popen: child will read stdin from %d", pipe_in[0]);
-            dup2(pipe_in[0], STDIN_FILENO);
-            close(pipe_in[0]);
-         } else {
-            /* Child's stdin will read from caller's input file */
-            dup2(*fno_stdin, STDIN_FILENO);
-            close(*fno_stdin);
-         }
-      }
-      /* assign child's stdout */
-      if (fno_stdout) {
-         if (*fno_stdout < 0) {
-            /* Write end of pipe will be child's stdout */
-            vlog.Debug("popen: child will write stdout to %d", pipe_out[1]);
-            dup2(pipe_out[1], STDOUT_FILENO);
-            close(pipe_out[1]);
-         } else {
-            /* Child's stdout will write to caller's output file */
-            dup2(*fno_stdout, STDOUT_FILENO);
-            close(*fno_stdout);
-         }
-      }
-      /* assign child's stderr */
-      if (fno_stderr) {
-         if (*fno_stderr < 0) {
-            /* Write end of pipe will be child's stderr */
-            vlog.Debug("popen: child will write stderr to %d", pipe_err[1]);
-            dup2(pipe_err[1], STDERR_FILENO);
-            close(pipe_err[1]);
-         } else {
-            /* Child's stderr will write to caller's error file */
-            dup2(*fno_stderr, STDERR_FILENO);
-            close(*fno_stderr);
-         }
-      }
-      /* now run the command */
-      vlog.Debug("popen: child executing '%s'", argv[0]);
-      execvp(argv[0], argv);
-      /* only gets here if execvp fails */
-      return -1;
    }
 
-   /* parent is running this */
-
-   /* close pipe ends always used by child */
-   vlog.Debug("popen: parent closing pipe ends %d,%d,%d used by child", pipe_in[0], pipe_out[1], pipe_err[1]);
+   /* close pipe ends used by child */
    if (pipe_in[0] >= 0) close(pipe_in[0]);
    if (pipe_out[1] >= 0) close(pipe_out[1]);
    if (pipe_err[1] >= 0) close(pipe_err[1]);
 
    /* Pass pipe ends being used back to caller */
-   if (fno_stdin) {
-      if (*fno_stdin < 0) {
-         /* Caller will be writing to child's stdin through pipe */
-         *fno_stdin = pipe_in[1];
-         vlog.Debug("popen: parent writes child's stdin to %d", pipe_in[1]);
-      }
-   }
-   if (fno_stdout) {
-      if (*fno_stdout < 0) {
-         /* Caller will be reading from child's stdout through pipe */
-         *fno_stdout = pipe_out[0];
-         vlog.Debug("popen: parent reads child's stdout from %d", pipe_out[0]);
-      }
-   }
-   if (fno_stderr) {
-      if (*fno_stderr < 0) {
-         /* Caller will be reading from child's stderr through pipe */
-         *fno_stderr = pipe_err[0];
-         vlog.Debug("popen: parent reads child's stderr from %d", pipe_err[0]);
-      }
-   }
-   //sleep(2);
+   if (fno_stdin && *fno_stdin < 0) *fno_stdin = pipe_in[1];
+   if (fno_stdout && *fno_stdout < 0) *fno_stdout = pipe_out[0];
+   if (fno_stderr && *fno_stderr < 0) *fno_stderr = pipe_err[0];
    vlog.Debug("popen: parent returning pid=%d of child", pid);
    return pid;
 }
@@ -342,8 +348,9 @@ static int do_mypopen_raw(const char *cline, int *fno_stdin, int *fno_stdout, in
    int rc, pipe_in[2], pipe_out[2], pipe_err[2];
    int save_in = -1, save_out = -1, save_err = -1;
    int child_in = -1, child_out = -1, child_err = -1;
-   int n, pid = -1, argc = 50;
-   char *argv[50], argbuf[4096];
+   int n, pid = -1;
+   tStringArray args;
+   std::vector<char*> argv;
 
    /* Sanity check parameters */
    if (!cline || !cline[0]) {
@@ -358,7 +365,7 @@ static int do_mypopen_raw(const char *cline, int *fno_stdin, int *fno_stdout, in
    }
 
    /* Build argv array from command line string */
-   if (mypopen_args(cline, argv, argc, argbuf, sizeof(argbuf))) {
+   if (mypopen_args(cline, args, argv)) {
       /* Invalid args, so terminate child */
       vlog.Debug("popen: invalid cmdline args for child");
       errno = EINVAL;
@@ -514,7 +521,7 @@ static int do_mypopen_raw(const char *cline, int *fno_stdin, int *fno_stdout, in
 
    /* Spawn the child process */
    rc = 0;
-   pid = _spawnvp(_P_NOWAIT, argv[0], argv);
+   pid = _spawnvp(_P_NOWAIT, argv[0], &argv[0]);
    if (pid < 0) {
       /* spawn failed */
       rc = errno;
@@ -724,3 +731,174 @@ int mypopenrw(const char *command, const char *cmd_in, const char *cmd_out, cons
    return rc;
 }
 
+
+#ifndef HAVE_WINDOWS_H
+/*
+ *  Function to return the milliseconds elapsed since 't0'
+ */
+static long elapsed_ms(const struct timeval &t0)
+{
+   struct timeval t1;
+   gettimeofday(&t1, NULL);
+   return (t1.tv_sec - t0.tv_sec) * 1000L + (t1.tv_usec - t0.tv_usec) / 1000L;
+}
+
+
+/*
+ *  Function to run a command in a child process, writing 'input' to the
+ *  child's stdin while concurrently capturing its stdout and stderr, so that
+ *  the child cannot block on a full pipe. If the command has not exited
+ *  within 'timeout_sec' seconds, it is sent SIGTERM, and then SIGKILL if it
+ *  has still not exited after a further MYPOPEN_KILL_GRACE seconds. The child
+ *  is reaped as soon as it exits, after which output is read for at most
+ *  MYPOPEN_DRAIN_MS milliseconds, so that descendants left holding the pipes
+ *  open cannot delay the return.
+ *  On return, 'result' holds the command's exit status, captured output,
+ *  and run time.
+ *  Returns zero if the command was run and reaped, else returns errno.
+ */
+int mypopen_run(const char *command, const tString &input, int timeout_sec, MYPOPEN_RESULT &result)
+{
+   int pid, rc, status, n, nfds, fno_in = -1, fno_out = -1, fno_err = -1;
+   size_t written = 0;
+   long wait_ms, deadline_ms = timeout_sec * 1000L;
+   bool exited = false, term_sent = false, kill_sent = false;
+   struct pollfd pfd[3];
+   struct timeval t0;
+   char buf[4096];
+
+   result.exit_code = -1;
+   result.term_signal = 0;
+   result.timed_out = false;
+   result.elapsed_ms = 0;
+   result.out.clear();
+   result.err.clear();
+
+   gettimeofday(&t0, NULL);
+   pid = do_mypopen_raw(command, &fno_in, &fno_out, &fno_err);
+   if (pid < 0) return errno;
+   fcntl(fno_in, F_SETFL, fcntl(fno_in, F_GETFL) | O_NONBLOCK);
+   if (input.empty()) {
+      close(fno_in);
+      fno_in = -1;
+   }
+
+   for (;;) {
+      /* Reap the child as soon as it exits, then only drain the pipes */
+      if (!exited) {
+         rc = waitpid(pid, &status, WNOHANG);
+         if (rc == pid) {
+            exited = true;
+            deadline_ms = elapsed_ms(t0) + MYPOPEN_DRAIN_MS;
+         } else if (rc < 0 && errno != EINTR) {
+            break;
+         }
+      }
+      wait_ms = deadline_ms - elapsed_ms(t0);
+      if (exited && (wait_ms <= 0 || (fno_out < 0 && fno_err < 0))) break;
+      /* Escalate from SIGTERM to SIGKILL once the deadline has passed */
+      if (wait_ms <= 0) {
+         if (!term_sent) {
+            vlog.Error("popen: '%s' pid=%d still running after %d seconds - terminating",
+                  command, pid, timeout_sec);
+            kill(pid, SIGTERM);
+            term_sent = true;
+            result.timed_out = true;
+            deadline_ms += MYPOPEN_KILL_GRACE * 1000L;
+         } else if (!kill_sent) {
+            vlog.Error("popen: '%s' pid=%d ignored SIGTERM - killing", command, pid);
+            kill(pid, SIGKILL);
+            kill_sent = true;
+            deadline_ms += 1000;
+         } else {
+            /* Pipes may be held open by descendants of the killed child */
+            break;
+         }
+         wait_ms = deadline_ms - elapsed_ms(t0);
+      }
+      /* Wake periodically to check whether the child has exited */
+      if (wait_ms > 100) wait_ms = 100;
+      /* Wait for pipes to become ready */
+      nfds = 0;
+      if (fno_in >= 0) {
+         pfd[nfds].fd = fno_in;
+         pfd[nfds++].events = POLLOUT;
+      }
+      if (fno_out >= 0) {
+         pfd[nfds].fd = fno_out;
+         pfd[nfds++].events = POLLIN;
+      }
+      if (fno_err >= 0) {
+         pfd[nfds].fd = fno_err;
+         pfd[nfds++].events = POLLIN;
+      }
+      if (nfds == 0 && wait_ms > 10) {
+         /* All pipes closed, so just wait for child to exit */
+         wait_ms = 10;
+      }
+      rc = poll(pfd, nfds, (int)wait_ms);
+      if (rc < 0) {
+         if (errno == EINTR) continue;
+         rc = errno;
+         vlog.Error("popen: errno=%d polling pipes of pid=%d", rc, pid);
+         kill(pid, SIGKILL);
+         break;
+      }
+      for (n = 0; n < nfds; n++) {
+         if (!pfd[n].revents) continue;
+         if (pfd[n].fd == fno_in) {
+            /* Write more input to child's stdin */
+            rc = write(fno_in, input.c_str() + written, input.size() - written);
+            if (rc > 0) written += rc;
+            if ((rc < 0 && errno != EAGAIN && errno != EINTR) || written >= input.size()) {
+               if (rc < 0) vlog.Error("popen: errno=%d writing stdin of pid=%d", errno, pid);
+               close(fno_in);
+               fno_in = -1;
+            }
+            continue;
+         }
+         /* Capture child's stdout or stderr */
+         rc = read(pfd[n].fd, buf, sizeof(buf));
+         if (rc > 0) {
+            if (pfd[n].fd == fno_out) result.out.append(buf, rc);
+            else result.err.append(buf, rc);
+         } else if (rc == 0 || (errno != EAGAIN && errno != EINTR)) {
+            /* EOF or error */
+            close(pfd[n].fd);
+            if (pfd[n].fd == fno_out) fno_out = -1;
+            else fno_err = -1;
+         }
+      }
+   }
+   if (fno_in >= 0) close(fno_in);
+   if (fno_out >= 0) close(fno_out);
+   if (fno_err >= 0) close(fno_err);
+
+   /* Reap child */
+   if (!exited) {
+      while ((rc = waitpid(pid, &status, WNOHANG)) < 0 && errno == EINTR) ;
+      if (rc == 0) {
+         /* Polling was abandoned while the child still runs */
+         kill(pid, SIGKILL);
+         while ((rc = waitpid(pid, &status, 0)) < 0 && errno == EINTR) ;
+      }
+      if (rc < 0) return errno;
+   }
+   result.elapsed_ms = elapsed_ms(t0);
+   if (WIFEXITED(status)) {
+      result.exit_code = WEXITSTATUS(status);
+   } else if (WIFSIGNALED(status)) {
+      result.term_signal = WTERMSIG(status);
+   }
+   vlog.Debug("popen: pid=%d exit_code=%d signal=%d in %ld ms, %lu bytes stdout, %lu bytes stderr",
+         pid, result.exit_code, result.term_signal, result.elapsed_ms,
+         (unsigned long)result.out.size(), (unsigned long)result.err.size());
+   return 0;
+}
+
+#else
+int mypopen_run(const char *command, const tString &input, int timeout_sec, MYPOPEN_RESULT &result)
+{
+   return ENOSYS;
+}
+#endif
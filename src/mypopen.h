@@ -34,4 +34,21 @@ int mypopenrw(const char *command, const char *cmd_in = NULL, const char *cmd_ou
 inline int mypopenrw(const tString &command, const char *cmd_in = NULL, const char *cmd_out = NULL, const char *cmd_err = NULL)
    { return mypopenrw(command.c_str(), cmd_in, cmd_out, cmd_err); }
 
+/*
+ *  Result of running a command with mypopen_run()
+ */
+typedef struct _mypopen_result_s
+{
+   int exit_code;       /* exit code of command, or -1 if terminated by a signal */
+   int term_signal;     /* signal that terminated command, else zero */
+   bool timed_out;      /* true if command was killed because the deadline passed */
+   long elapsed_ms;     /* milliseconds from start of command until it was reaped */
+   tString out;         /* captured stdout */
+   tString err;         /* captured stderr */
+} MYPOPEN_RESULT;
+
+int mypopen_run(const char *command, const tString &input, int timeout_sec, MYPOPEN_RESULT &result);
+inline int mypopen_run(const tString &command, const tString &input, int timeout_sec, MYPOPEN_RESULT &result)
+   { return mypopen_run(command.c_str(), input, timeout_sec, result); }
+
 #endif /* _MYPOPEN_H_ */
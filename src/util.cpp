@@ -179,6 +179,60 @@ int drop_privs(const char *uname, const char *gname)
 }
 
 
+/*-------------------------------------------------
+ *  Function to temporarily assume the persona of the given user name and
+ *  group name by changing only the effective uid:gid, so that root
+ *  privileges can later be regained by calling restore_privs(). Does
+ *  nothing if not running as root.
+ *  On success returns zero, else on error returns errno.
+ *------------------------------------------------*/
+int assume_privs(const char *uname, const char *gname)
+{
+#ifdef HAVE_WINDOWS_H
+   return 0;  /* For windows ignore user switching */
+#else
+   gid_t new_gid;
+   struct passwd *pw;
+   struct group *gr;
+   if (!uname || !uname[0] || getuid()) return 0; /* Nothing to do */
+   if ((pw = getpwnam(uname)) == NULL) return errno ? errno : ENOENT;
+   if (pw->pw_uid == 0) return 0; /* already running as root */
+   new_gid = pw->pw_gid;
+   if (gname && gname[0]) {
+      /* find given group */
+      if ((gr = getgrnam(gname)) == NULL) return errno ? errno : ENOENT; /* no such group */
+      new_gid = gr->gr_gid;
+   }
+   /* Set supplemental groups and group while still root */
+   if (initgroups(uname, new_gid)) return errno;
+   if (setegid(new_gid)) return errno;
+   /* Act as given user, keeping root as the real uid */
+   if (seteuid(pw->pw_uid)) return errno;
+   return 0;
+#endif
+}
+
+
+/*-------------------------------------------------
+ *  Function to regain root privileges given up by assume_privs().
+ *  Does nothing if not running as root.
+ *  On success returns zero, else on error returns errno.
+ *------------------------------------------------*/
+int restore_privs()
+{
+#ifdef HAVE_WINDOWS_H
+   return 0;
+#else
+   gid_t gid = 0;
+   if (getuid()) return 0; /* Nothing to do */
+   if (geteuid() && seteuid(0)) return errno;
+   if (setegid(0)) return errno;
+   if (setgroups(1, &gid)) return errno;
+   return 0;
+#endif
+}
+
+
 /*-------------------------------------------------
  *  Function returns zero if current user not superuser
  *  else non-zero.
@@ -28,6 +28,8 @@ long timeval_et(struct timeval *tv1, struct timeval *tv2);
 int exclusive_fopen(const char *fname, FILE **fs);
 int file_copy(const char *to, const char *from);
 int drop_privs(const char *uname, const char *gname);
+int assume_privs(const char *uname, const char *gname);
+int restore_privs();
 int is_root_user();
 
 #endif /* _UTIL_H_ */
@@ -39,7 +39,31 @@
 #ifdef HAVE_CTYPE_H
 #include <ctype.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#define MOUNTINFO_PATH "/proc/self/mountinfo"
+#define DISK_BY_UUID_DIR "/dev/disk/by-uuid/"
+#endif
 
+#include "compat/getline.h"
 #include "uuidlookup.h"
 #include "loghandler.h"
 
@@ -129,8 +153,47 @@ int GetMountpointFromUUID(char *mountp, size_t mountp_sz, const char *uuid_str)
    return 0;
 }
 
+/*
+ *  Mount table is not cached on Windows
+ */
+int LoadMountTable(void)
+{
+   return 0;
+}
+
+void FreeMountTable(void)
+{
+}
+
+int GetMountTableSignature(unsigned long long *sig)
+{
+   return -1;
+}
+
+int GetUUIDDevice(const char *uuid_str, unsigned long long *dev)
+{
+   return -1;
+}
+
+int GetDevnoMountpoint(char *mountp, size_t mountp_sz, unsigned long long devno)
+{
+   return -1;
+}
+
 #else
 
+#if defined(HAVE_PTHREAD_H) && (!defined(__GLIBC__) || (!defined(HAVE_LIBUDEV_H) \
+      && defined(HAVE_BLKID_BLKID_H)))
+/* Serializes calls into non-reentrant libraries when magazines are
+ * mounted concurrently */
+static pthread_mutex_t lookup_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LOOKUP_LOCK() pthread_mutex_lock(&lookup_mutex)
+#define LOOKUP_UNLOCK() pthread_mutex_unlock(&lookup_mutex)
+#else
+#define LOOKUP_LOCK()
+#define LOOKUP_UNLOCK()
+#endif
+
 #ifdef HAVE_MNTENT_H
 #include <mntent.h>
 
@@ -149,6 +212,13 @@ static int GetDevMountpoint(char *mountp, size_t mountp_sz, const char *devname)
    FILE *fs;
    struct mntent *ent;
    int rc;
+#ifdef __GLIBC__
+   struct mntent ent_buf;
+   char str_buf[4096];
+#define GETMNTENT(f) getmntent_r(f, &ent_buf, str_buf, sizeof(str_buf))
+#else
+#define GETMNTENT(f) getmntent(f)
+#endif
 
    mountp[0] = '\0';
    if (!mountp_sz || !devname || !strlen(devname)) return -2;
@@ -157,8 +227,11 @@ static int GetDevMountpoint(char *mountp, size_t mountp_sz, const char *devname)
    fs = setmntent(_PATH_MOUNTED, "r");
    if (fs == NULL) return -1; /* unknown non-POSIX system?? */
 
+#ifndef __GLIBC__
+   LOOKUP_LOCK();
+#endif
    rc = -4;
-   ent = getmntent(fs);
+   ent = GETMNTENT(fs);
    while (ent)
    {
       if (strcasecmp(devname, ent->mnt_fsname) == 0) {
@@ -172,8 +245,12 @@ static int GetDevMountpoint(char *mountp, size_t mountp_sz, const char *devname)
          rc = 0;
          break;
       }
-      ent = getmntent(fs);
+      ent = GETMNTENT(fs);
    }
+#ifndef __GLIBC__
+   LOOKUP_UNLOCK();
+#endif
+#undef GETMNTENT
    endmntent(fs);
    return rc;
 }
@@ -238,32 +315,500 @@ static int GetDevMountpoint(char *mountp, size_t mountp_sz, const char *devname)
 #endif  /* HAVE_GETFSSTAT */
 #endif  /* HAVE_MNTENT_H */
 
+/*
+ *  Table of mounted filesystems, hashed by device number, built from a
+ *  single read of /proc/self/mountinfo. Filesystems mounted with an
+ *  anonymous device number (major 0), such as btrfs, cannot be found by the
+ *  number of their block device, so they are also kept in a list by mount
+ *  source. Where mountinfo is not available, the table is left unloaded and
+ *  mountpoints are found by scanning the mount table for each device name.
+ */
+#define MOUNT_HASH_SIZE 256
+
+typedef struct _mount_entry_s
+{
+   struct _mount_entry_s *next;
+   dev_t dev;
+   int fs_root;    /* non-zero if the root of the filesystem is mounted here */
+   char *dir;
+   char *src;      /* mount source, for entries of the anonymous list only */
+} MOUNT_ENTRY;
+
+typedef struct _mount_table_s
+{
+   int loaded;
+   MOUNT_ENTRY *bucket[MOUNT_HASH_SIZE];
+   MOUNT_ENTRY *anon;       /* anonymous device mounts, in mount order */
+   MOUNT_ENTRY **anon_tail;
+} MOUNT_TABLE;
+
+/* Table shared by all lookups between LoadMountTable() and FreeMountTable() */
+static MOUNT_TABLE *shared_mounts = NULL;
+
+#define MOUNT_HASH(d) ((unsigned int)(d) % MOUNT_HASH_SIZE)
+
+/*
+ *  Decode the octal escapes (\040, \011, \012, \134) used for special
+ *  characters in mountinfo fields.
+ */
+static void UnescapeMountField(char *str)
+{
+   char *d = str;
+
+   while (*str) {
+      if (str[0] == '\\' && str[1] >= '0' && str[1] <= '3' && str[2] >= '0' && str[2] <= '7'
+            && str[3] >= '0' && str[3] <= '7') {
+         *d++ = (char)(((str[1] - '0') << 6) | ((str[2] - '0') << 3) | (str[3] - '0'));
+         str += 4;
+      } else *d++ = *str++;
+   }
+   *d = 0;
+}
+
+/*
+ *  Add the filesystem on device 'dev' mounted at 'dir' to table 'mt'. The
+ *  first mountpoint of the root of the filesystem is kept, or failing that
+ *  the first bind mount of a subdirectory of it.
+ *  On success returns zero, else returns -1.
+ */
+static int AddMountEntry(MOUNT_TABLE *mt, dev_t dev, int fs_root, const char *dir)
+{
+   MOUNT_ENTRY *ent;
+   char *tmp;
+   unsigned int h = MOUNT_HASH(dev);
+
+   for (ent = mt->bucket[h]; ent; ent = ent->next) {
+      if (ent->dev != dev) continue;
+      if (ent->fs_root || !fs_root) return 0;
+      tmp = strdup(dir);
+      if (!tmp) return -1;
+      free(ent->dir);
+      ent->dir = tmp;
+      ent->fs_root = fs_root;
+      return 0;
+   }
+   ent = (MOUNT_ENTRY*)malloc(sizeof(MOUNT_ENTRY));
+   if (!ent) return -1;
+   ent->dir = strdup(dir);
+   if (!ent->dir) {
+      free(ent);
+      return -1;
+   }
+   ent->dev = dev;
+   ent->fs_root = fs_root;
+   ent->src = NULL;
+   ent->next = mt->bucket[h];
+   mt->bucket[h] = ent;
+   return 0;
+}
+
+/*
+ *  Append the filesystem mounted from device name 'src' at 'dir' to the
+ *  anonymous device list of table 'mt'.
+ *  On success returns zero, else returns -1.
+ */
+static int AddAnonMountEntry(MOUNT_TABLE *mt, const char *src, const char *dir)
+{
+   MOUNT_ENTRY *ent;
+
+   ent = (MOUNT_ENTRY*)calloc(1, sizeof(MOUNT_ENTRY));
+   if (!ent) return -1;
+   ent->src = strdup(src);
+   ent->dir = strdup(dir);
+   if (!ent->src || !ent->dir) {
+      free(ent->src);
+      free(ent->dir);
+      free(ent);
+      return -1;
+   }
+   *mt->anon_tail = ent;
+   mt->anon_tail = &ent->next;
+   return 0;
+}
+
+/*
+ *  Free mount table 'mt'
+ */
+static void DeleteMountTable(MOUNT_TABLE *mt)
+{
+   int n;
+   MOUNT_ENTRY *ent;
+
+   if (!mt) return;
+   for (n = 0; n < MOUNT_HASH_SIZE; n++) {
+      while (mt->bucket[n]) {
+         ent = mt->bucket[n];
+         mt->bucket[n] = ent->next;
+         free(ent->dir);
+         free(ent);
+      }
+   }
+   while (mt->anon) {
+      ent = mt->anon;
+      mt->anon = ent->next;
+      free(ent->src);
+      free(ent->dir);
+      free(ent);
+   }
+   free(mt);
+}
+
+/*
+ *  Build a mount table from /proc/self/mountinfo. If mountinfo cannot be
+ *  read, returns an empty table whose 'loaded' flag is zero.
+ *  Returns NULL if out of memory.
+ */
+static MOUNT_TABLE* NewMountTable(void)
+{
+   MOUNT_TABLE *mt;
+#ifdef MOUNTINFO_PATH
+   FILE *fs;
+   char *line = NULL, *root, *dir, *src;
+   size_t line_sz = 0;
+   unsigned int maj, min;
+   int rpos, rend, dpos, dend, spos, send, rc;
+#endif
+
+   mt = (MOUNT_TABLE*)calloc(1, sizeof(MOUNT_TABLE));
+   if (!mt) return NULL;
+   mt->anon_tail = &mt->anon;
+#ifdef MOUNTINFO_PATH
+   fs = fopen(MOUNTINFO_PATH, "r");
+   if (!fs) return mt;
+   /* Fields are: mount-id parent-id major:minor root mountpoint ...
+    * followed by a " - " separator, filesystem type, and mount source */
+   while (getline(&line, &line_sz, fs) > 0) {
+      rpos = rend = dpos = dend = 0;
+      if (sscanf(line, "%*d %*d %u:%u %n%*s%n %n%*s%n", &maj, &min, &rpos, &rend,
+            &dpos, &dend) < 2 || !dend) continue;
+      root = line + rpos;
+      root[rend - rpos] = 0;
+      dir = line + dpos;
+      dir[dend - dpos] = 0;
+      UnescapeMountField(dir);
+      rc = AddMountEntry(mt, makedev(maj, min), strcmp(root, "/") == 0, dir);
+      if (rc == 0 && maj == 0 && (src = strstr(line + dend + 1, " - ")) != NULL) {
+         spos = send = 0;
+         sscanf(src + 3, "%*s %n%*s%n", &spos, &send);
+         if (send) {
+            src += 3 + spos;
+            src[send - spos] = 0;
+            UnescapeMountField(src);
+            if (src[0] == '/') rc = AddAnonMountEntry(mt, src, dir);
+         }
+      }
+      if (rc) {
+         free(line);
+         fclose(fs);
+         DeleteMountTable(mt);
+         return NULL;
+      }
+   }
+   free(line);
+   fclose(fs);
+   mt->loaded = 1;
+#endif
+   return mt;
+}
+
+/*
+ *  Find mountpoint of device 'dev' in mount table 'mt'.
+ *  Returns NULL if not mounted.
+ */
+static const char* FindMountEntry(const MOUNT_TABLE *mt, dev_t dev)
+{
+   const MOUNT_ENTRY *ent;
+
+   for (ent = mt->bucket[MOUNT_HASH(dev)]; ent; ent = ent->next) {
+      if (ent->dev == dev) return ent->dir;
+   }
+   return NULL;
+}
+
+/*
+ *  Find mountpoint of the filesystem mounted with an anonymous device number
+ *  from device name 'devname' in mount table 'mt'.
+ *  Returns NULL if not mounted.
+ */
+static const char* FindAnonMountEntry(const MOUNT_TABLE *mt, const char *devname)
+{
+   const MOUNT_ENTRY *ent;
+
+   for (ent = mt->anon; ent; ent = ent->next) {
+      if (strcasecmp(devname, ent->src) == 0) return ent->dir;
+   }
+   return NULL;
+}
+
+/*
+ *  Loads the system mount table, so that following calls to
+ *  GetMountpointFromUUID() look up mountpoints in memory rather than
+ *  reading the mount table for each call. Must not be called while
+ *  another thread may be calling GetMountpointFromUUID().
+ *  On success returns zero, else returns -1.
+ */
+int LoadMountTable(void)
+{
+   FreeMountTable();
+   shared_mounts = NewMountTable();
+   return shared_mounts ? 0 : -1;
+}
+
+/*
+ *  Frees the mount table loaded by LoadMountTable()
+ */
+void FreeMountTable(void)
+{
+   DeleteMountTable(shared_mounts);
+   shared_mounts = NULL;
+}
+
+/*
+ *  Computes a signature of the system mount table in 'sig', as a 64-bit
+ *  FNV-1a hash of /proc/self/mountinfo. Since mountinfo includes a unique
+ *  ID for each mount, the signature changes whenever any filesystem is
+ *  mounted, unmounted, or remounted.
+ *  On success returns zero. Returns -1 if mountinfo is not available.
+ */
+int GetMountTableSignature(unsigned long long *sig)
+{
+#ifdef MOUNTINFO_PATH
+   int fd;
+   ssize_t n, i;
+   unsigned long long h = 14695981039346656037ULL;
+   unsigned char buf[8192];
+
+   fd = open(MOUNTINFO_PATH, O_RDONLY);
+   if (fd < 0) return -1;
+   while ((n = read(fd, buf, sizeof(buf))) != 0) {
+      if (n < 0) {
+         if (errno == EINTR) continue;
+         close(fd);
+         return -1;
+      }
+      for (i = 0; i < n; i++) {
+         h ^= buf[i];
+         h *= 1099511628211ULL;
+      }
+   }
+   close(fd);
+   *sig = h;
+   return 0;
+#else
+   return -1;
+#endif
+}
+
+/*
+ *  Lookup mount point of the filesystem on the block device with device
+ *  number 'devno' and place in 'mountp'. Since the device node is not
+ *  needed, this also works after the device has been removed.
+ *  On success, returns zero. On error, returns negative value :
+ *      -1    system error, or mount table not available
+ *      -2    parameter error
+ *      -4    device not mounted
+ *      -5    mountp buffer too small
+ */
+int GetDevnoMountpoint(char *mountp, size_t mountp_sz, unsigned long long devno)
+{
+   MOUNT_TABLE *mt = shared_mounts, *local_mt = NULL;
+   const char *dir;
+   size_t n;
+   int rc = -4;
+
+   if (!mountp || !mountp_sz) return -2;
+   mountp[0] = '\0';
+   if (!mt) {
+      mt = local_mt = NewMountTable();
+      if (!mt) return -1;
+   }
+   if (!mt->loaded) {
+      rc = -1;
+   } else {
+      dir = FindMountEntry(mt, (dev_t)devno);
+      if (dir) {
+         n = strlen(dir);
+         if (n >= mountp_sz) {
+            rc = -5;
+         } else {
+            memcpy(mountp, dir, n + 1);
+            rc = 0;
+         }
+      }
+   }
+   DeleteMountTable(local_mt);
+   return rc;
+}
+
+/*
+ *  Lookup mount point for the block device node 'devname' (or a symlink to
+ *  it) and place in 'mountp'. The device is matched by device number, so
+ *  that it is found whatever name or alias it was mounted as. Uses the table
+ *  loaded by LoadMountTable() if any, else reads the mount table once.
+ *  Filesystems mounted with an anonymous device number, as is the case for
+ *  btrfs, are matched by device name in the same table. The mount table is
+ *  only scanned by device name when mountinfo is not available.
+ *  On success, returns zero. On error, returns negative value :
+ *      -1    system error
+ *      -2    parameter error
+ *      -3    devname not found
+ *      -4    devname not mounted
+ *      -5    mountp buffer too small
+ */
+static int GetBlockDevMountpoint(char *mountp, size_t mountp_sz, const char *devname)
+{
+   struct stat st;
+   MOUNT_TABLE *mt = shared_mounts, *local_mt = NULL;
+   const char *dir = NULL;
+   char realname[PATH_MAX];
+   size_t n;
+
+   mountp[0] = '\0';
+   if (!mountp_sz || !devname || !strlen(devname)) return -2;
+   if (stat(devname, &st) != 0) return errno == ENOENT ? -3 : -1;
+   if (!mt) {
+      mt = local_mt = NewMountTable();
+      if (!mt) return -1;
+   }
+   if (mt->loaded) {
+      if (S_ISBLK(st.st_mode)) dir = FindMountEntry(mt, st.st_rdev);
+      /* Not found by device number, so try the kernel device name of
+       * filesystems mounted with an anonymous device number */
+      if (!dir && mt->anon) {
+         if (!realpath(devname, realname)) {
+            DeleteMountTable(local_mt);
+            return -1;
+         }
+         dir = FindAnonMountEntry(mt, realname);
+      }
+      if (!dir) {
+         DeleteMountTable(local_mt);
+         return -4;
+      }
+   }
+   if (dir) {
+      n = strlen(dir);
+      if (n >= mountp_sz) {
+         DeleteMountTable(local_mt);
+         return -5;
+      }
+      memcpy(mountp, dir, n + 1);
+      DeleteMountTable(local_mt);
+      return 0;
+   }
+   DeleteMountTable(local_mt);
+   /* Without mountinfo, scan the mount table for the kernel device name */
+   if (!realpath(devname, realname)) return -1;
+   return GetDevMountpoint(mountp, mountp_sz, realname);
+}
+
+#ifdef DISK_BY_UUID_DIR
+/*
+ *  Finds the symlink udev maintains in /dev/disk/by-uuid for the filesystem
+ *  with UUID given by 'uuid_str', trying the UUID as given and then in lower
+ *  and upper case. The path of the link is returned in 'path' and the link
+ *  target's stat info in 'st'.
+ *  On success, returns zero. On error, returns negative value :
+ *      -1    system error
+ *      -3    filesystem with given uuid not found
+ *      -6    /dev/disk/by-uuid not maintained on this system
+ */
+static int FindUUIDLink(char *path, size_t path_sz, const char *uuid_str, struct stat *st)
+{
+   int pass;
+   size_t n, len;
+
+   if (access(DISK_BY_UUID_DIR, F_OK) != 0) return -6;
+   len = strlen(DISK_BY_UUID_DIR);
+   if (len + strlen(uuid_str) >= path_sz) return -3;
+   memcpy(path, DISK_BY_UUID_DIR, len);
+   for (pass = 0; pass < 3; pass++) {
+      for (n = 0; uuid_str[n]; n++) {
+         if (pass == 1) path[len + n] = (char)tolower((unsigned char)uuid_str[n]);
+         else if (pass == 2) path[len + n] = (char)toupper((unsigned char)uuid_str[n]);
+         else path[len + n] = uuid_str[n];
+      }
+      path[len + n] = 0;
+      if (stat(path, st) == 0) return 0;
+      if (errno != ENOENT) return -1;
+   }
+   return -3;
+}
+
+/*
+ *  Locates the filesystem with UUID given by 'uuid_str' via its symlink in
+ *  /dev/disk/by-uuid.
+ *  On success, returns zero. On error, returns negative value :
+ *      -1    system error
+ *      -3    filesystem with given uuid not found
+ *      -4    filesystem not mounted
+ *      -5    mountp buffer too small
+ *      -6    /dev/disk/by-uuid not maintained on this system
+ */
+static int GetUUIDLinkMountpoint(char *mountp, size_t mountp_sz, const char *uuid_str)
+{
+   int rc;
+   struct stat st;
+   char path[4096];
+
+   rc = FindUUIDLink(path, sizeof(path), uuid_str, &st);
+   if (rc == 0) rc = GetBlockDevMountpoint(mountp, mountp_sz, path);
+   if (rc == 0) {
+      LogHandler_write(LOG_DEBUG, "filesystem %s (device %s) mounted at %s", uuid_str, path, mountp);
+   } else if (rc == -4) {
+      LogHandler_write(LOG_DEBUG, "filesystem %s (device %s) not mounted", uuid_str, path);
+   } else if (rc == -3) {
+      LogHandler_write(LOG_DEBUG, "filesystem %s not found", uuid_str);
+   }
+   return rc;
+}
+#endif
+
+/*
+ *  Gets the device number of the block device holding the filesystem with
+ *  UUID given by 'uuid_str' in 'dev', without querying udev or libblkid.
+ *  On success, returns zero. On error, returns negative value :
+ *      -1    device cannot be determined this way on this system
+ *      -3    filesystem with given uuid not found
+ */
+int GetUUIDDevice(const char *uuid_str, unsigned long long *dev)
+{
+#ifdef DISK_BY_UUID_DIR
+   int rc;
+   struct stat st;
+   char path[4096];
+
+   rc = FindUUIDLink(path, sizeof(path), uuid_str, &st);
+   if (rc == -3) return -3;
+   if (rc || !S_ISBLK(st.st_mode)) return -1;
+   *dev = (unsigned long long)st.st_rdev;
+   return 0;
+#else
+   return -1;
+#endif
+}
+
 #ifdef HAVE_LIBUDEV_H
 #include <libudev.h>
 
 /*
- *  Locates disk partition containing file system with UUID given by 'uuid_str'.
- *  If found, and the filesystem is mounted, returns the first mountpoint found in
- *  string 'mountp'. On success, returns zero. On error, returns negative value :
+ *  Locates disk partition containing file system with UUID given by 'uuid_str'
+ *  using libudev. If found, and the filesystem is mounted, returns the first
+ *  mountpoint found in string 'mountp'. On success, returns zero. On error,
+ *  returns negative value :
  *      -1    system error
- *      -2    parameter error
  *      -3    filesystem with given uuid not found
  *      -4    filesystem not mounted
  *      -5    mountp buffer too small
  */
-int GetMountpointFromUUID(char *mountp, size_t mountp_sz, const char *uuid_str)
+static int GetUUIDDevMountpoint(char *mountp, size_t mountp_sz, const char *uuid_str)
 {
    struct udev *udev;
    struct udev_enumerate *enumerate;
    struct udev_list_entry *devices, *dev_list_entry;
    struct udev_device *dev;
    int rc = -3;
-   const char *dev_name, *dev_links, *path, *uuid;
-   size_t n, pos, dev_links_len;
-   char devlink[4096];
-
-   if (!mountp || !mountp_sz) return -2;
-   if (!uuid_str || !strlen(uuid_str)) return -2;
+   const char *dev_name, *path, *uuid;
 
    /* Enumerate devices with a filesystem UUID property */
    udev = udev_new();
@@ -284,50 +829,25 @@ int GetMountpointFromUUID(char *mountp, size_t mountp_sz, const char *uuid_str)
             /* Failed to get kernel device node */
             LogHandler_write(LOG_DEBUG, "filesystem %s has no udev assigned device node",
                         uuid_str);
+            udev_device_unref(dev);
             break;
          }
          LogHandler_write(LOG_DEBUG, "filesystem %s has udev assigned device %s",
                            uuid_str, dev_name);
-         /* Lookup mountpoint of the kernel device node */
-         rc = GetDevMountpoint(mountp, mountp_sz, dev_name);
+         /* Lookup mountpoint of the kernel device node. Since it is matched
+          * by device number, mounts using any of the device's aliases
+          * are also found. */
+         rc = GetBlockDevMountpoint(mountp, mountp_sz, dev_name);
+         if (rc == -3) rc = -1;
          if (rc == 0) {
-            /* Found mountpoint */
             LogHandler_write(LOG_DEBUG, "filesystem %s (device %s) mounted at %s", uuid_str, dev_name, mountp);
-            break;
-         }
-         if (rc == -4) {
-            /* If not mounted as the DEVNAME, also check if mounted as
-             * a device alias name from DEVLINKS */
-            dev_links = udev_device_get_property_value(dev, "DEVLINKS");
-            if (dev_links == NULL) {
-               /* No device alias links found */
-               break;
-            }
-            LogHandler_write(LOG_DEBUG, "device %s not found in system mounts, searching all udev device aliases",
-                              dev_name);
-            /* For each device alias, look for a mountpoint */
-            dev_links_len = strlen(dev_links);
-            pos = 0;
-            while (rc == -4 && pos < dev_links_len) {
-               for (n = pos; n < dev_links_len && !isblank(dev_links[n]); n++) ;
-               n -= pos;
-               memmove(devlink, dev_links + pos, n);
-               devlink[n] = 0;
-               rc = GetDevMountpoint(mountp, mountp_sz, devlink);
-               if (rc == 0) {
-                  /* Device alias is mounted */
-                  LogHandler_write(LOG_DEBUG, "filesystem %s (device %s) mounted at %s", uuid_str, devlink,
-                                 mountp);
-                  break;
-               }
-               rc = -4; /* Ignore other errors from attempt to get alias's mountpoint */
-               pos += n;
-               while (pos < dev_links_len && isblank(dev_links[pos])) ++pos;
-            }
+         } else if (rc == -4) {
+            LogHandler_write(LOG_DEBUG, "filesystem %s (device %s) not mounted", uuid_str, dev_name);
          }
-         if (rc == -4) LogHandler_write(LOG_DEBUG, "filesystem %s (device %s) not mounted", uuid_str, dev_name);
+         udev_device_unref(dev);
          break;
       }
+      udev_device_unref(dev);
    }
    udev_enumerate_unref(enumerate);
    udev_unref(udev);
@@ -340,29 +860,28 @@ int GetMountpointFromUUID(char *mountp, size_t mountp_sz, const char *uuid_str)
 #include <blkid/blkid.h>
 
 /*
- *  Locates disk partition containing file system with UUID given by 'uuid_str'.
- *  If found, and the filesystem is mounted, returns the first mountpoint found in
- *  string 'mountp'. On success, returns zero. On error, returns negative value :
+ *  Locates disk partition containing file system with UUID given by 'uuid_str'
+ *  using libblkid. If found, and the filesystem is mounted, returns the first
+ *  mountpoint found in string 'mountp'. On success, returns zero. On error,
+ *  returns negative value :
  *      -1    system error
- *      -2    parameter error
  *      -3    volume with given uuid not found
  *      -4    volume not mounted
  *      -5    mountp buffer too small
  */
-int GetMountpointFromUUID(char *mountp, size_t mountp_sz, const char *uuid_str)
+static int GetUUIDDevMountpoint(char *mountp, size_t mountp_sz, const char *uuid_str)
 {
    int rc;
    char *dev_name;
 
-   if (!mountp || !mountp_sz) return -2;
-   if (!uuid_str || !strlen(uuid_str)) return -2;
-
    /* Get device with requested UUID from libblkid */
+   LOOKUP_LOCK();
 #ifdef HAVE_BLKID_EVALUATE_TAG
    dev_name = blkid_evaluate_tag("UUID", uuid_str, NULL);
 #else
    dev_name = blkid_get_devname(NULL, "UUID", uuid_str);
 #endif
+   LOOKUP_UNLOCK();
    if (!dev_name) {
       LogHandler_write(LOG_DEBUG, "filesystem %s not found", uuid_str);
       return -3;
@@ -370,7 +889,8 @@ int GetMountpointFromUUID(char *mountp, size_t mountp_sz, const char *uuid_str)
    LogHandler_write(LOG_DEBUG, "libblkid found filesystem %s at device %s", uuid_str, dev_name);
 
    /* find mount point for device */
-   rc = GetDevMountpoint(mountp, mountp_sz, dev_name);
+   rc = GetBlockDevMountpoint(mountp, mountp_sz, dev_name);
+   if (rc == -3) rc = -1;
    free(dev_name);
    return rc;
 }
@@ -378,9 +898,10 @@ int GetMountpointFromUUID(char *mountp, size_t mountp_sz, const char *uuid_str)
 #else
 
 /*
- *  If built without libudev or libblkid support, then UUID lookup is a system error
+ *  If built without libudev or libblkid support, then UUID lookup is a system
+ *  error unless /dev/disk/by-uuid is available
  */
-int GetMountpointFromUUID(char *mountp, size_t mountp_sz, const char *uuid_str)
+static int GetUUIDDevMountpoint(char *mountp, size_t mountp_sz, const char *uuid_str)
 {
    LogHandler_write(LOG_DEBUG, "GetMountpointFromUUID: UUID lookups not supported by this build");
    return -1;
@@ -389,4 +910,32 @@ int GetMountpointFromUUID(char *mountp, size_t mountp_sz, const char *uuid_str)
 #endif  /* HAVE_BLKID_BLKID_H */
 #endif  /* HAVE_LIBUDEV_H */
 
+/*
+ *  Locates disk partition containing file system with UUID given by 'uuid_str'.
+ *  If found, and the filesystem is mounted, returns the first mountpoint found in
+ *  string 'mountp'. The /dev/disk/by-uuid symlinks are used when available,
+ *  else the device is found using libudev or libblkid.
+ *  On success, returns zero. On error, returns negative value :
+ *      -1    system error
+ *      -2    parameter error
+ *      -3    filesystem with given uuid not found
+ *      -4    filesystem not mounted
+ *      -5    mountp buffer too small
+ */
+int GetMountpointFromUUID(char *mountp, size_t mountp_sz, const char *uuid_str)
+{
+#ifdef DISK_BY_UUID_DIR
+   int rc;
+#endif
+
+   if (!mountp || !mountp_sz) return -2;
+   if (!uuid_str || !strlen(uuid_str)) return -2;
+   mountp[0] = '\0';
+#ifdef DISK_BY_UUID_DIR
+   rc = GetUUIDLinkMountpoint(mountp, mountp_sz, uuid_str);
+   if (rc != -6) return rc;
+#endif
+   return GetUUIDDevMountpoint(mountp, mountp_sz, uuid_str);
+}
+
 #endif  /* HAVE_WINDOWS_H */
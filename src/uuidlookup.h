@@ -29,6 +29,11 @@ extern "C" {
 #endif
 
 int GetMountpointFromUUID(char *mountp, size_t mountp_sz, const char *uuid_str);
+int LoadMountTable(void);
+void FreeMountTable(void);
+int GetMountTableSignature(unsigned long long *sig);
+int GetUUIDDevice(const char *uuid_str, unsigned long long *dev);
+int GetDevnoMountpoint(char *mountp, size_t mountp_sz, unsigned long long devno);
 
 #ifdef __cplusplus
 }
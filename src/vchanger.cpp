@@ -52,7 +52,14 @@
 #ifdef HAVE_SIGNAL_H
 #include <signal.h>
 #endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
 
+#include "compat/gettimeofday.h"
 #include "util.h"
 #include "compat_defs.h"
 #include "loghandler.h"
@@ -60,6 +67,8 @@
 #include "diskchanger.h"
 #include "mymutex.h"
 #include "bconsole.h"
+#include "vchangerd.h"
+#include "hotplug.h"
 
 DiskChanger changer;
 
@@ -87,6 +96,9 @@ typedef struct _cmdparams_s
    bool print_version;
    bool print_help;
    bool force;
+   bool daemon;
+   bool rescan;
+   bool hotplug;
    int command;
    int slot;
    int drive;
@@ -98,6 +110,9 @@ typedef struct _cmdparams_s
    tString runas_group;
    tString config_file;
    tString archive_device;
+   tString all_configs_dir;
+   tStringArray uuids;
+   HOTPLUG_OPTS hotplug_opts;
 } CMDPARAMS;
 CMDPARAMS cmdl;
 
@@ -131,6 +146,20 @@ static void print_help(void)
       "    API extension to issue an Update Slots command in bconsole if a change\n"
       "    in the virtual slot to volume file mapping is detected. The --force flag\n"
       "    forces the bconsole call regardless detected changes.\n"
+      "  vchanger [options] --daemon config_file\n"
+      "    Run in the foreground as a resident changer daemon (vchangerd mode) that\n"
+      "    keeps the changer state in memory. While it is running, the LIST, SLOTS,\n"
+      "    LOAD, UNLOAD, and LOADED commands are forwarded to the daemon.\n"
+      "  vchanger [options] --hotplug [config_file ...]\n"
+      "    Run in the foreground as root, listening for block device hotplug\n"
+      "    events. When a magazine specified by UUID in any of the given config\n"
+      "    files, or in all config files in %s by default, is\n"
+      "    attached or detached, it is mounted or unmounted and its changers are\n"
+      "    refreshed.\n"
+      "  vchanger [options] --all-configs=dir REFRESH [uuid ...]\n"
+      "    Perform the REFRESH command in a single process for all changers\n"
+      "    defined by the config files in 'dir', or only for those changers\n"
+      "    having a magazine whose filesystem UUID is given.\n"
       "  vchanger --version\n"
       "    print version info\n"
       "  vchanger --help\n"
@@ -138,6 +167,8 @@ static void print_help(void)
       "\nGeneral options:\n"
       "    -u, --user=uid       user to run as (when invoked by root)\n"
       "    -g, --group=gid      group to run as (when invoked by root)\n"
+      "    --rescan             read all magazine directories, ignoring the saved\n"
+      "                         magazine volume indexes\n"
       "\nCREATEVOLS command options:\n"
       "    -l, --label=string   string to use as a prefix for determining the\n"
       "                         barcode label of the volume files created. Labels\n"
@@ -148,7 +179,13 @@ static void print_help(void)
       "                         be placed into when labeling newly created volumes.\n"
       "\nREFRESH command options:\n"
       "    --force              Force a bconsole update slots command to be invoked\n"
-      "\nReport bugs to %s.\n", PACKAGE_BUGREPORT);
+      "\nHotplug options:\n"
+      "    --mount-dir=dir      directory under which magazines not listed in\n"
+      "                         /etc/fstab are mounted (default %s)\n"
+      "    --mount-options=opts mount options for magazines not listed in /etc/fstab\n"
+      "    --uevent-file=file   read uevents from 'file', or stdin if '-', rather\n"
+      "                         than listening for them\n"
+      "\nReport bugs to %s.\n", DEFAULT_CONFIG_DIR, DEFAULT_HOTPLUG_MOUNT_DIR, PACKAGE_BUGREPORT);
 }
 
 /*-------------------------------------------------
@@ -158,6 +195,13 @@ static void print_help(void)
 #define LONGONLYOPT_HELP      1
 #define LONGONLYOPT_POOL      2
 #define LONGONLYOPT_FORCE     3
+#define LONGONLYOPT_DAEMON    4
+#define LONGONLYOPT_RESCAN    5
+#define LONGONLYOPT_HOTPLUG   6
+#define LONGONLYOPT_MOUNTDIR  7
+#define LONGONLYOPT_MOUNTOPTS 8
+#define LONGONLYOPT_UEVENTS   9
+#define LONGONLYOPT_ALLCONFIGS 10
 
 static int parse_cmdline(int argc, char *argv[])
 {
@@ -170,11 +214,21 @@ static int parse_cmdline(int argc, char *argv[])
          { "label", 1, 0, 'l' },
          { "pool", 1, 0, LONGONLYOPT_POOL },
          { "force", 0, 0, LONGONLYOPT_FORCE },
+         { "daemon", 0, 0, LONGONLYOPT_DAEMON },
+         { "rescan", 0, 0, LONGONLYOPT_RESCAN },
+         { "hotplug", 0, 0, LONGONLYOPT_HOTPLUG },
+         { "mount-dir", 1, 0, LONGONLYOPT_MOUNTDIR },
+         { "mount-options", 1, 0, LONGONLYOPT_MOUNTOPTS },
+         { "uevent-file", 1, 0, LONGONLYOPT_UEVENTS },
+         { "all-configs", 1, 0, LONGONLYOPT_ALLCONFIGS },
          { 0, 0, 0, 0 } };
 
    cmdl.print_version = false;
    cmdl.print_help = false;
    cmdl.force = false;
+   cmdl.daemon = false;
+   cmdl.rescan = false;
+   cmdl.hotplug = false;
    cmdl.command = 0;
    cmdl.slot = 0;
    cmdl.drive = 0;
@@ -186,6 +240,12 @@ static int parse_cmdline(int argc, char *argv[])
    cmdl.runas_group.clear();
    cmdl.config_file.clear();
    cmdl.archive_device.clear();
+   cmdl.all_configs_dir.clear();
+   cmdl.uuids.clear();
+   cmdl.hotplug_opts.config_files.clear();
+   cmdl.hotplug_opts.mount_dir = DEFAULT_HOTPLUG_MOUNT_DIR;
+   cmdl.hotplug_opts.mount_options.clear();
+   cmdl.hotplug_opts.uevent_file.clear();
    /* process the command line */
    for (;;) {
       c = getopt_long(argc ,argv, "u:g:l:", options, NULL);
@@ -214,6 +274,27 @@ static int parse_cmdline(int argc, char *argv[])
       case LONGONLYOPT_FORCE:
          cmdl.force = true;
          break;
+      case LONGONLYOPT_DAEMON:
+         cmdl.daemon = true;
+         break;
+      case LONGONLYOPT_RESCAN:
+         cmdl.rescan = true;
+         break;
+      case LONGONLYOPT_HOTPLUG:
+         cmdl.hotplug = true;
+         break;
+      case LONGONLYOPT_MOUNTDIR:
+         cmdl.hotplug_opts.mount_dir = optarg;
+         break;
+      case LONGONLYOPT_MOUNTOPTS:
+         cmdl.hotplug_opts.mount_options = optarg;
+         break;
+      case LONGONLYOPT_UEVENTS:
+         cmdl.hotplug_opts.uevent_file = optarg;
+         break;
+      case LONGONLYOPT_ALLCONFIGS:
+         cmdl.all_configs_dir = optarg;
+         break;
       default:
          fprintf(stderr, "unknown option %s\n", optarg);
          return -1;
@@ -222,12 +303,55 @@ static int parse_cmdline(int argc, char *argv[])
 
    /* process positional params */
    ndx = optind;
+   /* Hotplug mode takes only a list of config files */
+   if (cmdl.hotplug) {
+      if (cmdl.daemon || !cmdl.label_prefix.empty() || !cmdl.pool.empty() || cmdl.force
+            || !cmdl.all_configs_dir.empty()) {
+         fprintf(stderr, "flags --daemon, -l, --pool, --force, and --all-configs not valid with --hotplug\n");
+         return -1;
+      }
+      for (; ndx < argc; ndx++) cmdl.hotplug_opts.config_files.push_back(argv[ndx]);
+      return 0;
+   }
+   /* All-configs mode takes the REFRESH command and an optional list of UUIDs */
+   if (!cmdl.all_configs_dir.empty()) {
+      if (cmdl.daemon || !cmdl.label_prefix.empty() || !cmdl.pool.empty()) {
+         fprintf(stderr, "flags --daemon, -l, and --pool not valid with --all-configs\n");
+         return -1;
+      }
+      if (ndx >= argc) {
+         fprintf(stderr, "missing parameter 1 (command)\n");
+         return -1;
+      }
+      tmp = argv[ndx];
+      tToLower(tStrip(tmp));
+      if (tmp != autochanger_command[CMD_REFRESH]) {
+         fprintf(stderr, "only the REFRESH command is valid with --all-configs\n");
+         return -1;
+      }
+      cmdl.command = CMD_REFRESH;
+      for (++ndx; ndx < argc; ndx++) {
+         tmp = argv[ndx];
+         tToLower(tStrip(tmp));
+         if (tmp.find("uuid:") == 0) tmp.erase(0, 5);
+         if (!tmp.empty()) cmdl.uuids.push_back(tmp);
+      }
+      return 0;
+   }
    /* First parameter is the vchanger config file path */
    if (ndx >= argc) {
       fprintf(stderr, "missing parameter 1 (config_file)\n");
       return -1;
    }
    cmdl.config_file = argv[ndx];
+   /* Daemon mode takes no command */
+   if (cmdl.daemon) {
+      if (!cmdl.label_prefix.empty() || !cmdl.pool.empty() || cmdl.force) {
+         fprintf(stderr, "flags -l, --pool, and --force not valid with --daemon\n");
+         return -1;
+      }
+      return 0;
+   }
    /* Second parameter is the command */
    ++ndx;
    if (ndx >= argc) {
@@ -387,16 +511,16 @@ static int parse_cmdline(int argc, char *argv[])
  * magazines, each of which may or may not be attached. Each volume file on
  * each magazine is mapped to a virtual slot. The barcode is the volume filename.
  *------------------------------------------------*/
-static int do_list_cmd()
+static int do_list_cmd(FILE *out)
 {
    int slot, num_slots = changer.NumSlots();
 
    /* Print all slot numbers, adding volume labels for non-empty slots */
    for (slot = 1; slot <= num_slots; slot++) {
       if (changer.SlotEmpty(slot)) {
-         fprintf(stdout, "%d:\n", slot);
+         fprintf(out, "%d:\n", slot);
       } else {
-         fprintf(stdout, "%d:%s\n", slot, changer.GetVolumeLabel(slot));
+         fprintf(out, "%d:%s\n", slot, changer.GetVolumeLabel(slot));
       }
    }
    vlog.Info("  SUCCESS sent list to stdout");
@@ -408,9 +532,9 @@ static int do_list_cmd()
  *   SLOTS Command
  * Prints the number of virtual slots the changer has
  *------------------------------------------------*/
-static int do_slots_cmd()
+static int do_slots_cmd(FILE *out)
 {
-   fprintf(stdout, "%d\n", changer.NumSlots());
+   fprintf(out, "%d\n", changer.NumSlots());
    vlog.Info("  SUCCESS reporting %d slots", changer.NumSlots());
    return 0;
 }
@@ -420,10 +544,10 @@ static int do_slots_cmd()
  *   LOAD Command
  * Loads the volume file mapped to a virtual slot into a virtual drive
  *------------------------------------------------*/
-static int do_load_cmd()
+static int do_load_cmd(FILE *err)
 {
    if (changer.LoadDrive(cmdl.drive, cmdl.slot)) {
-      fprintf(stderr, "%s\n", changer.GetErrorMsg());
+      fprintf(err, "%s\n", changer.GetErrorMsg());
       vlog.Error("  ERROR loading slot %d into drive %d", cmdl.slot, cmdl.drive);
       return 1;
    }
@@ -436,10 +560,10 @@ static int do_load_cmd()
  *   UNLOAD Command
  * Unloads the volume in a virtual drive
  *------------------------------------------------*/
-static int do_unload_cmd()
+static int do_unload_cmd(FILE *err)
 {
    if (changer.UnloadDrive(cmdl.drive)) {
-      fprintf(stderr, "%s\n", changer.GetErrorMsg());
+      fprintf(err, "%s\n", changer.GetErrorMsg());
       vlog.Error("  ERROR unloading slot %d from drive %d", cmdl.slot, cmdl.drive);
       return 1;
    }
@@ -453,11 +577,11 @@ static int do_unload_cmd()
  * Prints the virtual slot number of the volume file currently loaded
  * into a virtual drive, or zero if the drive is unloaded.
  *------------------------------------------------*/
-static int do_loaded_cmd()
+static int do_loaded_cmd(FILE *out)
 {
    int slot = changer.GetDriveSlot(cmdl.drive);
    if (slot < 0) slot = 0;
-   fprintf(stdout, "%d\n", slot);
+   fprintf(out, "%d\n", slot);
    vlog.Info("  SUCCESS reporting drive %d loaded from slot %d", cmdl.drive, slot);
    return 0;
 }
@@ -545,36 +669,283 @@ static int do_create_vols()
 
 
 
-/* -------------  Main  -------------------------*/
+/*-------------------------------------------------
+ *  Function to perform the command given on the command line,
+ *  writing normal output to 'out' and error messages to 'err'.
+ *------------------------------------------------*/
+static int perform_command(FILE *out, FILE *err)
+{
+   int error_code = 0;
 
-int main(int argc, char *argv[])
+   switch (cmdl.command) {
+   case CMD_LIST:
+      vlog.Debug("==== performing LIST command");
+      error_code = do_list_cmd(out);
+      break;
+   case CMD_SLOTS:
+      vlog.Debug("==== performing SLOTS command");
+      error_code = do_slots_cmd(out);
+      break;
+   case CMD_LOAD:
+      vlog.Debug("==== performing LOAD command");
+      error_code = do_load_cmd(err);
+      break;
+   case CMD_UNLOAD:
+      vlog.Debug("==== performing UNLOAD command");
+      error_code = do_unload_cmd(err);
+      break;
+   case CMD_LOADED:
+      vlog.Debug("==== performing LOADED command");
+      error_code = do_loaded_cmd(out);
+      break;
+   case CMD_LISTALL:
+      vlog.Debug("==== performing LISTALL command");
+      error_code = do_list_all();
+      break;
+   case CMD_LISTMAGS:
+      vlog.Debug("==== performing LISTMAGS command");
+      error_code = do_list_magazines();
+      break;
+   case CMD_CREATEVOLS:
+      vlog.Debug("==== performing CREATEVOLS command");
+      error_code = do_create_vols();
+      break;
+   case CMD_REFRESH:
+      vlog.Debug("==== performing REFRESH command");
+      error_code = 0;
+      break;
+   }
+   return error_code;
+}
+
+
+/*-------------------------------------------------
+ *  Function to determine if the command given on the command line only
+ *  reports the changer's state. Such commands may run concurrently.
+ *------------------------------------------------*/
+static bool command_is_read_only()
 {
-   int rc;
-   FILE *fs = NULL;
-   int32_t error_code;
-   void *command_mux = NULL, *bconsole_mux = NULL;
+   if (cmdl.rescan) return false;
+   switch (cmdl.command) {
+   case CMD_LIST:
+   case CMD_SLOTS:
+   case CMD_LOADED:
+   case CMD_LISTALL:
+   case CMD_LISTMAGS:
+      return true;
+   }
+   return false;
+}
 
-#ifdef HAVE_LOCALE_H
-   setlocale(LC_ALL, "");
+
+/*-------------------------------------------------
+ *  Function to lock the changer's command lock, waiting up to 'wait_sec'
+ *  seconds. If 'shared' is true, a shared lock is taken, which must only be held
+ *  while nothing is written to the changer's state, magazine volume
+ *  indexes, or drive symlinks. Otherwise an exclusive lock is taken. The
+ *  time spent waiting for the lock is logged.
+ *  On success returns zero, else returns -1 and sets errno.
+ *------------------------------------------------*/
+static int lock_command_mutex(void *command_mux, bool shared, time_t wait_sec = 300)
+{
+   int rc, err;
+   long ms;
+   struct timeval t0, t1;
+
+   gettimeofday(&t0, NULL);
+   if (shared) rc = myrwlock_rdlock(command_mux, wait_sec);
+   else rc = myrwlock_wrlock(command_mux, wait_sec);
+   err = errno;
+   gettimeofday(&t1, NULL);
+   ms = (long)((t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_usec - t0.tv_usec) / 1000);
+   if (rc) {
+      vlog.Error("ERROR! failed to lock %s command lock (%s) after %ld ms errno=%d",
+            conf.storage_name.c_str(), shared ? "shared" : "exclusive", ms, err);
+   } else if (ms >= 1000) {
+      vlog.Info("waited %ld ms for %s command lock (%s)", ms, conf.storage_name.c_str(),
+            shared ? "shared" : "exclusive");
+   } else {
+      vlog.Debug("waited %ld ms for %s command lock (%s)", ms, conf.storage_name.c_str(),
+            shared ? "shared" : "exclusive");
+   }
+   errno = err;
+   return rc;
+}
+
+
+/*-------------------------------------------------
+ *  Function to queue bconsole commands needed to inform Bacula of
+ *  changes, if any. The commands are issued by a background worker,
+ *  so this does not wait for bconsole. If 'start_worker' is false, the
+ *  caller starts the worker later. Returns non-zero on error.
+ *------------------------------------------------*/
+static int update_bacula(bool start_worker = true)
+{
+   void *bconsole_mux = NULL;
+
+   /* If not updating Bacula, then exit */
+#ifdef HAVE_WINDOWS_H
+   conf.bconsole = "";  /* Issuing bconsole commands not implemented on Windows */
 #endif
+   if (conf.bconsole.empty()) {
+      /* Bacula interaction via bconsole is disabled, so log warnings */
+      if (changer.NeedsUpdate())
+         vlog.Error("WARNING! 'update slots' needed in bconsole pid=%d", getpid());
+      if (changer.NeedsLabel())
+         vlog.Error("WARNING! 'label barcodes' needed in bconsole pid=%d", getpid());
+      return 0;
+   }
 
-   /* Log initially to stderr */
-   vlog.OpenLog(stderr, LOG_ERR);
-   /* parse the command line */
-   if ((error_code = parse_cmdline(argc, argv)) != 0) {
-      print_help();
+   /* Update Bacula via bconsole */
+
+   /* Check named mutex that is held while bconsole commands are being issued */
+   bconsole_mux = mymutex_create(conf.storage_name.c_str(), "bconsole");
+   if (bconsole_mux == 0) {
+      vlog.Error("ERROR! failed to create named mutex errno=%d", errno);
+      fprintf(stderr, "ERROR! failed to create named mutex errno=%d\n", errno);
       return 1;
    }
-   /* Check for --version flag */
-   if (cmdl.print_version) {
-      print_version();
+   if (mymutex_lock(bconsole_mux, 0)) {
+      /* If bconsole mutex is locked because the bconsole worker is issuing
+       * commands, then this instance is the result of bconsole itself invoking
+       * additional vchanger processes to handle the worker's bconsole
+       * command. So to prevent a loop, this instance must not queue
+       * further bconsole commands.  */
+      vlog.Info("invoked from bconsole - skipping further bconsole commands");
+      mymutex_destroy(bconsole_mux);
       return 0;
    }
-   /* Check for --help flag */
-   if (cmdl.print_help) {
-      print_help();
+   mymutex_unlock(bconsole_mux);
+   mymutex_destroy(bconsole_mux);
+
+   /* Queue the bconsole commands for the background worker, which issues
+    * them without holding the command mutex */
+   QueueBconsoleCommands(changer.NeedsUpdate() | cmdl.force,
+         cmdl.force ? tString() : changer.UpdateSlotList(), changer.NeedsLabel(),
+         changer.LabelSlotList(), changer.NumSlots(), start_worker);
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Function to lock the changer's command lock for the changer daemon,
+ *  which serves one client at a time and so only waits VCHANGERD_LOCK_WAIT
+ *  seconds. Before the daemon serves a request, its changer state is
+ *  re-initialized if another process has changed the saved changer state,
+ *  or has asked for it with a REINIT request, since the daemon last read
+ *  it. Re-initializing requires the lock exclusively, so a shared lock is
+ *  exchanged for an exclusive one first.
+ *  On success returns zero, else returns -1 and sets errno.
+ *------------------------------------------------*/
+static void *daemon_command_mux = NULL;
+static bool daemon_reinit_pending = false;
+
+static int lock_daemon_command_mutex(bool shared, FILE *err)
+{
+   if (lock_command_mutex(daemon_command_mux, shared, VCHANGERD_LOCK_WAIT)) return -1;
+   if (!daemon_reinit_pending && changer.StateCurrent()) return 0;
+   if (shared) {
+      myrwlock_unlock(daemon_command_mux);
+      if (lock_command_mutex(daemon_command_mux, false, VCHANGERD_LOCK_WAIT)) return -1;
+   }
+   vlog.Debug("==== performing vchangerd re-initialization");
+   if (changer.Initialize()) {
+      vlog.Error("%s", changer.GetErrorMsg());
+      fprintf(err, "%s\n", changer.GetErrorMsg());
+      myrwlock_unlock(daemon_command_mux);
+      errno = changer.GetError();
+      return -1;
+   }
+   daemon_reinit_pending = false;
+   vlog.Info("  SUCCESS re-initialized changer state");
+   update_bacula();
+   return 0;
+}
+
+
+/*-------------------------------------------------
+ *  Function called by the changer daemon to handle a request from
+ *  a vchanger client. Requests are of the form "command slot drive".
+ *  A REINIT request only marks the changer state for re-initialization
+ *  before the next request, so it never waits for the command lock. If
+ *  the lock cannot be obtained quickly, VCHANGERD_BUSY is returned so that
+ *  the client performs the command itself rather than hold up the daemon.
+ *------------------------------------------------*/
+static int do_daemon_request(const char *request, FILE *out, FILE *err)
+{
+   int rc, slot = 0, drive = 0;
+   char word[32];
+   tString cmd;
+
+   word[0] = 0;
+   if (sscanf(request, "%31s %d %d", word, &slot, &drive) < 1) {
+      fprintf(err, "invalid request\n");
+      return 1;
+   }
+   cmd = word;
+   tToLower(cmd);
+   if (cmd == VCHANGERD_REINIT) {
+      /* Re-read changer state after changes made by another process */
+      daemon_reinit_pending = true;
       return 0;
    }
+   /* Only the commands that do not modify magazines are served */
+   for (cmdl.command = 0; cmdl.command <= CMD_LOADED; cmdl.command++) {
+      if (cmd == autochanger_command[cmdl.command]) break;
+   }
+   if (cmdl.command > CMD_LOADED) {
+      fprintf(err, "'%s' is not a recognized command\n", word);
+      return 1;
+   }
+   cmdl.slot = slot;
+   cmdl.drive = drive;
+   cmdl.force = false;
+
+   if (lock_daemon_command_mutex(command_is_read_only(), err)) {
+      if (errno == ETIMEDOUT) return VCHANGERD_BUSY;
+      fprintf(err, "ERROR! failed to lock named mutex errno=%d\n", errno);
+      return 1;
+   }
+   rc = perform_command(out, err);
+   myrwlock_unlock(daemon_command_mux);
+   return rc;
+}
+
+
+
+/*-------------------------------------------------
+ *  Function to plan the initialization of the changer for the command
+ *  given on the command line. Read-only commands are served from the saved
+ *  changer state, reading only what they need: SLOTS needs the number of
+ *  slots, LOADED the state of one drive, and the list commands all labels
+ *  and drives. All other commands, and the changer daemon, need the full
+ *  initialization, which updates the saved state.
+ *------------------------------------------------*/
+static int init_scope()
+{
+   if (cmdl.daemon || !command_is_read_only()) return CHANGER_INIT_FULL;
+   switch (cmdl.command) {
+   case CMD_SLOTS:
+      return CHANGER_INIT_SLOTS;
+   case CMD_LOADED:
+      return CHANGER_INIT_LOADED;
+   }
+   return CHANGER_INIT_ALL;
+}
+
+
+/*-------------------------------------------------
+ *  Function to perform the command given on the command line for the
+ *  changer defined by the config file cmdl.config_file.
+ *  Returns the exit code.
+ *------------------------------------------------*/
+static int run_changer_command()
+{
+   int rc, scope;
+   FILE *fs = NULL;
+   int32_t error_code;
+   void *command_mux = NULL;
+   tString req;
 
    /* Read vchanger config file */
    if (!conf.Read(cmdl.config_file)) {
@@ -610,125 +981,351 @@ int main(int argc, char *argv[])
    signal(SIGPIPE, SIG_IGN);
 #endif
 
+   /* If a changer daemon is running, let it perform the autochanger API commands */
+   if (!cmdl.daemon && !cmdl.rescan && cmdl.command <= CMD_LOADED) {
+      tFormat(req, "%s %d %d", autochanger_command[cmdl.command], cmdl.slot, cmdl.drive);
+      if (ForwardToChangerDaemon(req.c_str(), rc) == 0) return rc;
+   }
+
    /* Open/create named mutex */
-   command_mux = mymutex_create("vchanger-command");
+   command_mux = myrwlock_create(conf.storage_name.c_str(), "command");
    if (command_mux == 0) {
       vlog.Error("ERROR! failed to create named mutex errno=%d", errno);
       fprintf(stderr, "ERROR! failed to create named mutex errno=%d\n", errno);
       return 1;
    }
    /* Lock mutex to perform command */
-   if (mymutex_lock(command_mux, 300)) {
-      vlog.Error("ERROR! failed to lock named mutex errno=%d", errno);
+   scope = init_scope();
+   if (lock_command_mutex(command_mux, scope != CHANGER_INIT_FULL)) {
       fprintf(stderr, "ERROR! failed to lock named mutex errno=%d\n", errno);
-      mymutex_destroy("vchanger-command", command_mux);
+      myrwlock_destroy(command_mux);
       return 1;
    }
 
+   /* Serve read-only commands from the saved changer state if it is current.
+    * Otherwise exchange the shared lock for an exclusive one, as the full
+    * initialization updates the saved state. */
+   if (scope != CHANGER_INIT_FULL) {
+      rc = changer.InitializeReadOnly(scope, cmdl.drive);
+      if (rc && rc != ESTALE) {
+         vlog.Error("%s", changer.GetErrorMsg());
+         fprintf(stderr, "%s\n", changer.GetErrorMsg());
+         myrwlock_destroy(command_mux);
+         return 1;
+      }
+      if (rc == ESTALE) {
+         myrwlock_unlock(command_mux);
+         if (lock_command_mutex(command_mux, false)) {
+            fprintf(stderr, "ERROR! failed to lock named mutex errno=%d\n", errno);
+            myrwlock_destroy(command_mux);
+            return 1;
+         }
+         scope = CHANGER_INIT_FULL;
+      }
+   }
+
+   /* Have a running changer daemon re-read the changer state before its next
+    * request, which it cannot serve until this process releases the lock */
+   if (scope == CHANGER_INIT_FULL && !cmdl.daemon) NotifyChangerDaemon(VCHANGERD_REINIT);
+
    /* Initialize changer. A named mutex is created to serialize access
     * to the changer. As a result, changer initialization may block
     * for up to 30 seconds, and may fail if a timeout is reached */
-   if (changer.Initialize()) {
+   if (scope == CHANGER_INIT_FULL && changer.Initialize(cmdl.rescan)) {
       vlog.Error("%s", changer.GetErrorMsg());
       fprintf(stderr, "%s\n", changer.GetErrorMsg());
-      mymutex_destroy("vchanger-command", command_mux);
+      myrwlock_destroy(command_mux);
       return 1;
    }
 
-   /* Perform command */
-   switch (cmdl.command) {
-   case CMD_LIST:
-      vlog.Debug("==== performing LIST command");
-      error_code = do_list_cmd();
-      break;
-   case CMD_SLOTS:
-      vlog.Debug("==== performing SLOTS command");
-      error_code = do_slots_cmd();
-      break;
-   case CMD_LOAD:
-      vlog.Debug("==== performing LOAD command");
-      error_code = do_load_cmd();
-      break;
-   case CMD_UNLOAD:
-      vlog.Debug("==== performing UNLOAD command");
-      error_code = do_unload_cmd();
-      break;
-   case CMD_LOADED:
-      vlog.Debug("==== performing LOADED command");
-      error_code = do_loaded_cmd();
-      break;
-   case CMD_LISTALL:
-      vlog.Debug("==== performing LISTALL command");
-      error_code = do_list_all();
-      break;
-   case CMD_LISTMAGS:
-      vlog.Debug("==== performing LISTMAGS command");
-      error_code = do_list_magazines();
-      break;
-   case CMD_CREATEVOLS:
-      vlog.Debug("==== performing CREATEVOLS command");
-      error_code = do_create_vols();
-      break;
-   case CMD_REFRESH:
-      vlog.Debug("==== performing REFRESH command");
-      error_code = 0;
-      break;
+   /* Run as resident changer daemon until terminated */
+   if (cmdl.daemon) {
+      update_bacula();
+      myrwlock_unlock(command_mux);
+      daemon_command_mux = command_mux;
+      rc = RunChangerDaemon(do_daemon_request);
+      lock_command_mutex(command_mux, false);
+      myrwlock_destroy(command_mux);
+      return rc ? 1 : 0;
    }
 
+   /* Perform command */
+   error_code = perform_command(stdout, stderr);
+
    /* If there was an error, then exit */
    if (error_code) {
-      mymutex_destroy("vchanger-command", command_mux);
+      myrwlock_destroy(command_mux);
       return error_code;
    }
 
-   /* If not updating Bacula, then exit */
-#ifdef HAVE_WINDOWS_H
-   conf.bconsole = "";  /* Issuing bconsole commands not implemented on Windows */
-#endif
-   if (conf.bconsole.empty()) {
-      /* Bacula interaction via bconsole is disabled, so log warnings */
-      if (changer.NeedsUpdate())
-         vlog.Error("WARNING! 'update slots' needed in bconsole pid=%d", getpid());
-      if (changer.NeedsLabel())
-         vlog.Error("WARNING! 'label barcodes' needed in bconsole pid=%d", getpid());
-      mymutex_destroy("vchanger-command", command_mux);
-      return 0;
+   /* Update Bacula via bconsole if needed */
+   rc = update_bacula();
+   myrwlock_destroy(command_mux);
+   return rc;
+}
+
+
+/*-------------------------------------------------
+ *  Hotplug refresh handler
+ *  Performs the REFRESH command for the changer defined by 'config_file'
+ *  in a child process, which drops privileges to the changer's user.
+ *  Returns the exit code of the REFRESH command.
+ *------------------------------------------------*/
+static int do_hotplug_refresh(const char *config_file)
+{
+   int status;
+   pid_t pid;
+
+   fflush(NULL);
+   pid = fork();
+   if (pid < 0) {
+      vlog.Error("hotplug: errno=%d forking refresh of %s", errno, config_file);
+      return 1;
+   }
+   if (pid == 0) {
+      signal(SIGTERM, SIG_DFL);
+      signal(SIGINT, SIG_DFL);
+      signal(SIGHUP, SIG_DFL);
+      cmdl.hotplug = false;
+      cmdl.command = CMD_REFRESH;
+      cmdl.config_file = config_file;
+      status = run_changer_command();
+      fflush(NULL);
+      _exit(status);
+   }
+   while (waitpid(pid, &status, 0) < 0) {
+      if (errno != EINTR) return 1;
    }
+   if (!WIFEXITED(status)) return 1;
+   return WEXITSTATUS(status);
+}
 
-   /* Update Bacula via bconsole */
 
-   /* Create named mutex to prevent further bconsole commands when bconsole
-    * commands have already been initiated */
-   bconsole_mux = mymutex_create("vchanger-bconsole");
-   if (bconsole_mux == 0) {
+
+/*-------------------------------------------------
+ *  Function returns true if changer config 'cf' assigns a magazine by
+ *  filesystem UUID to any of the lower case UUIDs in 'uuids'.
+ *------------------------------------------------*/
+static bool uses_magazine_uuid(const VchangerConfig &cf, const tStringArray &uuids)
+{
+   size_t m, u;
+   tString uuid;
+
+   for (m = 0; m < cf.magazine.size(); m++) {
+      if (tCaseFind(cf.magazine[m], "uuid:") != 0) continue;
+      uuid = cf.magazine[m].substr(5);
+      tToLower(tStrip(uuid));
+      for (u = 0; u < uuids.size(); u++) {
+         if (uuid == uuids[u]) return true;
+      }
+   }
+   return false;
+}
+
+
+/*-------------------------------------------------
+ *  Function to open the log file of the changer configured in 'conf'
+ *  as the changer's user. Returns the log file stream, or NULL if the
+ *  changer does not log to a file or the file could not be opened.
+ *------------------------------------------------*/
+static FILE *open_changer_log()
+{
+   FILE *fs;
+
+   if (conf.logfile.empty()) return NULL;
+   if (assume_privs(conf.user.c_str(), conf.group.c_str())) return NULL;
+   fs = fopen(conf.logfile.c_str(), "a");
+   restore_privs();
+   if (fs) vlog.OpenLog(fs, conf.log_level);
+   return fs;
+}
+
+
+/*-------------------------------------------------
+ *  Function to go back to logging errors to stderr after logging to the
+ *  changer log file 'fs'.
+ *------------------------------------------------*/
+static void close_changer_log(FILE *fs)
+{
+   vlog.OpenLog(stderr, LOG_ERR);
+   if (fs) fclose(fs);
+}
+
+
+/*-------------------------------------------------
+ *  Function to perform the REFRESH command for the changer configured
+ *  in 'conf', acting as the changer's user. Bconsole requests are queued,
+ *  but the worker to issue them is left for the caller to start.
+ *  Returns the exit code.
+ *------------------------------------------------*/
+static int refresh_changer()
+{
+   int rc;
+   void *command_mux;
+
+   rc = assume_privs(conf.user.c_str(), conf.group.c_str());
+   if (rc) {
+      fprintf(stderr, "Error %d attempting to run as user '%s'\n", rc, conf.user.c_str());
+      restore_privs();
+      return 1;
+   }
+   if (!conf.Validate()) {
+      fprintf(stderr, "ERROR! configuration file error in %s\n", conf.config_file.c_str());
+      restore_privs();
+      return 1;
+   }
+   command_mux = myrwlock_create(conf.storage_name.c_str(), "command");
+   if (command_mux == 0) {
       vlog.Error("ERROR! failed to create named mutex errno=%d", errno);
       fprintf(stderr, "ERROR! failed to create named mutex errno=%d\n", errno);
-      mymutex_destroy("vchanger-command", command_mux);
+      restore_privs();
       return 1;
    }
-   /* Lock mutex to perform command */
-   if (mymutex_lock(bconsole_mux, 0)) {
-      /* If bconsole mutex is locked because another instance has previously invoked
-       * bconsole, then this instance is the result of bconsole itself invoking
-       * additional vchanger processes to handle the previous instance's bconsole
-       * command. So tto prevent a race condition, this instance must not invoke
-       * further bconsole processes.  */
-      vlog.Info("invoked from bconsole - skipping further bconsole commands", errno);
-      mymutex_destroy("vchanger-bconsole", bconsole_mux);
-      mymutex_destroy("vchanger-command", command_mux);
+   if (lock_command_mutex(command_mux, false)) {
+      fprintf(stderr, "ERROR! failed to lock named mutex errno=%d\n", errno);
+      myrwlock_destroy(command_mux);
+      restore_privs();
+      return 1;
+   }
+   NotifyChangerDaemon(VCHANGERD_REINIT);
+   if (changer.Initialize(cmdl.rescan)) {
+      vlog.Error("%s", changer.GetErrorMsg());
+      fprintf(stderr, "%s\n", changer.GetErrorMsg());
+      myrwlock_destroy(command_mux);
+      restore_privs();
+      return 1;
+   }
+   vlog.Debug("==== performing REFRESH command");
+   rc = update_bacula(false);
+   myrwlock_destroy(command_mux);
+   restore_privs();
+   return rc;
+}
+
+
+/*-------------------------------------------------
+ *  Function returns true if changers 'a' and 'b' can share a bconsole
+ *  worker, because they use the same console and run as the same user.
+ *------------------------------------------------*/
+static bool same_console(const VchangerConfig &a, const VchangerConfig &b)
+{
+   return a.user == b.user && a.group == b.group && a.bconsole == b.bconsole
+         && a.bconsole_config == b.bconsole_config && a.native_console == b.native_console;
+}
+
+
+/*-------------------------------------------------
+ *  Function to perform the REFRESH command for all changers defined by the
+ *  config files in cmdl.all_configs_dir, or if cmdl.uuids is not empty,
+ *  for only those changers having a magazine with one of the given UUIDs.
+ *  Each config file is read once, and the bconsole requests of all changers
+ *  sharing the same console are issued by one worker in a single session.
+ *  Returns the exit code.
+ *------------------------------------------------*/
+static int run_all_configs_refresh()
+{
+   int rc = 0;
+   size_t n, g;
+   FILE *fs;
+   tStringArray files;
+   std::vector<VchangerConfig> changers;
+   std::vector< std::vector<VchangerConfig> > groups;
+
+   if (ListConfigFiles(cmdl.all_configs_dir.c_str(), files)) {
+      fprintf(stderr, "Error %d reading config directory %s\n", errno, cmdl.all_configs_dir.c_str());
+      return 1;
+   }
+   /* Read each config file once, selecting the changers to refresh */
+   for (n = 0; n < files.size(); n++) {
+      VchangerConfig cf;
+      if (!cf.Read(files[n])) {
+         fprintf(stderr, "skipping config file %s\n", files[n].c_str());
+         rc = 1;
+         continue;
+      }
+      if (!cmdl.uuids.empty() && !uses_magazine_uuid(cf, cmdl.uuids)) continue;
+      cf.config_file = files[n];
+      /* User:group from cmdline overrides config file values */
+      if (cmdl.runas_user.size()) cf.user = cmdl.runas_user;
+      if (cmdl.runas_group.size()) cf.group = cmdl.runas_group;
+      changers.push_back(cf);
+   }
+#ifndef HAVE_WINDOWS_H
+   /* Ignore SIGPIPE signals */
+   signal(SIGPIPE, SIG_IGN);
+#endif
+
+   /* Refresh each changer, queueing its bconsole requests */
+   for (n = 0; n < changers.size(); n++) {
+      conf = changers[n];
+      fs = open_changer_log();
+      if (refresh_changer()) {
+         rc = 1;
+         close_changer_log(fs);
+         continue;
+      }
+      close_changer_log(fs);
+      if (conf.bconsole.empty()) continue;
+      if (!changer.NeedsUpdate() && !changer.NeedsLabel() && !cmdl.force) continue;
+      for (g = 0; g < groups.size(); g++) {
+         if (same_console(groups[g][0], conf)) break;
+      }
+      if (g == groups.size()) groups.push_back(std::vector<VchangerConfig>());
+      groups[g].push_back(conf);
+   }
+
+   /* Start one bconsole worker for each group of changers sharing a console */
+   for (g = 0; g < groups.size(); g++) {
+      conf = groups[g][0];
+      fs = open_changer_log();
+      vlog.Info("issuing bconsole requests of %d changers in one session", (int)groups[g].size());
+      StartBconsoleWorker(groups[g]);
+      close_changer_log(fs);
+   }
+   return rc;
+}
+
+
+/* -------------  Main  -------------------------*/
+
+int main(int argc, char *argv[])
+{
+   int rc;
+
+#ifdef HAVE_LOCALE_H
+   setlocale(LC_ALL, "");
+#endif
+
+   /* Log initially to stderr */
+   vlog.OpenLog(stderr, LOG_ERR);
+   /* parse the command line */
+   if (parse_cmdline(argc, argv) != 0) {
+      print_help();
+      return 1;
+   }
+   /* Check for --version flag */
+   if (cmdl.print_version) {
+      print_version();
+      return 0;
+   }
+   /* Check for --help flag */
+   if (cmdl.print_help) {
+      print_help();
       return 0;
    }
 
-   /* Unlock the command mutex long enough to issue bconsole commands.
-    * Note that the bconsole mutex is left locked to prevent a race condition
-    * should the invoked bconsole process need to invoke additional
-    * instances of vchanger. */
-   mymutex_unlock(command_mux);
-   IssueBconsoleCommands(changer.NeedsUpdate() | cmdl.force, changer.NeedsLabel());
-   mymutex_lock(command_mux, 300);
+   /* Run as hotplug listener until terminated */
+   if (cmdl.hotplug) {
+      vlog.OpenLog(stderr, LOG_INFO);
+#ifndef HAVE_WINDOWS_H
+      signal(SIGPIPE, SIG_IGN);
+#endif
+      rc = RunHotplugListener(cmdl.hotplug_opts, do_hotplug_refresh);
+      return rc ? 1 : 0;
+   }
 
-   /* Cleanup */
-   mymutex_destroy("vchanger-bconsole", command_mux);
-   mymutex_destroy("vchanger-command", bconsole_mux);
-   return 0;
+   /* Refresh the changers of all config files in a directory */
+   if (!cmdl.all_configs_dir.empty()) return run_all_configs_refresh();
+
+   return run_changer_command();
 }
@@ -0,0 +1,398 @@
+/* vchangerd.cpp
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2020 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+ *
+ *  Provides the resident changer daemon (vchangerd mode), which keeps the
+ *  changer state in memory and answers autochanger commands over a UNIX
+ *  domain socket in the work directory, and the client side used by
+ *  vchanger to forward commands to it.
+ *
+ *  The protocol is a single request line per connection, of the form
+ *  "command slot drive\n". The reply is a header line "rc outlen errlen\n"
+ *  followed by 'outlen' bytes of stdout text and 'errlen' bytes of stderr
+ *  text, after which the daemon closes the connection.
+ */
+
+#include "config.h"
+#include "compat_defs.h"
+#ifdef HAVE_STDIO_H
+#include <stdio.h>
+#endif
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SIGNAL_H
+#include <signal.h>
+#endif
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifndef HAVE_WINDOWS_H
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "loghandler.h"
+#include "vconf.h"
+#include "vchangerd.h"
+
+#ifndef HAVE_WINDOWS_H
+
+static volatile sig_atomic_t daemon_stop = 0;
+static volatile sig_atomic_t daemon_reinit = 0;
+
+static void daemon_signal(int sig)
+{
+   if (sig == SIGHUP) daemon_reinit = 1;
+   else daemon_stop = 1;
+}
+
+
+/*
+ *  Function to build the address of the daemon's socket in the work directory.
+ *  On success returns zero, else returns ENAMETOOLONG.
+ */
+static int daemon_sockaddr(struct sockaddr_un &addr)
+{
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if ((size_t)snprintf(addr.sun_path, sizeof(addr.sun_path), "%s%s%s", conf.work_dir.c_str(),
+            DIR_DELIM, VCHANGERD_SOCKET) >= sizeof(addr.sun_path)) {
+      return ENAMETOOLONG;
+   }
+   return 0;
+}
+
+
+/*
+ *  Function to set send and receive timeouts on a socket
+ */
+static void set_socket_timeout(int fd, int sec)
+{
+   struct timeval tv;
+   tv.tv_sec = sec;
+   tv.tv_usec = 0;
+   setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+   setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+
+/*
+ *  Function to write a buffer completely to a socket.
+ *  On success returns zero, else returns errno.
+ */
+static int write_all(int fd, const char *buf, size_t len)
+{
+   ssize_t rc;
+   while (len) {
+      rc = write(fd, buf, len);
+      if (rc < 0) {
+         if (errno == EINTR) continue;
+         return errno;
+      }
+      buf += rc;
+      len -= rc;
+   }
+   return 0;
+}
+
+
+/*
+ *  Function to open a connection to the daemon's socket.
+ *  On success returns the connected socket, else returns -1 and sets errno.
+ */
+static int connect_daemon()
+{
+   int fd, rc;
+   struct sockaddr_un addr;
+
+   if ((rc = daemon_sockaddr(addr)) != 0) {
+      errno = rc;
+      return -1;
+   }
+   fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0) return -1;
+   if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+      rc = errno;
+      close(fd);
+      errno = rc;
+      return -1;
+   }
+   return fd;
+}
+
+
+/*
+ *  Function to read a request line from a client connection and pass it
+ *  to the handler, then send the reply back to the client.
+ */
+static void serve_request(int fd, ChangerDaemonHandler handler)
+{
+   int rc;
+   ssize_t n;
+   size_t len = 0, out_len = 0, err_len = 0;
+   char req[1024], hdr[64], *out_buf = NULL, *err_buf = NULL;
+   FILE *out, *err;
+
+   /* Read request line */
+   set_socket_timeout(fd, 10);
+   while (len < sizeof(req) - 1) {
+      n = read(fd, req + len, sizeof(req) - 1 - len);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      len += n;
+      if (memchr(req, '\n', len)) break;
+   }
+   req[len] = 0;
+   if (!len || !strchr(req, '\n')) {
+      vlog.Error("vchangerd: discarding incomplete request");
+      return;
+   }
+   *strchr(req, '\n') = 0;
+   vlog.Debug("vchangerd: request '%s'", req);
+
+   /* Perform request, capturing its output */
+   out = open_memstream(&out_buf, &out_len);
+   err = open_memstream(&err_buf, &err_len);
+   if (!out || !err) {
+      vlog.Error("vchangerd: out of memory");
+      if (out) fclose(out);
+      if (err) fclose(err);
+      free(out_buf);
+      free(err_buf);
+      return;
+   }
+   rc = handler(req, out, err);
+   fclose(out);
+   fclose(err);
+
+   /* Send reply */
+   set_socket_timeout(fd, 30);
+   snprintf(hdr, sizeof(hdr), "%d %lu %lu\n", rc, (unsigned long)out_len, (unsigned long)err_len);
+   if (write_all(fd, hdr, strlen(hdr)) || write_all(fd, out_buf, out_len)
+         || write_all(fd, err_buf, err_len)) {
+      vlog.Error("vchangerd: errno=%d sending reply to client", errno);
+   }
+   free(out_buf);
+   free(err_buf);
+}
+
+
+/*
+ *  Function to run the changer daemon. Listens on a UNIX domain socket in
+ *  the work directory and passes each request received to 'handler' until
+ *  terminated by SIGTERM or SIGINT. SIGHUP causes the changer state to be
+ *  re-initialized before the next request.
+ *  Returns zero on normal termination, else returns errno.
+ */
+int RunChangerDaemon(ChangerDaemonHandler handler)
+{
+   int fd, cfd, rc;
+   mode_t old_mask;
+   struct sockaddr_un addr;
+   struct sigaction sa;
+   char req[32];
+   FILE *nul;
+
+   if ((rc = daemon_sockaddr(addr)) != 0) {
+      vlog.Error("vchangerd: socket path in work directory is too long");
+      return rc;
+   }
+   /* Refuse to start if another daemon is already serving this changer */
+   cfd = connect_daemon();
+   if (cfd >= 0) {
+      close(cfd);
+      vlog.Error("vchangerd: daemon already running for %s", conf.storage_name.c_str());
+      return EEXIST;
+   }
+   unlink(addr.sun_path);
+
+   /* Create listening socket accessible only to user and group */
+   fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0) {
+      rc = errno;
+      vlog.Error("vchangerd: errno=%d creating socket", rc);
+      return rc;
+   }
+   old_mask = umask(007);
+   if (bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+      rc = errno;
+      umask(old_mask);
+      close(fd);
+      vlog.Error("vchangerd: errno=%d binding socket %s", rc, addr.sun_path);
+      return rc;
+   }
+   umask(old_mask);
+   if (listen(fd, 16)) {
+      rc = errno;
+      close(fd);
+      unlink(addr.sun_path);
+      vlog.Error("vchangerd: errno=%d listening on socket %s", rc, addr.sun_path);
+      return rc;
+   }
+
+   /* Signals interrupt accept() rather than restarting it */
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = daemon_signal;
+   sigemptyset(&sa.sa_mask);
+   sa.sa_flags = 0;
+   sigaction(SIGTERM, &sa, NULL);
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGHUP, &sa, NULL);
+
+   vlog.Notice("vchangerd: listening on %s pid=%d", addr.sun_path, getpid());
+   while (!daemon_stop) {
+      if (daemon_reinit) {
+         daemon_reinit = 0;
+         nul = fopen("/dev/null", "w");
+         if (nul) {
+            strncpy(req, VCHANGERD_REINIT, sizeof(req));
+            handler(req, nul, nul);
+            fclose(nul);
+         }
+      }
+      cfd = accept(fd, NULL, NULL);
+      if (cfd < 0) {
+         if (errno == EINTR || errno == ECONNABORTED) continue;
+         rc = errno;
+         vlog.Error("vchangerd: errno=%d accepting connection", rc);
+         break;
+      }
+      serve_request(cfd, handler);
+      close(cfd);
+   }
+   close(fd);
+   unlink(addr.sun_path);
+   vlog.Notice("vchangerd: terminated pid=%d", getpid());
+   return 0;
+}
+
+
+/*
+ *  Function to forward a request to the changer daemon and copy its reply
+ *  to stdout and stderr. The exit code returned by the daemon is placed
+ *  in 'result'.
+ *  Returns zero if the request was handled by the daemon, or negative if
+ *  the daemon is not running, is busy, or the request could not be
+ *  completed, in which case the caller should perform the command itself.
+ */
+int ForwardToChangerDaemon(const char *request, int &result)
+{
+   int fd;
+   ssize_t n;
+   size_t p;
+   unsigned long out_len, err_len;
+   tString reply;
+   char buf[4096];
+
+   fd = connect_daemon();
+   if (fd < 0) return -1;  /* not running */
+   /* Daemon may first serve other clients, each waiting briefly for the lock */
+   set_socket_timeout(fd, 330);
+   tString req(request);
+   req += "\n";
+   if (write_all(fd, req.c_str(), req.size())) {
+      vlog.Error("errno=%d sending request to vchangerd", errno);
+      close(fd);
+      return -1;
+   }
+   shutdown(fd, SHUT_WR);
+   for (;;) {
+      n = read(fd, buf, sizeof(buf));
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      reply.append(buf, n);
+   }
+   close(fd);
+   p = reply.find('\n');
+   if (p == tString::npos || sscanf(reply.c_str(), "%d %lu %lu", &result, &out_len, &err_len) != 3
+         || reply.size() != p + 1 + out_len + err_len) {
+      vlog.Error("incomplete reply from vchangerd");
+      return -1;
+   }
+   if (result == VCHANGERD_BUSY) {
+      vlog.Info("vchangerd busy, performing request '%s' in this process", request);
+      return -1;
+   }
+   fwrite(reply.data() + p + 1, 1, out_len, stdout);
+   fwrite(reply.data() + p + 1 + out_len, 1, err_len, stderr);
+   vlog.Debug("request '%s' handled by vchangerd rc=%d", request, result);
+   return 0;
+}
+
+
+/*
+ *  Function to send a request to the changer daemon, if it is running,
+ *  discarding any output.
+ */
+void NotifyChangerDaemon(const char *request)
+{
+   int fd;
+   char buf[256];
+   tString req(request);
+
+   fd = connect_daemon();
+   if (fd < 0) return;
+   set_socket_timeout(fd, 330);
+   req += "\n";
+   if (write_all(fd, req.c_str(), req.size()) == 0) {
+      shutdown(fd, SHUT_WR);
+      while (read(fd, buf, sizeof(buf)) > 0) ;
+      vlog.Info("notified vchangerd: %s", request);
+   }
+   close(fd);
+}
+
+#else
+/*
+ *  The changer daemon is not currently supported on Windows
+ */
+int RunChangerDaemon(ChangerDaemonHandler handler)
+{
+   vlog.Error("daemon mode is not supported on this platform");
+   return ENOSYS;
+}
+
+int ForwardToChangerDaemon(const char *request, int &result)
+{
+   return -1;
+}
+
+void NotifyChangerDaemon(const char *request)
+{
+   return;
+}
+#endif
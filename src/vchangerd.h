@@ -0,0 +1,45 @@
+/*  vchangerd.h
+ *
+ *  This file is part of vchanger by Josh Fisher.
+ *
+ *  vchanger copyright (C) 2008-2020 Josh Fisher
+ *
+ *  vchanger is free software.
+ *  You may redistribute it and/or modify it under the terms of the
+ *  GNU General Public License version 2, as published by the Free
+ *  Software Foundation.
+ *
+ *  vchanger is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vchanger.  See the file "COPYING".  If not,
+ *  write to:  The Free Software Foundation, Inc.,
+ *             59 Temple Place - Suite 330,
+ *             Boston,  MA  02111-1307, USA.
+*/
+
+#ifndef VCHANGERD_H_
+#define VCHANGERD_H_
+
+#include <stdio.h>
+
+#define VCHANGERD_SOCKET "vchangerd.sock"
+#define VCHANGERD_REINIT "reinit"
+/* Seconds the daemon waits for the changer's command lock */
+#define VCHANGERD_LOCK_WAIT 5
+/* Exit code by which the daemon tells the client to perform the command itself */
+#define VCHANGERD_BUSY -1
+
+/* Handler called by the daemon for each request line received. Output
+ * that would normally go to stdout and stderr is written to 'out' and 'err'.
+ * Returns the exit code the client should return. */
+typedef int (*ChangerDaemonHandler)(const char *request, FILE *out, FILE *err);
+
+int RunChangerDaemon(ChangerDaemonHandler handler);
+int ForwardToChangerDaemon(const char *request, int &result);
+void NotifyChangerDaemon(const char *request);
+
+#endif /* VCHANGERD_H_ */
@@ -74,7 +74,12 @@
 #define VK_GROUP "group"
 #define VK_BCONSOLE "bconsole"
 #define VK_BCONSOLE_CONFIG "bconsole config"
+#define VK_BCONSOLE_DELAY "bconsole delay"
+#define VK_NATIVE_CONSOLE "native console"
 #define VK_DEF_POOL "default pool"
+#define VK_JOURNAL_SYNC "journal sync"
+#define VK_JOURNAL_GROUP "journal group"
+#define VK_JOURNAL_CHECKPOINT "journal checkpoint"
 
 
 /*================================================
@@ -84,7 +89,9 @@
 /*--------------------------------------------------
  * Default constructor
  *------------------------------------------------*/
-VchangerConfig::VchangerConfig() : log_level(DEFAULT_LOG_LEVEL)
+VchangerConfig::VchangerConfig() : log_level(DEFAULT_LOG_LEVEL), bconsole_delay(DEFAULT_BCONSOLE_DELAY),
+      native_console(false), journal_sync(JOURNAL_SYNC_OP), journal_group(DEFAULT_JOURNAL_GROUP),
+      journal_checkpoint(DEFAULT_JOURNAL_CHECKPOINT)
 {
 #ifdef HAVE_WINDOWS_H
    char tmp[4096];
@@ -125,8 +132,13 @@ VchangerConfig::VchangerConfig() : log_level(DEFAULT_LOG_LEVEL)
    keyword.AddKeyword(VK_GROUP, INIKEYWORDTYPE_SZ);
    keyword.AddKeyword(VK_BCONSOLE, INIKEYWORDTYPE_SZ);
    keyword.AddKeyword(VK_BCONSOLE_CONFIG, INIKEYWORDTYPE_SZ);
+   keyword.AddKeyword(VK_BCONSOLE_DELAY, INIKEYWORDTYPE_LONG);
+   keyword.AddKeyword(VK_NATIVE_CONSOLE, INIKEYWORDTYPE_BOOL);
    keyword.AddKeyword(VK_STORAGE_NAME, INIKEYWORDTYPE_SZ);
    keyword.AddKeyword(VK_DEF_POOL, INIKEYWORDTYPE_SZ);
+   keyword.AddKeyword(VK_JOURNAL_SYNC, INIKEYWORDTYPE_SZ);
+   keyword.AddKeyword(VK_JOURNAL_GROUP, INIKEYWORDTYPE_LONG);
+   keyword.AddKeyword(VK_JOURNAL_CHECKPOINT, INIKEYWORDTYPE_LONG);
 }
 
 /*-------------------------------------------------
@@ -232,6 +244,19 @@ bool VchangerConfig::Read(const char *cfile)
       tStrip(bconsole_config);
    }
 
+   /* Get seconds to wait for further bconsole requests before issuing commands */
+   if (keyword[VK_BCONSOLE_DELAY].IsSet()) {
+      bconsole_delay = (int)keyword[VK_BCONSOLE_DELAY];
+      if (bconsole_delay < 0 || bconsole_delay > 600) {
+         vlog.Error("config file keyword '%s' must specify a value between 0 and 600 inclusive",
+               VK_BCONSOLE_DELAY);
+         return false;
+      }
+   }
+
+   /* Get flag to talk to the Director directly instead of running bconsole */
+   if (keyword[VK_NATIVE_CONSOLE].IsSet()) native_console = keyword[VK_NATIVE_CONSOLE];
+
    /* Get default pool */
    if (keyword[VK_DEF_POOL].IsSet()) {
       def_pool = (const char*)keyword[VK_DEF_POOL];
@@ -242,6 +267,40 @@ bool VchangerConfig::Read(const char *cfile)
       }
    }
 
+   /* Get when the drive state journal is flushed to disk */
+   if (keyword[VK_JOURNAL_SYNC].IsSet()) {
+      tString val((const char*)keyword[VK_JOURNAL_SYNC]);
+      tStrip(val);
+      tToLower(val);
+      if (val == "none") journal_sync = JOURNAL_SYNC_NONE;
+      else if (val == "op") journal_sync = JOURNAL_SYNC_OP;
+      else if (val == "group") journal_sync = JOURNAL_SYNC_GROUP;
+      else {
+         vlog.Error("config file keyword '%s' must be one of none, op, or group", VK_JOURNAL_SYNC);
+         return false;
+      }
+   }
+
+   /* Get number of journal records flushed together when syncing by group */
+   if (keyword[VK_JOURNAL_GROUP].IsSet()) {
+      journal_group = (int)keyword[VK_JOURNAL_GROUP];
+      if (journal_group < 1 || journal_group > 1000) {
+         vlog.Error("config file keyword '%s' must specify a value between 1 and 1000 inclusive",
+               VK_JOURNAL_GROUP);
+         return false;
+      }
+   }
+
+   /* Get number of journal records after which the journal is compacted */
+   if (keyword[VK_JOURNAL_CHECKPOINT].IsSet()) {
+      journal_checkpoint = (int)keyword[VK_JOURNAL_CHECKPOINT];
+      if (journal_checkpoint < 1 || journal_checkpoint > 100000) {
+         vlog.Error("config file keyword '%s' must specify a value between 1 and 100000 inclusive",
+               VK_JOURNAL_CHECKPOINT);
+         return false;
+      }
+   }
+
    /* Get list of assigned magazines */
    if (keyword[VK_MAGAZINE].IsSet()) {
       magazine = keyword[VK_MAGAZINE];
@@ -299,6 +358,11 @@ bool VchangerConfig::Validate()
          bconsole_config.clear();
       }
    }
+   /* The native console reads the Director's address from the bconsole config */
+   if (native_console && !bconsole.empty() && bconsole_config.empty()) {
+      vlog.Warning("'%s' requires '%s'. Using bconsole.", VK_NATIVE_CONSOLE, VK_BCONSOLE_CONFIG);
+      native_console = false;
+   }
 
    return true;
 }
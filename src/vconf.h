@@ -32,6 +32,14 @@
 #define DEFAULT_BCONSOLE "/usr/sbin/bconsole"
 #define DEFAULT_STORAGE_NAME "vchanger"
 #define DEFAULT_POOL "Scratch"
+#define DEFAULT_BCONSOLE_DELAY 3
+#define DEFAULT_JOURNAL_GROUP 8
+#define DEFAULT_JOURNAL_CHECKPOINT 64
+
+/* Values of the Journal Sync keyword */
+#define JOURNAL_SYNC_NONE 0
+#define JOURNAL_SYNC_OP 1
+#define JOURNAL_SYNC_GROUP 2
 
 /* Configuration values */
 
@@ -47,6 +55,11 @@ public:
    tString group;
    tString bconsole;
    tString bconsole_config;
+   int bconsole_delay;
+   bool native_console;
+   int journal_sync;
+   int journal_group;
+   int journal_checkpoint;
    tString storage_name;
    tString def_pool;
    tStringArray magazine;